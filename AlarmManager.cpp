@@ -0,0 +1,321 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "AlarmManager.h"
+#include "BatteryManager.h"
+#include "TelemetryPipeline.h"
+
+AlarmManager *AlarmManager::m_instance = NULL;
+
+/**
+ * The alarm rules. Mask rules raise on the first frame with the bit set since the
+ * BMS has already done its own filtering. Threshold rules want a couple of frames
+ * in a row either way so a single noisy reading doesn't flap the alarm.
+ */
+static const alarmRule_t alarmRules[] = {
+  { "cell_high_voltage", ALARM_RULE_STATUS_MASK, LIFE_CELL_HIGH_VOLTAGE, 0, 1 },
+  { "cell_low_voltage", ALARM_RULE_STATUS_MASK, LIFE_CELL_LOW_VOLTAGE, 0, 1 },
+  { "over_current_when_charge", ALARM_RULE_STATUS_MASK, LIFE_OVER_CURRENT_WHEN_CHARGE, 0, 1 },
+  { "over_current_when_discharge", ALARM_RULE_STATUS_MASK, LIFE_OVER_CURRENT_WHEN_DISCHARGE, 0, 1 },
+  { "low_temp_when_discharge", ALARM_RULE_STATUS_MASK, LIFE_LOW_TEMP_WHEN_DISCHARGE, 0, 1 },
+  { "low_temp_when_charge", ALARM_RULE_STATUS_MASK, LIFE_LOW_TEMP_WHEN_CHARGE, 0, 1 },
+  { "high_temp_when_discharge", ALARM_RULE_STATUS_MASK, LIFE_HIGH_TEMP_WHEN_DISCHARGE, 0, 1 },
+  { "high_temp_when_charge", ALARM_RULE_STATUS_MASK, LIFE_HIGH_TEMP_WHEN_CHARGE, 0, 1 },
+  { "short_circuited", ALARM_RULE_AFE_MASK, LIFE_SHORT_CIRCUITED, 0, 1 },
+  { "cell_over_voltage", ALARM_RULE_CELL_HIGH, ALARM_CELL_HIGH_MV, ALARM_CELL_HIGH_CLEAR_MV, 2 },
+  { "cell_under_voltage", ALARM_RULE_CELL_LOW, ALARM_CELL_LOW_MV, ALARM_CELL_LOW_CLEAR_MV, 2 },
+  { "over_temperature", ALARM_RULE_TEMP_HIGH, ALARM_TEMP_HIGH, ALARM_TEMP_HIGH_CLEAR, 2 },
+  { "under_temperature", ALARM_RULE_TEMP_LOW, ALARM_TEMP_LOW, ALARM_TEMP_LOW_CLEAR, 2 },
+  { "cell_imbalance", ALARM_RULE_IMBALANCE, ALARM_IMBALANCE_MV, ALARM_IMBALANCE_CLEAR_MV, 3 }
+};
+
+#define ALARM_RULE_COUNT (sizeof(alarmRules) / sizeof(alarmRules[0]))
+
+static_assert(ALARM_RULE_COUNT <= ALARM_MAX_RULES, "Too many alarm rules for alarmState_t");
+
+AlarmManager *AlarmManager::instance()
+{
+  if(!m_instance) {
+    m_instance = new AlarmManager();
+  }
+
+  return m_instance;
+}
+
+AlarmManager::AlarmManager()
+{
+  signal = xSemaphoreCreateBinary();
+}
+
+/**
+ * Runs every rule against the battery's freshly decoded frame. This is called from
+ * processBuffer() after the bank aggregates are updated, so the battery's min / max
+ * cell are already worked out for us in battery->bank. If cells is false the frame's
+ * cells couldn't be decoded, and the cell rules are left as they were.
+ */
+void AlarmManager::evaluate(batteryInfo_t *battery, bool cells)
+{
+  alarmState_t *state = &battery->alarms;
+  const alarmRule_t *rule;
+  alarmEvent_t event;
+  bool wasActive;
+  int32_t value;
+
+  state->changed = 0;
+
+  for(uint8_t i = 0; i < ALARM_RULE_COUNT; i++) {
+    rule = &alarmRules[i];
+
+    if(!cells && isCellRule(rule)) {
+      continue;
+    }
+
+    wasActive = state->active & (1UL << i);
+    value = getRuleValue(rule, battery);
+
+    if(ruleTriggered(rule, value, wasActive) == wasActive) {
+      state->pending[i] = 0;
+      continue;
+    }
+
+    if(++state->pending[i] < rule->debounce) {
+      continue;
+    }
+
+    state->pending[i] = 0;
+    state->active ^= (1UL << i);
+    state->changed |= (1UL << i);
+
+    event.battery = battery;
+    event.rule = i;
+    event.active = !wasActive;
+    event.value = value;
+    event.timestamp = millis();
+
+    Serial.printf("- Alarm '%s' %s on %s (%d)\n", rule->name, event.active ? "raised" : "cleared", battery->id, value);
+
+    portENTER_CRITICAL(&mux);
+
+    if(queue.isFull()) {
+      resync = true; // push() is about to drop the oldest transition
+    }
+
+    queue.push(event);
+
+    portEXIT_CRITICAL(&mux);
+
+    xSemaphoreGive(signal);
+  }
+}
+
+/**
+ * The value a rule looks at in the battery's last frame
+ */
+int32_t AlarmManager::getRuleValue(const alarmRule_t *rule, batteryInfo_t *battery)
+{
+  switch(rule->type) {
+    case ALARM_RULE_STATUS_MASK:
+      return battery->status & rule->trigger;
+    case ALARM_RULE_AFE_MASK:
+      return battery->afeStatus & rule->trigger;
+    case ALARM_RULE_CELL_HIGH:
+      return battery->bank.maxCell;
+    case ALARM_RULE_CELL_LOW:
+      return battery->bank.minCell;
+    case ALARM_RULE_TEMP_HIGH:
+    case ALARM_RULE_TEMP_LOW:
+      return (int16_t)battery->temp; // below 0C this has wrapped around in the uint16_t
+    case ALARM_RULE_IMBALANCE:
+      return battery->bank.maxCell - battery->bank.minCell;
+  }
+
+  return 0;
+}
+
+/**
+ * The value a rule looked at in the frame the snapshot was taken from, for sinks
+ * reporting alarmsChanged after the battery has moved on
+ */
+int32_t AlarmManager::getRuleValue(const alarmRule_t *rule, const telemetrySnapshot_t *snapshot)
+{
+  switch(rule->type) {
+    case ALARM_RULE_STATUS_MASK:
+      return snapshot->status & rule->trigger;
+    case ALARM_RULE_AFE_MASK:
+      return snapshot->afeStatus & rule->trigger;
+    case ALARM_RULE_CELL_HIGH:
+      return snapshot->maxCell;
+    case ALARM_RULE_CELL_LOW:
+      return snapshot->minCell;
+    case ALARM_RULE_TEMP_HIGH:
+    case ALARM_RULE_TEMP_LOW:
+      return (int16_t)snapshot->temp;
+    case ALARM_RULE_IMBALANCE:
+      return snapshot->maxCell - snapshot->minCell;
+  }
+
+  return 0;
+}
+
+bool AlarmManager::isCellRule(const alarmRule_t *rule)
+{
+  return (rule->type == ALARM_RULE_CELL_HIGH) || (rule->type == ALARM_RULE_CELL_LOW) ||
+         (rule->type == ALARM_RULE_IMBALANCE);
+}
+
+/**
+ * Whether the rule is tripped by value. Threshold rules have to go past trigger to
+ * raise but then stay raised until they come back past clear (hysteresis), so
+ * which threshold applies depends on whether the alarm is already active.
+ */
+bool AlarmManager::ruleTriggered(const alarmRule_t *rule, int32_t value, bool active)
+{
+  switch(rule->type) {
+    case ALARM_RULE_STATUS_MASK:
+    case ALARM_RULE_AFE_MASK:
+      return value != 0;
+    case ALARM_RULE_CELL_HIGH:
+    case ALARM_RULE_TEMP_HIGH:
+    case ALARM_RULE_IMBALANCE:
+      return active ? (value >= rule->clear) : (value >= rule->trigger);
+    case ALARM_RULE_CELL_LOW:
+    case ALARM_RULE_TEMP_LOW:
+      return active ? (value <= rule->clear) : (value <= rule->trigger);
+  }
+
+  return false;
+}
+
+bool AlarmManager::hasPending()
+{
+  bool pending;
+
+  portENTER_CRITICAL(&mux);
+  pending = !queue.isEmpty();
+  portEXIT_CRITICAL(&mux);
+
+  return pending;
+}
+
+/**
+ * Copies the oldest transition into event without removing it, so it can stay
+ * queued if the publish fails. Call shift() once it's been published.
+ */
+bool AlarmManager::peek(alarmEvent_t *event)
+{
+  bool found = false;
+
+  portENTER_CRITICAL(&mux);
+
+  if(!queue.isEmpty()) {
+    *event = queue.first();
+    found = true;
+  }
+
+  portEXIT_CRITICAL(&mux);
+
+  return found;
+}
+
+void AlarmManager::shift()
+{
+  portENTER_CRITICAL(&mux);
+
+  if(!queue.isEmpty()) {
+    queue.shift();
+  }
+
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Blocks for up to timeout ms, returning as soon as a transition is queued. Use
+ * this in place of delay() anywhere an alarm shouldn't have to wait. While the
+ * transitions can't be delivered (see setDeliverable()) the ones already queued
+ * don't cut the wait short, otherwise every wait would return straight away.
+ */
+bool AlarmManager::waitForPending(uint32_t timeout)
+{
+  // Throw away a wake up for a transition that has already been dealt with
+  xSemaphoreTake(signal, 0);
+
+  if(deliverable && hasPending()) {
+    return true;
+  }
+
+  xSemaphoreTake(signal, pdMS_TO_TICKS(timeout));
+
+  return hasPending();
+}
+
+/**
+ * Whoever publishes the transitions says whether they can right now (e.g. MQTT
+ * is connected)
+ */
+void AlarmManager::setDeliverable(bool canDeliver)
+{
+  deliverable = canDeliver;
+}
+
+/**
+ * True if transitions have been lost because the queue overflowed, in which case
+ * the current state of every alarm needs publishing again.
+ */
+bool AlarmManager::needsResync()
+{
+  return resync;
+}
+
+void AlarmManager::clearResync()
+{
+  portENTER_CRITICAL(&mux);
+  resync = false;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Puts back the alarm state a battery had before a deep sleep, so debounces carry
+ * on counting across wakes and active alarms stay active (and can clear) rather
+ * than raising again on the first frame. If lost is set transitions were still
+ * queued when we went to sleep, those are gone so every alarm gets resynced.
+ */
+void AlarmManager::restore(batteryInfo_t *battery, const alarmState_t *state, bool lost)
+{
+  battery->alarms = *state;
+  battery->alarms.changed = 0;
+
+  if(lost) {
+    portENTER_CRITICAL(&mux);
+    resync = true;
+    portEXIT_CRITICAL(&mux);
+  }
+}
+
+uint8_t AlarmManager::getTotalRules()
+{
+  return ALARM_RULE_COUNT;
+}
+
+const alarmRule_t *AlarmManager::getRule(uint8_t rule)
+{
+  return (rule < ALARM_RULE_COUNT) ? &alarmRules[rule] : NULL;
+}
@@ -0,0 +1,154 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFEALARMMGR_H_
+#define LIFEALARMMGR_H_
+
+#include "Arduino.h"
+#include <CircularBuffer.h>
+
+/**
+ * Default thresholds for the threshold alarms, each with the value it has to get
+ * back past before it clears (hysteresis). Voltages are in mV, temperatures in
+ * tenths of a degree C.
+ */
+#ifndef ALARM_CELL_HIGH_MV
+#define ALARM_CELL_HIGH_MV 3650
+#define ALARM_CELL_HIGH_CLEAR_MV 3550
+#endif
+
+#ifndef ALARM_CELL_LOW_MV
+#define ALARM_CELL_LOW_MV 2800
+#define ALARM_CELL_LOW_CLEAR_MV 2950
+#endif
+
+#ifndef ALARM_TEMP_HIGH
+#define ALARM_TEMP_HIGH 550
+#define ALARM_TEMP_HIGH_CLEAR 500
+#endif
+
+#ifndef ALARM_TEMP_LOW
+#define ALARM_TEMP_LOW 0
+#define ALARM_TEMP_LOW_CLEAR 30
+#endif
+
+#ifndef ALARM_IMBALANCE_MV
+#define ALARM_IMBALANCE_MV 100
+#define ALARM_IMBALANCE_CLEAR_MV 60
+#endif
+
+#ifndef ALARM_QUEUE_SIZE
+#define ALARM_QUEUE_SIZE 32
+#endif
+
+#define ALARM_MAX_RULES 32
+
+enum alarmRuleType_t {
+  ALARM_RULE_STATUS_MASK = 0, // any of the bits in trigger set in status
+  ALARM_RULE_AFE_MASK, // any of the bits in trigger set in afeStatus
+  ALARM_RULE_CELL_HIGH, // highest cell above trigger, clears below clear
+  ALARM_RULE_CELL_LOW, // lowest cell below trigger, clears above clear
+  ALARM_RULE_TEMP_HIGH,
+  ALARM_RULE_TEMP_LOW,
+  ALARM_RULE_IMBALANCE // highest minus lowest cell above trigger, clears below clear
+};
+
+struct alarmRule_t {
+  const char *name;
+  alarmRuleType_t type;
+  int32_t trigger;
+  int32_t clear;
+  uint8_t debounce; // consecutive frames that have to agree before the alarm raises or clears
+};
+
+/**
+ * Per battery alarm state, lives in batteryInfo_t
+ */
+struct alarmState_t {
+  uint32_t active; // bit per rule
+  uint32_t changed; // the bits in active that flipped on the last frame evaluated
+  uint8_t pending[ALARM_MAX_RULES]; // consecutive frames disagreeing with the active bit
+};
+
+struct batteryInfo_t;
+struct telemetrySnapshot_t;
+
+/**
+ * A single alarm raising or clearing
+ */
+struct alarmEvent_t {
+  batteryInfo_t *battery;
+  uint8_t rule;
+  bool active;
+  int32_t value; // the value that caused the transition
+  uint32_t timestamp; // millis() when it was detected
+};
+
+/**
+ * Table driven alarm engine. Every rule is checked against every frame as soon as
+ * it's decoded (so from the BLE task), and when an alarm raises or clears the
+ * transition is put on a queue for the main loop to publish ahead of anything
+ * else. Anyone waiting in waitForPending() is woken straight away.
+ */
+class AlarmManager
+{
+
+public:
+  void evaluate(batteryInfo_t *, bool);
+
+  bool hasPending();
+  bool peek(alarmEvent_t *);
+  void shift();
+  bool waitForPending(uint32_t);
+  void setDeliverable(bool);
+
+  bool needsResync();
+  void clearResync();
+
+  void restore(batteryInfo_t *, const alarmState_t *, bool);
+
+  uint8_t getTotalRules();
+  const alarmRule_t *getRule(uint8_t);
+  int32_t getRuleValue(const alarmRule_t *, batteryInfo_t *);
+  int32_t getRuleValue(const alarmRule_t *, const telemetrySnapshot_t *);
+
+  static AlarmManager *instance();
+
+private:
+  AlarmManager();
+  AlarmManager(AlarmManager const &) {};
+  AlarmManager& operator=(AlarmManager const &) { return *this; };
+
+  bool ruleTriggered(const alarmRule_t *, int32_t, bool);
+  bool isCellRule(const alarmRule_t *);
+
+  CircularBuffer<alarmEvent_t, ALARM_QUEUE_SIZE> queue;
+  bool resync = false; // set when the queue overflowed and events were lost
+  volatile bool deliverable = true; // false while queued transitions can't be published
+
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  SemaphoreHandle_t signal;
+
+  static AlarmManager *m_instance;
+};
+
+#endif
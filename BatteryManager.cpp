@@ -21,7 +21,12 @@
 */
 
 #include "BatteryManager.h"
+#include "FrameCapture.h"
+#include "HeapMonitor.h"
+#include "CommandManager.h"
+#include "TelemetryPipeline.h"
 #include "lifeblue.h"
+#include "hex_dump.h"
 
 //#define DUMP_HEX_BATTERY_BUFFER  // Comment this out to stop outputting the buffer in hex / ascii -- JR
 
@@ -31,19 +36,18 @@ extern "C" {
    * This callback is what is called when the battery we are connected to sends use a Bluetooth Notification
    * via the proper characteristic. Each notification is only a fragment of the total data packet.
    * 
-   * So what we have to do here is store the data as it comes in as chuncks until we hit the magic 0x87
-   * character. This character indicates the start of the data stream and we know we've captured a full packet!
+   * So what we have to do here is store the data as it comes in as chuncks until we have a whole frame,
+   * BatteryManager::receive() works out where the frames start and end.
    * 
-   * Although it's probably not strictly necessary and a bit of a resource waste, this implementation uses
-   * a separate buffer for each battery. I may refactor it someday to use a single buffer since we never maintain
-   * a connection to multiple batteries at once (I found the ESP32 BLE library pretty buggy when I tried).
+   * Every battery's buffer is the same single buffer, since we never maintain a connection to multiple
+   * batteries at once (I found the ESP32 BLE library pretty buggy when I tried) and a buffer each adds
+   * up fast on a big bank.
    * 
-   * Once we have a full packet we call processBuffer(), which extracts the data and stores it with that
+   * Once we have a full packet processBuffer() is called, which extracts the data and stores it with that
    * particular device.
    */
   void _bm_char_callback(BLERemoteCharacteristic *characteristic, uint8_t *data, size_t length, bool isNotify)
   {
-    char *stream;
     BLEClient *client;
     BatteryManager *batteryManager;
     batteryInfo_t *currentBattery;
@@ -62,37 +66,42 @@ extern "C" {
       
       return;
     }
-   
-    stream = (char *)data;
-       
-    for(int i = 0; i < length; i++) {
-        
-        currentBattery->buffer->push(stream[i]);
-        
-        if(currentBattery->buffer->first() == (char)0x87) {
-
-          currentBattery->buffer->shift(); // get rid of 0x87
-          currentBattery->characteristicHandle = 0;
-                
-          if(client->isConnected()) {
-            client->disconnect();
-          }
-
-          Serial.println("");
-          
-          batteryManager->processBuffer();
 
-#ifdef DUMP_HEX_BATTERY_BUFFER
-         hex_dump(currentBattery->buffer, 512, "Battery buffer before clear");
+#ifdef CAPTURE_BLE_FRAGMENTS
+    FrameCapture::instance()->record(BLEAddress(currentBattery->bdAddress), data, length);
 #endif
-          
-          currentBattery->buffer->clear();
-          batteryManager->setCurrentBattery(NULL);
-            
-          return;
-        }
 
+    batteryManager->recordStage(POLL_STAGE_FIRST_FRAGMENT);
+    HeapMonitor::instance()->sampleBLETask();
+
+    batteryManager->receive(data, length);
+  }
+
+  /**
+   * GAP events from the BLE stack. We only care about the connection parameters
+   * the battery we're polling ends up with, see BatteryManager::negotiateLink().
+   */
+  void _bm_gap_callback(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+  {
+    batteryInfo_t *currentBattery = BatteryManager::instance()->getCurrentBattery();
+    linkParams_t *link;
+
+    if((event != ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT) || !currentBattery ||
+       (memcmp(param->update_conn_params.bda, currentBattery->bdAddress, sizeof(esp_bd_addr_t)) != 0)) {
+      return;
+    }
+
+    link = &currentBattery->link;
+
+    if(param->update_conn_params.status != ESP_BT_STATUS_SUCCESS) {
+      Serial.printf(" - %s turned down our connection parameters\n", currentBattery->address);
+      link->intervalRefused = true;
+      return;
     }
+
+    link->interval = param->update_conn_params.conn_int;
+    link->latency = param->update_conn_params.latency;
+    link->timeout = param->update_conn_params.timeout;
   }
 }
 
@@ -102,6 +111,230 @@ extern "C" {
  */
 BatteryManager *BatteryManager::m_instance = NULL;
 
+/**
+ * Finds the frames in a notification from the current battery. A frame is every
+ * hex character between a FRAME_START and a FRAME_END, only those go in the
+ * buffer. Neither can turn up inside a frame, so wherever we come in (part way
+ * through a frame when we connect, or after fragments have been lost) the next
+ * FRAME_START is the start of a whole frame:
+ *
+ * - anything before the first FRAME_START is thrown away
+ * - a FRAME_START before the FRAME_END means the end of the last frame was lost,
+ *   what we had of it is dropped and we start again from there
+ * - anything else that isn't hex (or a frame that's too long) drops the frame,
+ *   and we wait for the next FRAME_START
+ *
+ * A frame that fails its checksum doesn't end the poll, the battery keeps sending
+ * so we wait for the next one on the same connection (see frameReceived()).
+ */
+void BatteryManager::receive(const uint8_t *data, size_t length)
+{
+  CircularBuffer<char, 512> *buffer = currentBattery->buffer;
+
+  for(size_t i = 0; i < length; i++) {
+
+    if(data[i] == FRAME_START) {
+      if(framing) {
+        Serial.println(" - Lost the end of a frame, starting again from the next one");
+        currentBattery->metrics.resyncs++;
+      }
+
+      buffer->clear();
+      framing = true;
+      continue;
+    }
+
+    if(!framing) {
+      continue;
+    }
+
+    if(data[i] == FRAME_END) {
+      framing = false;
+
+      if(frameReceived()) {
+        return; // we're done with this battery, anything left is the next frame
+      }
+
+      continue;
+    }
+
+    if(!isxdigit(data[i]) || (buffer->size() >= FRAME_MAX_LENGTH)) {
+      Serial.println(" - Garbage in frame, starting again from the next one");
+      currentBattery->metrics.resyncs++;
+      buffer->clear();
+      framing = false;
+      continue;
+    }
+
+    buffer->push((char)data[i]);
+  }
+}
+
+/**
+ * A whole frame is in the buffer. If it's good this poll is done, otherwise we
+ * stay connected for the next frame, up to FRAME_MAX_REJECTS of them. Returns
+ * true when the poll is over either way.
+ */
+bool BatteryManager::frameReceived()
+{
+  BLEClient *client = getBLEClient();
+
+  recordStage(POLL_STAGE_TERMINATOR);
+
+  // The MTU exchange has long finished by the time a whole frame is in. Nothing
+  // was asked for if the battery turned it down before, and as the client is
+  // shared what it says could be left over from the last battery.
+  if(currentBattery->link.mtu != LINK_DEFAULT_MTU) {
+    currentBattery->link.mtu = client->getMTU();
+  }
+
+#ifdef DUMP_HEX_BATTERY_BUFFER
+  dumpBuffer("Battery buffer before processing");
+#endif
+
+  if(!processBuffer()) {
+    currentBattery->buffer->clear();
+
+    if(++frameRejects < FRAME_MAX_REJECTS) {
+      Serial.println(" - Waiting for the next frame");
+      return false;
+    }
+
+    Serial.printf(" - %u bad frames in a row from %s, trying again next sweep\n", frameRejects, currentBattery->address);
+    currentBattery->metrics.timeouts++;
+  } else {
+    recordStage(POLL_STAGE_DECODE);
+    recordStage(POLL_STAGE_TOTAL);
+  }
+
+  frameRejects = 0;
+  currentBattery->characteristicHandle = 0;
+  currentBattery->buffer->clear();
+
+  if(client->isConnected()) {
+    client->disconnect();
+  }
+
+  Serial.println("");
+
+  setCurrentBattery(NULL);
+
+  return true;
+}
+
+/**
+ * Takes the cell voltages off the front of the buffer. A battery has every cell
+ * slot up to the last one that isn't 0, the rest are padding. A cell that happens
+ * to read 0 would have us count short, so the count is only settled once a frame
+ * agrees with the most any frame has shown so far. Only that many are kept, so a
+ * 4 cell battery doesn't carry a 16 cell array around.
+ *
+ * The cells array is read from other tasks, so once it's allocated it isn't
+ * resized. A battery that later reports more cells than it started with is
+ * logged and the extra cells ignored until the gateway restarts. Returns false if
+ * the battery's cells couldn't be stored, or the frame has fewer slots than the
+ * battery has cells, in which case the cells from the last frame are left alone.
+ */
+bool BatteryManager::decodeCells(uint8_t slots)
+{
+  uint16_t cells[MAX_BATTERY_CELLS] = {};
+  uint8_t found = 0;
+
+  for(int i = 0; i < slots; i++) {
+    cells[i] = convertBufferStringToValue(FRAME_CELL_LENGTH);
+
+    if(cells[i]) {
+      found = i + 1;
+    }
+  }
+
+  if(!currentBattery->cells) {
+    if(!found || (found != currentBattery->seenCells)) {
+      // Nothing to go on yet, or not confirmed, try again next frame
+      currentBattery->seenCells = (found > currentBattery->seenCells) ? found : currentBattery->seenCells;
+      return false;
+    }
+
+    if(!allocateCells(currentBattery, found)) {
+      return false;
+    }
+
+    Serial.printf("- %s has %u cells (%u slots in its frame)\n", currentBattery->address, found, slots);
+  } else if(slots < currentBattery->totalCells) {
+    Serial.printf("- FAILED: %s sent %u cell slots, it has %u cells\n", currentBattery->address, slots,
+                  currentBattery->totalCells);
+    return false;
+  } else if(found > currentBattery->totalCells) {
+    Serial.printf("- FAILED: %s now reports %u cells, it had %u, restart to pick them up\n",
+                  currentBattery->address, found, currentBattery->totalCells);
+  }
+
+  memcpy(currentBattery->cells, cells, currentBattery->totalCells * sizeof(uint16_t));
+
+  return true;
+}
+
+/**
+ * Sets aside room for a battery's cells, only ever once per battery (see
+ * decodeCells())
+ */
+bool BatteryManager::allocateCells(batteryInfo_t *battery, uint8_t totalCells)
+{
+  if(battery->cells) {
+    return false;
+  }
+
+  battery->cells = (uint16_t *)os_zalloc(totalCells * sizeof(uint16_t));
+
+  if(!battery->cells) {
+    Serial.println("- FAILED: Could not allocate cells");
+    return false;
+  }
+
+  TRACK_ALLOC(ALLOC_SITE_BATTERY_DATA, totalCells * sizeof(uint16_t));
+
+  battery->totalCells = totalCells;
+
+  return true;
+}
+
+/**
+ * Pulls the flags we know about out of the status and afeStatus bitmasks
+ */
+void BatteryManager::decodeStatus(batteryInfo_t *battery)
+{
+  battery->cell_high_voltage = (battery->status & LIFE_CELL_HIGH_VOLTAGE);
+  battery->cell_low_voltage = (battery->status  & LIFE_CELL_LOW_VOLTAGE);
+  battery->over_current_when_charge = (battery->status & LIFE_OVER_CURRENT_WHEN_CHARGE);
+  battery->over_current_when_discharge = (battery->status & LIFE_OVER_CURRENT_WHEN_DISCHARGE);
+  battery->low_temp_when_discharge = (battery->status & LIFE_LOW_TEMP_WHEN_DISCHARGE);
+  battery->low_temp_when_charge = (battery->status & LIFE_LOW_TEMP_WHEN_CHARGE);
+  battery->high_temp_when_discharge = (battery->status & LIFE_HIGH_TEMP_WHEN_DISCHARGE);
+  battery->high_temp_when_charge = (battery->status & LIFE_HIGH_TEMP_WHEN_CHARGE);
+  
+  battery->short_circuited = (battery->afeStatus & LIFE_SHORT_CIRCUITED);
+}
+
+/**
+ * A frame decoded before we went to sleep and never published. The caller has
+ * put the values (and cells) back into the battery, this makes it look like the
+ * frame was just decoded so it's published and counted in the bank again. It
+ * isn't evaluated again: the caller has also put back the alarm and estimator
+ * state as they were after this frame, see AlarmManager::restore(). It goes down
+ * the pipeline marked as restored so history can skip it too.
+ */
+void BatteryManager::restoreFrame(batteryInfo_t *battery)
+{
+  strncpy(battery->id, battery->address, sizeof(battery->id) - 1);
+  battery->is_valid = true;
+  battery->metrics.decodes++;
+
+  decodeStatus(battery);
+  updateBankAggregates(battery, true);
+
+  TelemetryPipeline::instance()->submit(battery, true);
+}
+
 /**
  * Process the current battery's buffer. The battery's transmit their data as ASCII hexadecimal values
  * in big endian format. The format of the buffer is as follows:
@@ -119,37 +352,43 @@ BatteryManager *BatteryManager::m_instance = NULL;
  * 
  * CELL_byte1H, CELL_byte1L, CELL_byte2H, CELL_byte2L // Cell voltage (in mV)
  * 
- * for as many cells as the battery has (mine has 4)
+ * for as many cell slots as the frame has (mine has 16 for 4 cells, the unused ones are 0)
  * 
- * Finally we have the checksum:
+ * Finally we have the checksum (the 0x29 after it is taken off by receive()):
  * 
  * SUM_byte1H, SUM_byte1L, SUM_byte2H, SUM_byte2L
  * 
+ * How long the frame is tells us how many cell slots there are, so 12V and 24V packs
+ * can share a bank. See decodeCells() for how many of the slots are real cells.
+ * 
  * For the status fields (status and afeStatus) these are bitmasks. I don't know what all of the bits represent
  * but I know a good portion of them which I have pulled out as booleans in the status and provided matching
  * defines for.
+ *
+ * Returns false if the frame was thrown away.
  */
-void BatteryManager::processBuffer()
+bool BatteryManager::processBuffer()
 {
-  char buf[9];
+  int16_t length;
+  bool cells;
 
   if(!currentBattery) {
-    return;
+    return false;
   }
 
-  if(!isValidChecksum()) {
-    Serial.printf("- Throwing away buffer for '%s' due to invalid checksum", currentBattery->device->getAddress().toString().c_str());
-    return;
+  length = currentBattery->buffer->size();
+
+  if(!isValidChecksum(length)) {
+    Serial.printf("- Throwing away buffer for '%s' due to invalid checksum\n", currentBattery->address);
+    currentBattery->metrics.checksumRejects++;
+    return false;
   }
-  // Adding Battery bname, id.
+
+  currentBattery->metrics.decodes++;
+  currentBattery->lastSweep = totalSweeps + 1;
+  // Adding Battery id, bname is filled in when the battery is added.
   // battery->is_valid is set in the isValidChecksum() function.
-  // "name" needs to be cleaned as LifeBLue app interface adds a '\n' to the name. -- JR
-  char *batteryName = (char *)currentBattery->device->getName().c_str();
-  batteryName[strlen(batteryName) - 1] = '\0';
-  //char bname[20] = {NULL};
-  memcpy(currentBattery->bname, batteryName, strlen(batteryName));
-  char *id = (char *)currentBattery->device->getAddress().toString().c_str();
-  memcpy(currentBattery->id, id, strlen(id));
+  strncpy(currentBattery->id, currentBattery->address, sizeof(currentBattery->id) - 1);
 
   currentBattery->voltage = (uint32_t)convertBufferStringToValue(8);
   currentBattery->current = convertBufferStringToValue(8);
@@ -161,28 +400,190 @@ void BatteryManager::processBuffer()
   currentBattery->status = convertBufferStringToValue(4);
   currentBattery->afeStatus = convertBufferStringToValue(4);
 
-  for(int i = 0; i < totalCells; i++) {
-    currentBattery->cells[i] = convertBufferStringToValue(4);
-  }
+  // Without cells from this frame the cell aggregates and cell rules are left as they were
+  cells = decodeCells((length - FRAME_HEADER_LENGTH - FRAME_CHECKSUM_LENGTH) / FRAME_CELL_LENGTH);
 
-  currentBattery->cell_high_voltage = (currentBattery->status & LIFE_CELL_HIGH_VOLTAGE);
-  currentBattery->cell_low_voltage = (currentBattery->status  & LIFE_CELL_LOW_VOLTAGE);
-  currentBattery->over_current_when_charge = (currentBattery->status & LIFE_OVER_CURRENT_WHEN_CHARGE);
-  currentBattery->over_current_when_discharge = (currentBattery->status & LIFE_OVER_CURRENT_WHEN_DISCHARGE);
-  currentBattery->low_temp_when_discharge = (currentBattery->status & LIFE_LOW_TEMP_WHEN_DISCHARGE);
-  currentBattery->low_temp_when_charge = (currentBattery->status & LIFE_LOW_TEMP_WHEN_CHARGE);
-  currentBattery->high_temp_when_discharge = (currentBattery->status & LIFE_HIGH_TEMP_WHEN_DISCHARGE);
-  currentBattery->high_temp_when_charge = (currentBattery->status & LIFE_HIGH_TEMP_WHEN_CHARGE);
+  decodeStatus(currentBattery);
+  
+  estimatorUpdate(&currentBattery->estimator, millis(), currentBattery->current,
+                  currentBattery->voltage, currentBattery->ampHrs, currentBattery->soc);
+  
+  updateBankAggregates(currentBattery, cells);
   
-  currentBattery->short_circuited = (currentBattery->afeStatus & LIFE_SHORT_CIRCUITED);
+  AlarmManager::instance()->evaluate(currentBattery, cells);
+  TelemetryPipeline::instance()->submit(currentBattery);
+  CommandManager::instance()->frameDecoded(currentBattery);
   
   DEBUG_DUMP_BATTERYINFO(currentBattery);
+
+  return true;
+}
+
+/**
+ * Takes the battery's previous contribution to the bank aggregates out and puts
+ * its new one in. The sums are just adjusted. The extremes (min/max) only need to
+ * look at the other batteries when this battery was the one holding an extreme and
+ * has since moved away from it, and even then it's one value per battery from their
+ * stored contributions rather than going through all of their cells again.
+ *
+ * If cells is false the frame's cells couldn't be decoded, so the battery's cell
+ * contribution from its last frame is kept.
+ */
+void BatteryManager::updateBankAggregates(batteryInfo_t *battery, bool cells)
+{
+  bankAggregates_t next = bank;
+  bankContribution_t contribution = {};
+  bool hadCells = battery->bank.counted && (battery->bank.minCell <= battery->bank.maxCell);
+  bool rescan = false;
+
+  contribution.counted = true;
+  contribution.current = battery->current;
+  contribution.voltage = battery->voltage;
+  contribution.remaining = battery->ampHrs;
+  contribution.capacity = (battery->soc > 0) ? ((uint64_t)battery->ampHrs * 100) / battery->soc : 0;
+  contribution.minCell = UINT16_MAX;
+
+  if(!cells && battery->bank.counted) {
+    contribution.minCell = battery->bank.minCell;
+    contribution.minCellIndex = battery->bank.minCellIndex;
+    contribution.maxCell = battery->bank.maxCell;
+    contribution.maxCellIndex = battery->bank.maxCellIndex;
+  }
+
+  for(int i = 0; cells && (i < battery->totalCells); i++) {
+    if(battery->cells[i] < contribution.minCell) {
+      contribution.minCell = battery->cells[i];
+      contribution.minCellIndex = i;
+    }
+
+    if(battery->cells[i] > contribution.maxCell) {
+      contribution.maxCell = battery->cells[i];
+      contribution.maxCellIndex = i;
+    }
+  }
+
+  if(battery->bank.counted) {
+    next.totalCurrent -= battery->bank.current;
+    next.totalRemaining -= battery->bank.remaining;
+    next.totalCapacity -= battery->bank.capacity;
+  } else {
+    next.batteries++;
+  }
+
+  if(contribution.minCell <= contribution.maxCell) { // no cells yet otherwise
+    next.cellBatteries += hadCells ? 0 : 1;
+  } else if(hadCells) {
+    next.cellBatteries--;
+  }
+
+  next.totalCurrent += contribution.current;
+  next.totalRemaining += contribution.remaining;
+  next.totalCapacity += contribution.capacity;
+
+  battery->bank = contribution;
+
+  rescan |= updateBankExtreme(&next.minVoltage, contribution.voltage, 0, battery, false);
+  rescan |= updateBankExtreme(&next.maxVoltage, contribution.voltage, 0, battery, true);
+  rescan |= updateBankExtreme(&next.minCurrent, contribution.current, 0, battery, false);
+  rescan |= updateBankExtreme(&next.maxCurrent, contribution.current, 0, battery, true);
+
+  if(contribution.minCell <= contribution.maxCell) { // no cells yet otherwise
+    rescan |= updateBankExtreme(&next.minCell, contribution.minCell, contribution.minCellIndex, battery, false);
+    rescan |= updateBankExtreme(&next.maxCell, contribution.maxCell, contribution.maxCellIndex, battery, true);
+  }
+
+  if(rescan) {
+    rescanBankExtremes(&next);
+  }
+
+  next.updated = millis();
+
+  portENTER_CRITICAL(&bankMux);
+  bank = next;
+  portEXIT_CRITICAL(&bankMux);
+}
+
+/**
+ * Offer a battery's new value to one of the bank extremes. Returns true if this
+ * battery was holding the extreme and has moved away from it, in which case some
+ * other battery might hold it now and the extremes need a rescan.
+ */
+bool BatteryManager::updateBankExtreme(bankExtreme_t *extreme, int32_t value, uint8_t cell, batteryInfo_t *battery, bool isMax)
+{
+  bool better = isMax ? (value >= extreme->value) : (value <= extreme->value);
+
+  if(!extreme->battery || better) {
+    extreme->value = value;
+    extreme->battery = battery;
+    extreme->cell = cell;
+    return false;
+  }
+
+  return extreme->battery == battery;
+}
+
+/**
+ * Rebuild all of the bank extremes in next from each battery's stored contribution
+ */
+void BatteryManager::rescanBankExtremes(bankAggregates_t *next)
+{
+  bankContribution_t *contribution;
+  
+  next->minVoltage.battery = next->maxVoltage.battery = NULL;
+  next->minCurrent.battery = next->maxCurrent.battery = NULL;
+  next->minCell.battery = next->maxCell.battery = NULL;
+
+  for(int i = 0; i < totalBatteries; i++) {
+    contribution = &batteryData[i]->bank;
+
+    if(!contribution->counted) {
+      continue;
+    }
+
+    updateBankExtreme(&next->minVoltage, contribution->voltage, 0, batteryData[i], false);
+    updateBankExtreme(&next->maxVoltage, contribution->voltage, 0, batteryData[i], true);
+    updateBankExtreme(&next->minCurrent, contribution->current, 0, batteryData[i], false);
+    updateBankExtreme(&next->maxCurrent, contribution->current, 0, batteryData[i], true);
+
+    if(contribution->minCell <= contribution->maxCell) {
+      updateBankExtreme(&next->minCell, contribution->minCell, contribution->minCellIndex, batteryData[i], false);
+      updateBankExtreme(&next->maxCell, contribution->maxCell, contribution->maxCellIndex, batteryData[i], true);
+    }
+  }
+}
+
+/**
+ * Returns a copy of the running aggregates across the whole bank, taken between
+ * updates from the BLE task so the sums and extremes all belong together
+ */
+bankAggregates_t BatteryManager::getBankAggregates()
+{
+  bankAggregates_t aggregates;
+
+  portENTER_CRITICAL(&bankMux);
+  aggregates = bank;
+  portEXIT_CRITICAL(&bankMux);
+
+  return aggregates;
+}
+
+/**
+ * The bank's state of charge (%), which is each battery's SoC weighted by its
+ * capacity, from a copy of the aggregates (see getBankAggregates())
+ */
+uint16_t BatteryManager::getBankSoc(const bankAggregates_t *aggregates)
+{
+  if(aggregates->totalCapacity == 0) {
+    return 0;
+  }
+
+  return ((uint64_t)aggregates->totalRemaining * 100) / aggregates->totalCapacity;
 }
 
-bool BatteryManager::isValidChecksum()
+bool BatteryManager::isValidChecksum(int16_t length)
 {
 #ifdef DUMP_HEX_BATTERY_BUFFER
-  hex_dump(currentBattery->buffer, 512, "Battery Checksum buffer");
+  dumpBuffer("Battery Checksum buffer");
 #endif
   uint32_t sum = 0;
   uint32_t checksum = 0;
@@ -190,13 +591,14 @@ bool BatteryManager::isValidChecksum()
   char temp[3] = {NULL};
   char t;
   
-  // Byte 112 should be end-of-buffer
-  if(buffer[112] != (char)0x29) {
+  // Has to have room for at least one cell, and whole cells at that
+  if((length < (FRAME_HEADER_LENGTH + FRAME_CELL_LENGTH + FRAME_CHECKSUM_LENGTH)) ||
+     ((length - FRAME_HEADER_LENGTH - FRAME_CHECKSUM_LENGTH) % FRAME_CELL_LENGTH)) {
     return false;
   }
 
   // Add up all the bytes in the buffer
-  for(int i = 0; i < 108; i += 2) {
+  for(int i = 0; i < (length - FRAME_CHECKSUM_LENGTH); i += 2) {
     temp[0] = buffer[i];
     temp[1] = buffer[i+1];
     temp[2] = NULL;
@@ -205,14 +607,14 @@ bool BatteryManager::isValidChecksum()
     sum += checksum;
   }
 
-  temp[0] = buffer[108];
-  temp[1] = buffer[109];
+  temp[0] = buffer[length - 4];
+  temp[1] = buffer[length - 3];
   temp[2] = NULL;
 
   checksum = strtoul(temp, NULL, 16) << 8;
  
-  temp[0] = buffer[110];
-  temp[1] = buffer[111];
+  temp[0] = buffer[length - 2];
+  temp[1] = buffer[length - 1];
   temp[2] = NULL;
     
   checksum += strtoul(temp, NULL, 16);
@@ -260,12 +662,210 @@ int32_t BatteryManager::convertBufferStringToValue(uint8_t len)
   return -1;
 }
 
-uint8_t BatteryManager::getTotalCells()
+/**
+ * Hex dumps the current battery's buffer. The buffer is a CircularBuffer so it
+ * has to be copied out in order before it can be handed to hex_dump(), otherwise we
+ * end up dumping the CircularBuffer object itself rather than the frame.
+ */
+void BatteryManager::dumpBuffer(const char *caption)
 {
-  return totalCells;
+  char linear[512];
+  size_t size;
+
+  if(!currentBattery) {
+    return;
+  }
+
+  size = currentBattery->buffer->size();
+
+  for(size_t i = 0; i < size; i++) {
+    linear[i] = (*currentBattery->buffer)[i];
+  }
+
+  hex_dump(linear, size, (char *)caption);
 }
 
-batteryInfo_t *BatteryManager::getBattery(uint8_t idx)
+/**
+ * Records how long the given stage of the current poll took, which is the time
+ * since the previous stage was recorded (or the time since the poll started for
+ * POLL_STAGE_TOTAL). Each stage is only recorded once per poll, so it's safe to
+ * call this for every fragment that comes in.
+ */
+void BatteryManager::recordStage(pollStage_t stage)
+{
+  uint32_t now = micros();
+
+  if(!currentBattery || (stagesRecorded & (1 << stage))) {
+    return;
+  }
+
+  if(stage == POLL_STAGE_TOTAL) {
+    histogramRecord(&currentBattery->metrics.stages[stage], now - pollStarted);
+  } else {
+    histogramRecord(&currentBattery->metrics.stages[stage], now - stageStarted);
+    stageStarted = now;
+  }
+
+  stagesRecorded |= (1 << stage);
+}
+
+/**
+ * Finds the battery with the given address, or NULL if we don't have it
+ */
+batteryInfo_t *BatteryManager::findBattery(BLEAddress address)
+{
+  for(int i = 0; i < totalBatteries; i++) {
+    if(BLEAddress(batteryData[i]->bdAddress).equals(address)) {
+      return batteryData[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Puts the battery at the front of the polling queue so it's the next one polled
+ * (the queue is a stack), even if we're between sweeps. If it has already been
+ * asked for and not polled yet it's left where it is.
+ */
+bool BatteryManager::pollNow(batteryInfo_t *battery)
+{
+  if(!battery) {
+    return false;
+  }
+
+  if(battery->pollRequested) {
+    return true;
+  }
+
+  if(pollingQueue.isFull()) {
+    return false;
+  }
+
+  battery->pollRequested = true;
+  requestedPolls++;
+  pollingQueue.push(battery);
+
+  return true;
+}
+
+/**
+ * True if pollNow() has queued a battery that hasn't been polled yet, in which
+ * case the main loop shouldn't sleep
+ */
+bool BatteryManager::hasRequestedPolls()
+{
+  return requestedPolls > 0;
+}
+
+void BatteryManager::setPollInterval(uint32_t interval)
+{
+  pollInterval = interval;
+}
+
+uint32_t BatteryManager::getPollInterval()
+{
+  return pollInterval;
+}
+
+void BatteryManager::setDeadbands(const publishDeadbands_t *d)
+{
+  deadbands = *d;
+}
+
+const publishDeadbands_t *BatteryManager::getDeadbands()
+{
+  return &deadbands;
+}
+
+/**
+ * Whether the battery's latest frame is worth publishing, see the snapshot
+ * version below
+ */
+bool BatteryManager::needsPublish(batteryInfo_t *battery)
+{
+  telemetrySnapshot_t snapshot;
+
+  if(!battery->is_valid) {
+    return false;
+  }
+
+  TelemetryPipeline::snapshot(battery, &snapshot);
+
+  return needsPublish(&snapshot);
+}
+
+/**
+ * Whether a frame is worth publishing: it has to be newer than the last one
+ * published, and it has to have moved past one of the deadbands, be the frame
+ * someone asked for, or be the first in deadbands.maxAge.
+ */
+bool BatteryManager::needsPublish(const telemetrySnapshot_t *snapshot)
+{
+  publishState_t *state = &snapshot->battery->published;
+
+  if(snapshot->decodes == state->decodes) {
+    return false;
+  }
+
+  if(!state->published || state->forced || ((millis() - state->timestamp) >= deadbands.maxAge)) {
+    return true;
+  }
+
+  return (abs((int32_t)(snapshot->voltage - state->voltage)) >= (int32_t)deadbands.voltage) ||
+         (abs(snapshot->current - state->current) >= (int32_t)deadbands.current) ||
+         (abs(snapshot->soc - state->soc) >= deadbands.soc) ||
+         (abs((int16_t)snapshot->temp - state->temp) >= deadbands.temp);
+}
+
+/**
+ * Call once the frame has been published
+ */
+void BatteryManager::markPublished(const telemetrySnapshot_t *snapshot)
+{
+  publishState_t *state = &snapshot->battery->published;
+
+  state->published = true;
+  state->forced = false;
+  state->decodes = snapshot->decodes;
+  state->voltage = snapshot->voltage;
+  state->current = snapshot->current;
+  state->soc = snapshot->soc;
+  state->temp = (int16_t)snapshot->temp;
+  state->timestamp = millis();
+}
+
+/**
+ * How long (in ms) it took to get through the last full sweep of all of the batteries
+ */
+uint32_t BatteryManager::getLastSweepDuration()
+{
+  return lastSweepDuration;
+}
+
+uint32_t BatteryManager::getTotalSweeps()
+{
+  return totalSweeps;
+}
+
+/**
+ * For picking the count back up after a deep sleep
+ */
+void BatteryManager::setTotalSweeps(uint32_t sweeps)
+{
+  totalSweeps = sweeps;
+}
+
+/**
+ * Nothing to do until the next sweep is due: the last sweep is finished, there
+ * are no retries or on demand polls waiting, and we aren't connected to anything
+ */
+bool BatteryManager::isIdle()
+{
+  return !sweepStarted && pollingQueue.isEmpty() && !(client && client->isConnected());
+}
+
+batteryInfo_t *BatteryManager::getBattery(uint16_t idx)
 {
   if(idx >= totalBatteries) {
     return NULL;
@@ -274,7 +874,7 @@ batteryInfo_t *BatteryManager::getBattery(uint8_t idx)
   return batteryData[idx];
 }
 
-uint8_t BatteryManager::getTotalBatteries()
+uint16_t BatteryManager::getTotalBatteries()
 {
   return totalBatteries;
 }
@@ -304,35 +904,29 @@ void BatteryManager::setCurrentBattery(batteryInfo_t *b) {
 
 /**
  * Private constructor. There can be only one instance of this class
- * so it's implemented as a singleton. First parameter is maximum batteries
- * to keep track of, the second is the number of cells for each battery.
- * 
- * Note: We do not support a mixture of batteries with different numbers of
- * cells in each.
+ * so it's implemented as a singleton. The parameter is maximum batteries
+ * to keep track of. Each battery's cell count comes from its own frames.
  */
-BatteryManager::BatteryManager(uint8_t mb, uint8_t tc)
+BatteryManager::BatteryManager(uint16_t mb)
 {
   maxBatteries = mb;
   totalBatteries = 0;
-  totalCells = (tc > MAX_BATTERY_CELLS) ? MAX_BATTERY_CELLS : tc;
 
-  Serial.printf("- Created BatteryManager with %d batteries maximum (%d cells each)\n", maxBatteries, totalCells);
-  
-  batteryData = (batteryInfo_t **)os_zalloc(maxBatteries * sizeof(batteryInfo_t *));
+  Serial.printf("- Created BatteryManager with %d batteries maximum\n", maxBatteries);
 
-  for(int i = 0; i < maxBatteries; i++) {
-    batteryData[i] = (batteryInfo_t *)os_zalloc(sizeof(batteryInfo_t));
-    batteryData[i]->buffer = new CircularBuffer<char, 512>();
-  }
+  frameBuffer = new CircularBuffer<char, 512>();
+  TRACK_ALLOC(ALLOC_SITE_BATTERY_DATA, sizeof(CircularBuffer<char, 512>));
+
+  BLEDevice::setCustomGapHandler(_bm_gap_callback);
 }
 
 /**
  * Retrieve a (new) instance of the BatteryManager
  */
-BatteryManager *BatteryManager::instance(uint8_t mb, uint8_t tc)
+BatteryManager *BatteryManager::instance(uint16_t mb)
 {
   if(!m_instance) {
-    m_instance = new BatteryManager(mb, tc);
+    m_instance = new BatteryManager(mb);
   }
 
   return m_instance;
@@ -343,7 +937,7 @@ BatteryManager *BatteryManager::instance(uint8_t mb, uint8_t tc)
  */
 BatteryManager *BatteryManager::instance()
 {
-  return instance(NULL, NULL);
+  return instance(NULL);
 }
 
 /**
@@ -356,30 +950,30 @@ void BatteryManager::reset()
    if(batteryData != NULL) {
 
     Serial.println("- Found existing batteries");
-     for(int i = 0; i < maxBatteries; i++) {
-       if(batteryData[i]->device) {
-          delete batteryData[i]->device;
-       }
-
-       if(batteryData[i]->buffer) {
-          delete batteryData[i]->buffer;
+     for(int i = 0; i < totalBatteries; i++) {
+       if(batteryData[i]->cells) {
+          free(batteryData[i]->cells);
+          TRACK_FREE(ALLOC_SITE_BATTERY_DATA);
        }
 
        free(batteryData[i]);
+       TRACK_FREE(ALLOC_SITE_BATTERY_DATA);
      }
      
      free(batteryData);
+     TRACK_FREE(ALLOC_SITE_BATTERY_DATA);
      batteryData = NULL;
    }
    
-   batteryData = (batteryInfo_t **)os_zalloc(maxBatteries * sizeof(batteryInfo_t *));
-
-   for(int i = 0; i < maxBatteries; i++) {
-     batteryData[i] = (batteryInfo_t *)os_zalloc(sizeof(batteryInfo_t));
-      batteryData[i]->buffer = new CircularBuffer<char, 512>();
-   }
-   
+   allocatedBatteries = 0;
    totalBatteries = 0;
+   portENTER_CRITICAL(&bankMux);
+   bank = bankAggregates_t();
+   portEXIT_CRITICAL(&bankMux);
+   pollingQueue.clear();
+   requestedPolls = 0;
+   sweepCursor = 0;
+   sweepStarted = 0;
 }
 
 /**
@@ -388,26 +982,194 @@ void BatteryManager::reset()
  */
 bool BatteryManager::addBattery(BLEAdvertisedDevice *device)
 {
+  return addBattery(device->getAddress(), device->getAddressType(), device->getName().c_str(), device->getRSSI());
+}
+
+/**
+ * Adds a battery from what we know about it rather than a scan result, i.e. what
+ * SleepManager kept from before we went to sleep. Everything is copied, nothing
+ * from the scan has to stay around.
+ */
+bool BatteryManager::addBattery(BLEAddress address, uint8_t addressType, const char *name, int8_t rssi)
+{
+  batteryInfo_t *battery;
+  batteryInfo_t **grown;
+  uint16_t size;
+
   if(totalBatteries == maxBatteries) {
     Serial.printf("Cannot add battery, maximum of %d reached.\n", maxBatteries);
     return false;
   }
 
-  batteryData[totalBatteries]->device = device;
+  if(findBattery(address)) {
+    return false; // already have it, i.e. we've been asked to rescan
+  }
+
+  // Storage grows as batteries are found rather than being sized for maxBatteries up front
+  if(totalBatteries == allocatedBatteries) {
+    size = allocatedBatteries ? allocatedBatteries * 2 : 8;
+    size = (size > maxBatteries) ? maxBatteries : size;
+
+    grown = (batteryInfo_t **)realloc(batteryData, size * sizeof(batteryInfo_t *));
+
+    if(!grown) {
+      Serial.printf("- FAILED: Could not grow battery storage to %d batteries\n", size);
+      return false;
+    }
+
+    if(!batteryData) {
+      TRACK_ALLOC(ALLOC_SITE_BATTERY_DATA, size * sizeof(batteryInfo_t *));
+    }
+
+    batteryData = grown;
+    allocatedBatteries = size;
+  }
+
+  batteryData[totalBatteries] = (batteryInfo_t *)os_zalloc(sizeof(batteryInfo_t));
+
+  if(!batteryData[totalBatteries]) {
+    Serial.println("- FAILED: Could not allocate battery");
+    return false;
+  }
+
+  TRACK_ALLOC(ALLOC_SITE_BATTERY_DATA, sizeof(batteryInfo_t));
+
+  battery = batteryData[totalBatteries];
+
+  memcpy(battery->bdAddress, *address.getNative(), sizeof(esp_bd_addr_t));
+  strncpy(battery->address, address.toString().c_str(), sizeof(battery->address) - 1);
+  battery->addressType = addressType;
+  battery->rssi = rssi;
+  battery->buffer = frameBuffer;
+
+  // "name" needs to be cleaned as LifeBLue app interface adds a '\n' to the name. -- JR
+  strncpy(battery->bname, name, sizeof(battery->bname) - 1);
+
+  if(battery->bname[0] && (battery->bname[strlen(battery->bname) - 1] == '\n')) {
+    battery->bname[strlen(battery->bname) - 1] = '\0';
+  }
   
   totalBatteries++;
 
-  Serial.printf("- Added LiFeBlue battery (%s): %s\n", device->getAddress().toString().c_str(), device->getName().c_str());
+  Serial.printf("- Added LiFeBlue battery (%s): %s\n", battery->address, battery->bname);
   return true;
 }
 
+/**
+ * Picks the battery to poll next. Anything on the polling queue (asked for with
+ * pollNow(), or being retried) goes first, most recent first, otherwise it's the
+ * next battery in the sweep. When the sweep gets to the end a new one starts once
+ * the poll interval is up. Either way it's O(1) per poll however big the bank is,
+ * plus skipping over batteries already polled on demand this sweep or that
+ * another gateway holds (see LeaseManager). Returns NULL if there's nothing to
+ * poll right now.
+ */
+batteryInfo_t *BatteryManager::nextBattery()
+{
+  LeaseManager *leaseManager = LeaseManager::instance();
+  batteryInfo_t *battery;
+  uint16_t visited = 0;
+
+  for(;;) {
+    if(!pollingQueue.isEmpty()) {
+      battery = pollingQueue.pop();
+
+      if(battery->pollRequested) {
+        battery->pollRequested = false;
+        requestedPolls--;
+      } else if(battery->lastSweep == (totalSweeps + 1)) {
+        continue; // a retry that's been decoded since
+      }
+
+      if(!leaseManager->mayPoll(battery)) {
+        continue; // another gateway has it now
+      }
+
+      return battery;
+    }
+
+
+    if(!sweepStarted || (sweepCursor >= totalBatteries)) {
+      if(sweepStarted) {
+        lastSweepDuration = millis() - sweepStarted;
+        totalSweeps++;
+        sweepStarted = 0;
+      }
+
+      if(!totalBatteries || (lastSweepStarted && ((millis() - lastSweepStarted) < pollInterval))) {
+        return NULL; // not time for the next sweep yet
+      }
+
+      sweepCursor = 0;
+      sweepStarted = lastSweepStarted = millis();
+    }
+
+    if(visited++ == totalBatteries) {
+      return NULL; // been all the way round and none of them are ours
+    }
+
+    battery = batteryData[sweepCursor++];
+
+    // A battery polled on demand this sweep has already been done, don't do it twice
+    if((battery->lastSweep != (totalSweeps + 1)) && leaseManager->mayPoll(battery)) {
+      return battery;
+    }
+  }
+}
+
+/**
+ * Puts a battery we failed to poll back on the polling queue so it's retried
+ * straight away. If the queue is full it waits for the next sweep instead.
+ */
+void BatteryManager::requeue(batteryInfo_t *battery)
+{
+  if(pollingQueue.isFull()) {
+    Serial.println(" - Polling queue full, retrying next sweep");
+    return;
+  }
+
+  pollingQueue.push(battery);
+}
+
+/**
+ * Asks the battery we just connected to for a bigger MTU, so a frame turns up in
+ * one notification rather than six, and for a short connection interval so it
+ * turns up quickly. Neither is waited for, the answers come back while we're
+ * discovering the service.
+ *
+ * What the battery settles on is kept in its linkParams_t. Next time we ask for
+ * exactly that, and whatever it turned down isn't asked for again.
+ */
+void BatteryManager::negotiateLink()
+{
+  linkParams_t *link = &currentBattery->link;
+  esp_ble_conn_update_params_t params;
+
+  if(link->mtu != LINK_DEFAULT_MTU) {
+    client->setMTU(link->mtu ? link->mtu : LINK_MTU);
+  }
+
+  if(link->intervalRefused) {
+    return;
+  }
+
+  memcpy(params.bda, currentBattery->bdAddress, sizeof(esp_bd_addr_t));
+  params.min_int = link->interval ? link->interval : LINK_MIN_INTERVAL;
+  params.max_int = link->interval ? link->interval : LINK_MAX_INTERVAL;
+  params.latency = 0;
+  params.timeout = LINK_SUPERVISION_TIMEOUT;
+
+  if(esp_ble_gap_update_conn_params(&params) != ESP_OK) {
+    Serial.println(" - Could not ask for faster connection parameters");
+  }
+}
+
 /**
  * The main loop function. The way this works is the manager has a list
- * of batteries it's monitoring and uses a stack to do them one at a time. If
+ * of batteries it's monitoring and sweeps through them one at a time. If
  * for some reason we can't connect to the battery right away (happens from time to time),
- * we push the battery back on the stack to be re-processed. Otherwise, we pop the next battery
- * off the stack and process it until there are no batteries left to process. At that point,
- * we loop through all of the batteries and push them all back on the stack.
+ * we push the battery on to the polling queue (a stack) to be re-processed, and anything on
+ * that stack goes ahead of the sweep. See nextBattery() for how the next battery is picked.
  * 
  */
 void BatteryManager::loop()
@@ -417,48 +1179,61 @@ void BatteryManager::loop()
 
   if(client) {
     if(client->isConnected()) {
-      return;
+      if((micros() - pollStarted) < (POLL_TIMEOUT * 1000UL)) {
+        return;
+      }
+
+      // Connected, but nothing we could use came through
+      if(currentBattery) {
+        Serial.printf(" - No good frame from %s in %u ms, trying again next sweep\n", currentBattery->address, POLL_TIMEOUT);
+        currentBattery->metrics.timeouts++;
+      }
+
+      client->disconnect();
     }
   }
   
-  if(pollingQueue.isEmpty()) {
-    for(int i = 0; i < totalBatteries; i++) {
-      pollingQueue.push(batteryData[i]);
-    }
-  }
+  currentBattery = nextBattery();
 
-  if(!pollingQueue.isEmpty()) {
-    currentBattery = pollingQueue.pop();
+  if(currentBattery) {
+    currentBattery->metrics.polls++;
+    currentBattery->buffer->clear(); // whatever's left over from the last battery isn't ours
+    framing = false;
+    frameRejects = 0;
+    
+    pollStarted = stageStarted = micros();
+    stagesRecorded = 0;
 
-    Serial.printf("\n- Connecting to Battery: %s\n", currentBattery->device->getAddress().toString().c_str());
-    /* //This causes a crash commenting it out.  
-    // CORRUPT HEAP: Bad head at 0x3fff6594. Expected 0xabba1234 got 0x3fff761c
-    // assertion "head != NULL" failed: file "/home/runner/work/esp32-arduino-lib-builder/esp32-arduino-lib-builder/esp-idf/components/heap/multi_heap_poisoning.c", line 214, function: multi_heap_free
-    // abort() was called at PC 0x40106ebf on core 1
- 
-    if(client) {
-      delete client;
-      client = NULL;
+    Serial.printf("\n- Connecting to Battery: %s\n", currentBattery->address);
+
+    // One client does every poll. A new one each time leaked the last, and deleting
+    // it after a disconnect is what gave us CORRUPT HEAP: Bad head (the BT task
+    // still has hold of it until the close event comes through).
+    if(!client) {
+      client = BLEDevice::createClient();
+      TRACK_ALLOC(ALLOC_SITE_BLE_CLIENT, sizeof(BLEClient));
     }
-    */
-    client = BLEDevice::createClient();
     
-    if(!client->connect(currentBattery->device)) {
+    if(!client->connect(BLEAddress(currentBattery->bdAddress), (esp_ble_addr_type_t)currentBattery->addressType)) {
       Serial.println(" - Failed to connect to battery, requeuing");
-      delete client;
-      client = NULL;
-      pollingQueue.push(currentBattery);
+      currentBattery->metrics.connectFailures++;
+      currentBattery->metrics.requeues++;
+      requeue(currentBattery);
       return;
     }
 
+    recordStage(POLL_STAGE_CONNECT);
+
+    negotiateLink();
+
     remoteService = client->getService(serviceUUID);
 
     if(remoteService == nullptr) {
       Serial.println(" - FAILURE: Could not find service UUID");
+      currentBattery->metrics.discoveryFailures++;
+      currentBattery->metrics.requeues++;
       client->disconnect();
-      delete client;
-      client = NULL;
-      pollingQueue.push(currentBattery);
+      requeue(currentBattery);
       return;
     }
 
@@ -466,26 +1241,31 @@ void BatteryManager::loop()
 
     if(characteristic == nullptr) {
       Serial.println(" - FAILURE: Could not find characteristic UUID");
+      currentBattery->metrics.discoveryFailures++;
+      currentBattery->metrics.requeues++;
       client->disconnect();
-      delete client;
-      client = NULL;
-      pollingQueue.push(currentBattery);
+      requeue(currentBattery);
       return;
     }
 
     if(!characteristic->canNotify()) {
       Serial.println(" - FAILURE: characteristic UUID cannot notify");
+      currentBattery->metrics.discoveryFailures++;
+      currentBattery->metrics.requeues++;
       client->disconnect();
-      delete client;
-      client = NULL;
-      pollingQueue.push(currentBattery);  
+      requeue(currentBattery);
       return;
     }
   
+    recordStage(POLL_STAGE_DISCOVERY);
+  
     currentBattery->characteristicHandle = characteristic->getHandle();
     characteristic->registerForNotify(_bm_char_callback);
+
+    recordStage(POLL_STAGE_SUBSCRIBE);
    
   }
   
-  delay(2000);
+  // Wait for the frame, but don't hold an alarm it raised up behind the rest of this
+  AlarmManager::instance()->waitForPending(2000);
 }
@@ -27,13 +27,96 @@
 #include "Arduino.h"
 #include "lifeblue.h"
 #include "os.h"
+#include "PollMetrics.h"
+#include "StateEstimator.h"
+#include "AlarmManager.h"
+#include "LeaseManager.h"
 #include <BLEDevice.h>
 #include <CircularBuffer.h>
 
+// Cell slots a frame can have, batteries with fewer cells leave the rest 0
 #ifndef MAX_BATTERY_CELLS
 #define MAX_BATTERY_CELLS 16
 #endif
 
+// A frame is FRAME_START, hex characters, then FRAME_END
+#define FRAME_START 0x87
+#define FRAME_END 0x29
+
+// Frame layout, in hex characters: everything up to the cells, then one cell, then the checksum
+#define FRAME_HEADER_LENGTH 44
+#define FRAME_CELL_LENGTH 4
+#define FRAME_CHECKSUM_LENGTH 4
+#define FRAME_MAX_LENGTH (FRAME_HEADER_LENGTH + (MAX_BATTERY_CELLS * FRAME_CELL_LENGTH) + FRAME_CHECKSUM_LENGTH)
+
+// Bad frames in a row we'll wait through for a good one before giving up on a poll
+#ifndef FRAME_MAX_REJECTS
+#define FRAME_MAX_REJECTS 3
+#endif
+
+// ms we stay connected to a battery waiting for a good frame
+#ifndef POLL_TIMEOUT
+#define POLL_TIMEOUT 10000
+#endif
+
+/**
+ * What we ask each battery for once we're connected. The default ATT MTU (23)
+ * splits a frame into six or more notifications, at LINK_MTU a whole frame fits in
+ * one. Intervals are in units of 1.25ms, the supervision timeout in units of 10ms.
+ */
+#ifndef LINK_MTU
+#define LINK_MTU 247
+#endif
+
+#define LINK_DEFAULT_MTU 23
+
+#ifndef LINK_MIN_INTERVAL
+#define LINK_MIN_INTERVAL 6 // 7.5ms, as short as BLE goes
+#endif
+
+#ifndef LINK_MAX_INTERVAL
+#define LINK_MAX_INTERVAL 12 // 15ms
+#endif
+
+#ifndef LINK_SUPERVISION_TIMEOUT
+#define LINK_SUPERVISION_TIMEOUT 200 // 2s
+#endif
+
+// Batteries polled on demand or being retried, they're polled ahead of the sweep
+#ifndef POLL_QUEUE_SIZE
+#define POLL_QUEUE_SIZE 16
+#endif
+
+// ms from the start of one sweep to the start of the next, 0 to sweep back to back
+#ifndef POLL_INTERVAL
+#define POLL_INTERVAL 0
+#endif
+
+/**
+ * Default publish deadbands. A battery's frame is only published when something
+ * has moved at least this far since the last time it was published, or when
+ * DEADBAND_MAX_AGE (ms) has passed. 0 publishes every frame.
+ */
+#ifndef DEADBAND_VOLTAGE
+#define DEADBAND_VOLTAGE 0 // mV
+#endif
+
+#ifndef DEADBAND_CURRENT
+#define DEADBAND_CURRENT 0 // mA
+#endif
+
+#ifndef DEADBAND_SOC
+#define DEADBAND_SOC 0 // %
+#endif
+
+#ifndef DEADBAND_TEMP
+#define DEADBAND_TEMP 0 // tenths of a degree C
+#endif
+
+#ifndef DEADBAND_MAX_AGE
+#define DEADBAND_MAX_AGE 60000
+#endif
+
 /**
  * Various bit values for each flag in either the status or afeStatus variable
  */
@@ -47,15 +130,106 @@
 #define LIFE_HIGH_TEMP_WHEN_CHARGE 0x1
 #define LIFE_SHORT_CIRCUITED 0x20
 
+/**
+ * What a single battery last contributed to the bank aggregates, so that we can
+ * take it back out again when that battery's next frame is decoded.
+ */
+struct bankContribution_t {
+  bool counted; // has this battery contributed yet?
+  int32_t current; // mA
+  uint32_t voltage; // mV
+  uint32_t remaining; // mAh (ampHrs)
+  uint32_t capacity; // mAh, estimated from ampHrs and soc
+  uint16_t minCell; // mV
+  uint8_t minCellIndex;
+  uint16_t maxCell; // mV
+  uint8_t maxCellIndex;
+};
+
+/**
+ * How far a value has to move before a battery is published again
+ */
+struct publishDeadbands_t {
+  uint32_t voltage; // mV
+  uint32_t current; // mA
+  uint16_t soc; // %
+  uint16_t temp; // tenths of a degree C
+  uint32_t maxAge; // ms, publish anyway after this long
+};
+
+/**
+ * What a battery looked like the last time it was published
+ */
+struct publishState_t {
+  bool published; // false until the first publish
+  bool forced; // publish the next frame whatever the deadbands say (someone asked for it)
+  uint32_t decodes; // metrics.decodes at the time, so we know when there's a new frame
+  uint32_t voltage;
+  int32_t current;
+  uint16_t soc;
+  int16_t temp;
+  uint32_t timestamp; // millis()
+};
+
+/**
+ * What a battery's link ended up as the last time we asked, so the next connect
+ * can ask for exactly that and not bother asking for what it turned down
+ */
+struct linkParams_t {
+  uint16_t mtu; // ATT MTU in use once the frame came in, 0 until then, LINK_DEFAULT_MTU if it refused
+  uint16_t interval; // connection interval it accepted, 1.25ms units, 0 if it hasn't
+  uint16_t latency; // connection events it can skip
+  uint16_t timeout; // supervision timeout, 10ms units
+  bool intervalRefused; // turned our connection parameters down
+};
+
+struct batteryInfo_t;
+struct telemetrySnapshot_t;
+
+/**
+ * The lowest or highest of something across the bank and where it came from
+ */
+struct bankExtreme_t {
+  int32_t value;
+  batteryInfo_t *battery; // NULL until a battery has contributed
+  uint8_t cell; // for cell voltages, the cell index in battery (0 based)
+};
+
+/**
+ * Running aggregates across every battery in the bank. These are updated each time
+ * a single battery's frame is decoded by taking that battery's old contribution out
+ * and putting the new one in, rather than going back over every battery.
+ */
+struct bankAggregates_t {
+  uint16_t batteries; // how many batteries have contributed
+  uint16_t cellBatteries; // how many of those have reported cells, minCell / maxCell are unset while it's 0
+  int32_t totalCurrent; // mA
+  uint32_t totalRemaining; // mAh
+  uint32_t totalCapacity; // mAh
+
+  bankExtreme_t minVoltage; // pack voltage, mV
+  bankExtreme_t maxVoltage;
+  bankExtreme_t minCurrent; // per battery current (current sharing), mA
+  bankExtreme_t maxCurrent;
+  bankExtreme_t minCell; // cell voltage, mV
+  bankExtreme_t maxCell;
+
+  uint32_t updated; // millis() of the last update
+};
+
 /**
  * This is the struct that holds the "raw" data from the battery
  * that gets updated as we receive new stats.
  */
 struct batteryInfo_t {
   
-  BLEAdvertisedDevice *device = NULL;
+  esp_bd_addr_t bdAddress; // from the scan, along with addressType it's all we need to connect again
+  uint8_t addressType; // esp_ble_addr_type_t
+  char address[18]; // bdAddress as text, for logging
+  int8_t rssi; // at the last scan it was seen in
+  uint32_t lastScan; // the ScanManager scan it was last seen in
   uint16_t  characteristicHandle;
-  CircularBuffer<char, 512> *buffer = NULL;
+  CircularBuffer<char, 512> *buffer = NULL; // shared by every battery, see BatteryManager::frameBuffer
   
   char bname[20] = {NULL}; // Battery Name -- JR
   char id[20] = {NULL}; // Battery ID -- JR
@@ -68,7 +242,9 @@ struct batteryInfo_t {
   uint16_t temp; // Temperature in C
   uint16_t status; // Status Bitmask
   uint16_t afeStatus; // afeStatus Bitmask
-  uint16_t cells[MAX_BATTERY_CELLS];
+  uint16_t *cells = NULL; // totalCells of them, allocated once we know how many
+  uint8_t totalCells = 0; // settled from its first frames, see BatteryManager::decodeCells()
+  uint8_t seenCells = 0; // most cells seen before totalCells was settled
 
   bool cell_high_voltage = false;
   bool cell_low_voltage = false;
@@ -79,6 +255,17 @@ struct batteryInfo_t {
   bool high_temp_when_discharge = false;
   bool high_temp_when_charge = false;
   bool short_circuited = false;
+
+  pollMetrics_t metrics;
+  bankContribution_t bank;
+  stateEstimator_t estimator;
+  alarmState_t alarms;
+  publishState_t published;
+  leaseState_t lease;
+  linkParams_t link;
+
+  bool pollRequested; // queued by pollNow() and not polled yet
+  uint32_t lastSweep; // the sweep (1 based) this battery's frame was last decoded in
   
 };
 
@@ -95,8 +282,8 @@ struct batteryInfo_t {
    Serial.printf("Cycles: %u\n", _i->cycleCount); \
    Serial.printf("SoC: %u%%\n", _i->soc); \
    Serial.printf("Temp: %.1f (C) %.2f (F)\n", ((float)_i->temp) / 10, (((float)_i->temp) / 10) * 1.8 + 32); \
-   Serial.printf("RSSI: %d db\n", _i->device->getRSSI()); \
-   for(int i = 0; i < totalCells; i++) Serial.printf("%lu (mV) ", (unsigned long int)_i->cells[i]); \
+   Serial.printf("RSSI: %d db\n", _i->rssi); \
+   for(int i = 0; i < _i->totalCells; i++) Serial.printf("%lu (mV) ", (unsigned long int)_i->cells[i]); \
    Serial.printf("\nCell High Voltage: %s\n", _i->cell_high_voltage ? "X" : "-"); \
    Serial.printf("Cell Low Voltage: %s\n", _i->cell_low_voltage ? "X" : "-"); \
    Serial.printf("Over Current When Charge: %s\n", _i->over_current_when_charge ? "X" : "-"); \
@@ -110,6 +297,7 @@ struct batteryInfo_t {
 
 extern "C" {
   void _bm_char_callback(BLERemoteCharacteristic *, uint8_t *, size_t, bool);
+  void _bm_gap_callback(esp_gap_ble_cb_event_t, esp_ble_gap_cb_param_t *);
 }
 
 class BatteryManager
@@ -119,40 +307,96 @@ public:
     
     ~BatteryManager();
     bool addBattery(BLEAdvertisedDevice *);
+    bool addBattery(BLEAddress, uint8_t, const char *, int8_t);
     void reset();
     void loop();
     
     void setCurrentBattery(batteryInfo_t *);
     batteryInfo_t *getCurrentBattery();
-    batteryInfo_t *getBattery(uint8_t);
-    uint8_t getTotalBatteries();
-    uint8_t getTotalCells();
+    batteryInfo_t *getBattery(uint16_t);
+    uint16_t getTotalBatteries();
     BLEClient *getBLEClient();
-    void processBuffer();
+    void receive(const uint8_t *, size_t);
+    bool processBuffer();
+    void dumpBuffer(const char *);
+    void recordStage(pollStage_t);
+    uint32_t getLastSweepDuration();
+    uint32_t getTotalSweeps();
+    void setTotalSweeps(uint32_t);
+    bool isIdle();
+    bankAggregates_t getBankAggregates();
+    static uint16_t getBankSoc(const bankAggregates_t *);
+
+    batteryInfo_t *findBattery(BLEAddress);
+    bool pollNow(batteryInfo_t *);
+    bool hasRequestedPolls();
+    void setPollInterval(uint32_t);
+    uint32_t getPollInterval();
+
+    void setDeadbands(const publishDeadbands_t *);
+    const publishDeadbands_t *getDeadbands();
+    bool needsPublish(batteryInfo_t *);
+    bool needsPublish(const telemetrySnapshot_t *);
+    void markPublished(const telemetrySnapshot_t *);
+
+    bool allocateCells(batteryInfo_t *, uint8_t);
+    void restoreFrame(batteryInfo_t *);
     
-    static BatteryManager *instance(uint8_t, uint8_t);
+    static BatteryManager *instance(uint16_t);
     static BatteryManager *instance();
     
 private:
-    BatteryManager(uint8_t, uint8_t);
+    BatteryManager(uint16_t);
     BatteryManager(BatteryManager const &) {};
     BatteryManager& operator=(BatteryManager const &) { };
 
-    bool isValidChecksum();
+    bool frameReceived();
+    void negotiateLink();
+    bool isValidChecksum(int16_t);
+    bool decodeCells(uint8_t);
+    void decodeStatus(batteryInfo_t *);
+    void updateBankAggregates(batteryInfo_t *, bool);
+    bool updateBankExtreme(bankExtreme_t *, int32_t, uint8_t, batteryInfo_t *, bool);
+    void rescanBankExtremes(bankAggregates_t *);
+    batteryInfo_t *nextBattery();
+    void requeue(batteryInfo_t *);
       
     int32_t convertBufferStringToValue(uint8_t);  // Return a int32_t so we can capture the signed current value.
                                                   // Need to cast the Voltage and AmpHrs calls to (uint32_t)
     
     BLEClient *client = NULL;
            
-    uint8_t maxBatteries = 0;
-    uint8_t totalBatteries = 0;
-    uint8_t totalCells = 0;
+    uint16_t maxBatteries = 0;
+    uint16_t totalBatteries = 0;
+    uint16_t allocatedBatteries = 0; // size of batteryData, it grows as batteries are found
     
     batteryInfo_t **batteryData = NULL;
     batteryInfo_t *currentBattery = NULL;
+
+    // We're only ever connected to one battery at a time, so they all share one receive buffer
+    CircularBuffer<char, 512> *frameBuffer = NULL;
+    bool framing = false; // seen a FRAME_START and not its FRAME_END yet, only touched from the BLE task
+    uint8_t frameRejects = 0; // bad frames in a row this poll
+
+    // Only changed from the BLE task, but read from the loop task, so a new copy is
+    // built up and swapped in under bankMux
+    bankAggregates_t bank = {};
+    portMUX_TYPE bankMux = portMUX_INITIALIZER_UNLOCKED;
+
+    uint32_t pollStarted = 0; // micros() when the current poll started
+    uint32_t stageStarted = 0; // micros() when the current poll stage started
+    uint8_t stagesRecorded = 0; // bitmask of the pollStage_t's we have recorded this poll
+    uint32_t sweepStarted = 0; // millis() when we last refilled the polling queue
+    uint32_t lastSweepDuration = 0; // in ms
+    uint32_t totalSweeps = 0;
+    uint32_t lastSweepStarted = 0; // millis(), unlike sweepStarted this isn't cleared when the sweep finishes
+    uint32_t pollInterval = POLL_INTERVAL;
+    uint16_t requestedPolls = 0; // batteries queued by pollNow() that haven't been polled yet
+
+    publishDeadbands_t deadbands = { DEADBAND_VOLTAGE, DEADBAND_CURRENT, DEADBAND_SOC, DEADBAND_TEMP, DEADBAND_MAX_AGE };
             
-    CircularBuffer<batteryInfo_t *, 50> pollingQueue;
+    uint16_t sweepCursor = 0; // index in batteryData of the next battery in this sweep
+    CircularBuffer<batteryInfo_t *, POLL_QUEUE_SIZE> pollingQueue;
     
     static BatteryManager *m_instance;
 };
@@ -0,0 +1,315 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "CommandManager.h"
+#include "BatteryManager.h"
+
+CommandManager *CommandManager::m_instance = NULL;
+
+static const char *commandTypeNames[] = {
+  "poll",
+  "set",
+  "rescan",
+  "unknown"
+};
+
+static const char *commandStatusNames[] = {
+  "ok",
+  "failed",
+  "timeout",
+  "pending"
+};
+
+CommandManager *CommandManager::instance()
+{
+  if(!m_instance) {
+    m_instance = new CommandManager();
+  }
+
+  return m_instance;
+}
+
+/**
+ * Poll the battery with the given address as soon as whatever poll is in progress
+ * is done. Acknowledged once its frame has been decoded.
+ */
+void CommandManager::poll(const char *id, const char *address)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  command_t command;
+  command_t *tracked;
+
+  prepare(&command, id, COMMAND_POLL);
+
+  if(address) {
+    command.battery = batteryManager->findBattery(BLEAddress(std::string(address)));
+  }
+
+  if(!command.battery) {
+    complete(&command, COMMAND_FAILED, "unknown battery");
+    return;
+  }
+
+  if(!LeaseManager::instance()->mayPoll(command.battery)) {
+    complete(&command, COMMAND_FAILED, "not owned by this gateway");
+    return;
+  }
+
+  if(!(tracked = track(&command))) {
+    complete(&command, COMMAND_FAILED, "too many commands pending");
+    return;
+  }
+
+  if(!batteryManager->pollNow(command.battery)) {
+    complete(tracked, COMMAND_FAILED, "polling queue full");
+  }
+}
+
+/**
+ * Changes the poll interval and the publish deadbands, both take effect right away
+ */
+void CommandManager::set(const char *id, uint32_t pollInterval, const publishDeadbands_t *deadbands)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  command_t command;
+
+  prepare(&command, id, COMMAND_SET);
+
+  batteryManager->setPollInterval(pollInterval);
+  batteryManager->setDeadbands(deadbands);
+
+  Serial.printf("- Poll interval now %u ms, deadbands %u mV %u mA %u%% %u (0.1C), max age %u ms\n", pollInterval,
+                deadbands->voltage, deadbands->current, deadbands->soc, deadbands->temp, deadbands->maxAge);
+
+  complete(&command, COMMAND_OK, NULL);
+}
+
+/**
+ * Asks for a rescan, which the main loop starts once no battery is connected (see
+ * takeRescan()). Acknowledged when the scan completes.
+ */
+void CommandManager::rescan(const char *id)
+{
+  command_t command;
+
+  prepare(&command, id, COMMAND_RESCAN);
+
+  if(!track(&command)) {
+    complete(&command, COMMAND_FAILED, "too many commands pending");
+    return;
+  }
+
+  portENTER_CRITICAL(&mux);
+  rescanWanted = true;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Acknowledges a command we couldn't make sense of
+ */
+void CommandManager::reject(const char *id, const char *error)
+{
+  command_t command;
+
+  prepare(&command, id, COMMAND_UNKNOWN);
+  complete(&command, COMMAND_FAILED, error);
+}
+
+/**
+ * Called from processBuffer() (so from the BLE task) for every decoded frame,
+ * completes any polls waiting on that battery and makes sure the frame gets
+ * published whatever the deadbands say.
+ */
+void CommandManager::frameDecoded(batteryInfo_t *battery)
+{
+  for(int i = 0; i < COMMAND_MAX_PENDING; i++) {
+    if((pending[i].status == COMMAND_PENDING) && (pending[i].type == COMMAND_POLL) && (pending[i].battery == battery)) {
+      battery->published.forced = true;
+      complete(&pending[i], COMMAND_OK, NULL);
+    }
+  }
+}
+
+/**
+ * True (once) if a rescan has been asked for
+ */
+bool CommandManager::takeRescan()
+{
+  bool wanted;
+
+  portENTER_CRITICAL(&mux);
+  wanted = rescanWanted;
+  rescanWanted = false;
+  portEXIT_CRITICAL(&mux);
+
+  return wanted;
+}
+
+void CommandManager::scanComplete()
+{
+  for(int i = 0; i < COMMAND_MAX_PENDING; i++) {
+    if((pending[i].status == COMMAND_PENDING) && (pending[i].type == COMMAND_RESCAN)) {
+      complete(&pending[i], COMMAND_OK, NULL);
+    }
+  }
+}
+
+/**
+ * Times out anything that has been waiting longer than COMMAND_TIMEOUT, i.e. a
+ * battery that has stopped answering
+ */
+void CommandManager::loop()
+{
+  for(int i = 0; i < COMMAND_MAX_PENDING; i++) {
+    if((pending[i].status == COMMAND_PENDING) && ((millis() - pending[i].received) >= COMMAND_TIMEOUT)) {
+      complete(&pending[i], COMMAND_TIMED_OUT, NULL);
+    }
+  }
+}
+
+/**
+ * Copies the oldest acknowledgement into command without removing it, so it can
+ * stay queued if the publish fails. Call shiftAck() once it's been published.
+ */
+bool CommandManager::peekAck(command_t *command)
+{
+  bool found = false;
+
+  portENTER_CRITICAL(&mux);
+
+  if(!acks.isEmpty()) {
+    *command = acks.first();
+    found = true;
+  }
+
+  portEXIT_CRITICAL(&mux);
+
+  return found;
+}
+
+void CommandManager::shiftAck()
+{
+  portENTER_CRITICAL(&mux);
+
+  if(!acks.isEmpty()) {
+    acks.shift();
+  }
+
+  portEXIT_CRITICAL(&mux);
+}
+
+void CommandManager::prepare(command_t *command, const char *id, commandType_t type)
+{
+  memset(command, 0, sizeof(command_t));
+
+  strncpy(command->id, id ? id : "", sizeof(command->id) - 1);
+  command->type = type;
+  command->status = COMMAND_PENDING;
+  command->received = millis();
+}
+
+/**
+ * Copies the command into a free pending slot, returns the slot or NULL if
+ * there wasn't one
+ */
+command_t *CommandManager::track(command_t *command)
+{
+  command_t *slot = NULL;
+
+  portENTER_CRITICAL(&mux);
+
+  for(int i = 0; i < COMMAND_MAX_PENDING; i++) {
+    if(pending[i].status != COMMAND_PENDING) {
+      slot = &pending[i];
+      *slot = *command;
+      break;
+    }
+  }
+
+  portEXIT_CRITICAL(&mux);
+
+  return slot;
+}
+
+/**
+ * Finishes the command and queues its acknowledgement. If it was in a pending
+ * slot that frees the slot up. The BLE task and the main loop can both try to
+ * finish the same poll (decoded vs timed out), only the first one counts.
+ */
+void CommandManager::complete(command_t *command, commandStatus_t status, const char *error)
+{
+  command_t done;
+  bool dropped;
+
+  portENTER_CRITICAL(&mux);
+
+  if(command->status != COMMAND_PENDING) {
+    portEXIT_CRITICAL(&mux);
+    return;
+  }
+
+  command->status = status;
+  command->error = error;
+  command->completed = millis();
+
+  done = *command;
+  dropped = acks.isFull(); // push() is about to drop the oldest ack
+
+  acks.push(done);
+
+  if((done.type == COMMAND_RESCAN) && (status == COMMAND_TIMED_OUT)) {
+    rescanWanted = false; // never got started and nobody is waiting on it any more
+  }
+
+  portEXIT_CRITICAL(&mux);
+
+  if(dropped) {
+    Serial.println("- FAILED: Command ack queue full, the oldest ack was dropped");
+  }
+
+  Serial.printf("- Command '%s' (%s) %s in %u ms\n", done.id, commandTypeNames[done.type],
+                commandStatusNames[status], done.completed - done.received);
+}
+
+/**
+ * Looks up a command by the name it's sent with
+ */
+commandType_t CommandManager::commandType(const char *name)
+{
+  for(int i = 0; i < COMMAND_UNKNOWN; i++) {
+    if(name && !strcmp(name, commandTypeNames[i])) {
+      return (commandType_t)i;
+    }
+  }
+
+  return COMMAND_UNKNOWN;
+}
+
+const char *CommandManager::commandTypeName(commandType_t type)
+{
+  return commandTypeNames[type];
+}
+
+const char *CommandManager::commandStatusName(commandStatus_t status)
+{
+  return commandStatusNames[status];
+}
@@ -0,0 +1,124 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFECOMMANDMGR_H_
+#define LIFECOMMANDMGR_H_
+
+#include "Arduino.h"
+#include <CircularBuffer.h>
+
+// How many polls / rescans can be waiting to complete at once
+#ifndef COMMAND_MAX_PENDING
+#define COMMAND_MAX_PENDING 8
+#endif
+
+#ifndef COMMAND_ACK_QUEUE_SIZE
+#define COMMAND_ACK_QUEUE_SIZE 16
+#endif
+
+// ms a poll or rescan gets to complete before it's acknowledged as timed out
+#ifndef COMMAND_TIMEOUT
+#define COMMAND_TIMEOUT 60000
+#endif
+
+#define COMMAND_ID_SIZE 24
+
+enum commandType_t {
+  COMMAND_POLL = 0, // poll a battery now, ahead of everything else
+  COMMAND_SET, // change the poll interval and / or publish deadbands
+  COMMAND_RESCAN, // scan for batteries again
+  COMMAND_UNKNOWN
+};
+
+enum commandStatus_t {
+  COMMAND_OK = 0,
+  COMMAND_FAILED,
+  COMMAND_TIMED_OUT,
+  COMMAND_PENDING // only while it's waiting to complete
+};
+
+struct batteryInfo_t;
+struct publishDeadbands_t;
+
+/**
+ * A single command, from when it's received until it's acknowledged
+ */
+struct command_t {
+  char id[COMMAND_ID_SIZE]; // whatever the sender wants back in the ack
+  commandType_t type;
+  commandStatus_t status;
+  batteryInfo_t *battery; // COMMAND_POLL only
+  const char *error; // why it failed, COMMAND_FAILED only
+  uint32_t received; // millis()
+  uint32_t completed; // millis()
+};
+
+/**
+ * Carries out commands from the outside world. The sketch takes them off MQTT and
+ * hands them over; commands that finish straight away are acknowledged straight
+ * away, polls are acknowledged when the battery's frame has been decoded and
+ * rescans when the scan is done. Every acknowledgement is queued for the main
+ * loop to publish along with how long the command took.
+ */
+class CommandManager
+{
+
+public:
+  void poll(const char *, const char *);
+  void set(const char *, uint32_t, const publishDeadbands_t *);
+  void rescan(const char *);
+  void reject(const char *, const char *);
+
+  void frameDecoded(batteryInfo_t *);
+  bool takeRescan();
+  void scanComplete();
+  void loop();
+
+  bool peekAck(command_t *);
+  void shiftAck();
+
+  static commandType_t commandType(const char *);
+  static const char *commandTypeName(commandType_t);
+  static const char *commandStatusName(commandStatus_t);
+
+  static CommandManager *instance();
+
+private:
+  CommandManager() {};
+  CommandManager(CommandManager const &) {};
+  CommandManager& operator=(CommandManager const &) { return *this; };
+
+  void prepare(command_t *, const char *, commandType_t);
+  command_t *track(command_t *);
+  void complete(command_t *, commandStatus_t, const char *);
+
+  command_t pending[COMMAND_MAX_PENDING] = {}; // a slot is free unless its status is COMMAND_PENDING
+  bool rescanWanted = false;
+
+  CircularBuffer<command_t, COMMAND_ACK_QUEUE_SIZE> acks;
+
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+  static CommandManager *m_instance;
+};
+
+#endif
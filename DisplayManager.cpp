@@ -107,7 +107,11 @@ DisplayManager *DisplayManager::instance()
 
 
 
-void DisplayManager::setup()
+/**
+ * Starts the display, showing the logo for a few seconds unless splash is false
+ * (waking up from a deep sleep, where every second awake counts)
+ */
+void DisplayManager::setup(bool splash)
 {
   if(!display->begin(SSD1306_SWITCHCAPVCC, OLED_ADDRESS)) {
     Serial.println("SSD1306 Failed to initailize");
@@ -116,19 +120,34 @@ void DisplayManager::setup()
   
   display->clearDisplay();
 
-  display->drawBitmap(0, 3, logo, 128, 58, 1);
-
   display->setTextSize(1);
   display->setTextColor(WHITE);
   display->setCursor(0, 0);
   display->cp437(true);
 
+  if(!splash) {
+    display->display();
+    return;
+  }
+
+  display->drawBitmap(0, 3, logo, 128, 58, 1);
+
   display->display();
   delay(5000);
   display->clearDisplay();
   display->display();
 }
 
+/**
+ * Blanks the panel and turns it off, it stays off until setup() is called again
+ */
+void DisplayManager::off()
+{
+  display->clearDisplay();
+  display->display();
+  display->ssd1306_command(SSD1306_DISPLAYOFF);
+}
+
 void DisplayManager::scanningScreen(uint8_t percent)
 {
   display->clearDisplay();
@@ -172,7 +191,7 @@ void DisplayManager::statusScreen()
   display->clearDisplay();
   display->setCursor(0, 0);
   display->println("LiFeBlue Monitor");
-  display->printf("%s RSSI:%ddb", batteryInfo->bname, batteryInfo->device->getRSSI());
+  display->printf("%s RSSI:%ddb", batteryInfo->bname, batteryInfo->rssi);
   
   display->setCursor(0,20);
   display->printf("V: %.2fV\nC: %.2fA\nSoC: %u%%\nT: %.1fC", 
@@ -181,7 +200,7 @@ void DisplayManager::statusScreen()
                   batteryInfo->soc,
                   (float)batteryInfo->temp / 10);
 
-  totalCells = batteryManager->getTotalCells();
+  totalCells = batteryInfo->totalCells;
 
   if(totalCells > 0) {
     display->setCursor(65, 20);
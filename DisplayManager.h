@@ -63,7 +63,8 @@ class DisplayManager
 {
 
 public:
-  void setup();
+  void setup(bool splash = true);
+  void off();
 
   void scanningScreen(uint8_t);
   void statusScreen();
@@ -81,7 +82,7 @@ private:
   static DisplayManager *m_instance;
   Adafruit_SSD1306 *display;
   BatteryManager *batteryManager;
-  uint8_t currentBattery;
+  uint16_t currentBattery;
 };
 
 #endif
@@ -0,0 +1,225 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "FrameCapture.h"
+#include "os.h"
+
+FrameCapture *FrameCapture::m_instance = NULL;
+
+FrameCapture::FrameCapture()
+{
+  ring = (uint8_t *)os_zalloc(CAPTURE_BUFFER_SIZE);
+
+  Serial.printf("- Created FrameCapture with a %d byte ring\n", CAPTURE_BUFFER_SIZE);
+}
+
+FrameCapture *FrameCapture::instance()
+{
+  if(!m_instance) {
+    m_instance = new FrameCapture();
+  }
+
+  return m_instance;
+}
+
+/**
+ * Copies len bytes into the ring at the current tail, wrapping around the end
+ * of the ring if we need to. The caller has to make sure there is room.
+ */
+void FrameCapture::write(const uint8_t *data, size_t len)
+{
+  size_t tail = (head + used) % CAPTURE_BUFFER_SIZE;
+
+  for(size_t i = 0; i < len; i++) {
+    ring[tail] = data[i];
+    tail = (tail + 1) % CAPTURE_BUFFER_SIZE;
+  }
+
+  used += len;
+}
+
+/**
+ * Copies len bytes out of the ring starting at offset (relative to the ring, not
+ * the oldest record) into out.
+ */
+void FrameCapture::read(size_t offset, uint8_t *out, size_t len)
+{
+  for(size_t i = 0; i < len; i++) {
+    out[i] = ring[(offset + i) % CAPTURE_BUFFER_SIZE];
+  }
+}
+
+/**
+ * Throws away the oldest record in the ring
+ */
+void FrameCapture::evictOldest()
+{
+  captureHeader_t header;
+  size_t recordSize;
+
+  read(head, (uint8_t *)&header, sizeof(header));
+
+  recordSize = sizeof(header) + header.length;
+
+  head = (head + recordSize) % CAPTURE_BUFFER_SIZE;
+  used -= recordSize;
+  records--;
+  evictedRecords++;
+}
+
+/**
+ * Store a single notification fragment. This is called from the notification
+ * callback (so from the BLE task) and has to be quick, there's no allocation or
+ * I/O in here.
+ */
+void FrameCapture::record(BLEAddress address, uint8_t *data, size_t length)
+{
+  captureHeader_t header;
+  size_t recordSize = sizeof(header) + length;
+
+  if(!ring) {
+    return;
+  }
+
+  portENTER_CRITICAL(&mux);
+
+  if(paused || (recordSize > CAPTURE_BUFFER_SIZE)) {
+    droppedRecords++;
+    portEXIT_CRITICAL(&mux);
+    return;
+  }
+
+  header.timestamp = micros();
+  memcpy(header.address, address.getNative(), sizeof(header.address));
+  header.length = length;
+
+  while((CAPTURE_BUFFER_SIZE - used) < recordSize) {
+    evictOldest();
+  }
+
+  write((uint8_t *)&header, sizeof(header));
+  write(data, length);
+
+  records++;
+
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Throw away everything we have captured so far
+ */
+void FrameCapture::clear()
+{
+  portENTER_CRITICAL(&mux);
+  head = 0;
+  used = 0;
+  records = 0;
+  evictedRecords = 0;
+  droppedRecords = 0;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Write every record in the ring (oldest first) to the given output, which is
+ * usually Serial or a File. Recording is paused for the duration of the dump so
+ * the ring doesn't move underneath us, anything that arrives in the meantime is
+ * counted as dropped. Returns how many records were written.
+ */
+uint32_t FrameCapture::dump(Print &out)
+{
+  captureHeader_t header;
+  uint8_t fragment[512];
+  size_t offset;
+  size_t remaining;
+  uint32_t written;
+
+  portENTER_CRITICAL(&mux);
+  paused = true;
+  portEXIT_CRITICAL(&mux);
+
+  written = records;
+
+  out.printf("# lifeblue-capture v1 records=%u evicted=%u dropped=%u\n", records, evictedRecords, droppedRecords);
+
+  offset = head;
+  remaining = used;
+
+  while(remaining >= sizeof(header)) {
+    read(offset, (uint8_t *)&header, sizeof(header));
+    offset = (offset + sizeof(header)) % CAPTURE_BUFFER_SIZE;
+
+    read(offset, fragment, (header.length > sizeof(fragment)) ? sizeof(fragment) : header.length);
+    offset = (offset + header.length) % CAPTURE_BUFFER_SIZE;
+    remaining -= sizeof(header) + header.length;
+
+    out.printf("F %u %02x:%02x:%02x:%02x:%02x:%02x ", header.timestamp,
+               header.address[0], header.address[1], header.address[2],
+               header.address[3], header.address[4], header.address[5]);
+
+    for(size_t i = 0; (i < header.length) && (i < sizeof(fragment)); i++) {
+      out.printf("%02x", fragment[i]);
+    }
+
+    out.println("");
+  }
+
+  portENTER_CRITICAL(&mux);
+  paused = false;
+  portEXIT_CRITICAL(&mux);
+
+  return written;
+}
+
+/**
+ * Dump the capture ring to a file on flash (i.e. SPIFFS) so it survives a reboot
+ */
+bool FrameCapture::dumpToFile(fs::FS &fs, const char *path)
+{
+  File file = fs.open(path, FILE_WRITE);
+  uint32_t written;
+
+  if(!file) {
+    Serial.printf("- FAILED: Could not open '%s' for writing capture\n", path);
+    return false;
+  }
+
+  written = dump(file);
+  file.close();
+
+  Serial.printf("- Wrote %u captured fragments to '%s'\n", written, path);
+  return true;
+}
+
+uint32_t FrameCapture::getRecords()
+{
+  return records;
+}
+
+uint32_t FrameCapture::getEvictedRecords()
+{
+  return evictedRecords;
+}
+
+uint32_t FrameCapture::getDroppedRecords()
+{
+  return droppedRecords;
+}
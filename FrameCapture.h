@@ -0,0 +1,102 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFEFRAMECAPTURE_H_
+#define LIFEFRAMECAPTURE_H_
+
+#include "Arduino.h"
+#include <BLEDevice.h>
+#include <FS.h>
+#include "lifeblue.h"
+
+#ifndef CAPTURE_BUFFER_SIZE
+#define CAPTURE_BUFFER_SIZE 16384
+#endif
+
+#define CAPTURE_FILE_PATH "/capture.txt"
+
+/**
+ * Every raw notification fragment is stored in the ring with this header
+ * in front of it, followed by `length` bytes of fragment data.
+ */
+struct captureHeader_t {
+  uint32_t timestamp; // micros() when the fragment arrived
+  uint8_t  address[6]; // battery address, as esp_bd_addr_t
+  uint16_t length; // fragment length in bytes
+};
+
+/**
+ * Records the raw BLE notification fragments exactly as they come out of the
+ * stack into a fixed size ring buffer so that they can be dumped later and replayed
+ * on a host through the same decoder (see tools/replay).
+ *
+ * When the ring is full the oldest fragments are thrown away to make room, so what
+ * you get is always the most recent CAPTURE_BUFFER_SIZE bytes worth of traffic.
+ *
+ * The dump format is line oriented text so it survives being copy/pasted out of a
+ * serial monitor:
+ *
+ * F <timestamp in us> <aa:bb:cc:dd:ee:ff> <fragment as hex>
+ *
+ * Any line that doesn't start with "F " is ignored by the replay tool, so the
+ * dump can be mixed in with the rest of the serial output.
+ */
+class FrameCapture
+{
+
+public:
+  void record(BLEAddress, uint8_t *, size_t);
+  void clear();
+
+  uint32_t dump(Print &);
+  bool dumpToFile(fs::FS &, const char *);
+
+  uint32_t getRecords();
+  uint32_t getEvictedRecords();
+  uint32_t getDroppedRecords();
+
+  static FrameCapture *instance();
+
+private:
+  FrameCapture();
+  FrameCapture(FrameCapture const &) {};
+  FrameCapture& operator=(FrameCapture const &) { return *this; };
+
+  void write(const uint8_t *, size_t);
+  void read(size_t, uint8_t *, size_t);
+  void evictOldest();
+
+  uint8_t *ring = NULL;
+  size_t head = 0; // offset of the oldest record
+  size_t used = 0; // bytes currently in the ring
+
+  uint32_t records = 0; // still in the ring
+  uint32_t evictedRecords = 0; // thrown away to make room for newer ones
+  uint32_t droppedRecords = 0; // never stored, too big or arrived during a dump
+  volatile bool paused = false;
+
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+  static FrameCapture *m_instance;
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "HeapMonitor.h"
+
+HeapMonitor *HeapMonitor::m_instance = NULL;
+
+static const char *allocSiteNames[ALLOC_SITE_COUNT] = {
+  "ble_client",
+  "battery_data",
+  "publish_topic",
+  "publish_json",
+  "publish_buffer"
+};
+
+HeapMonitor *HeapMonitor::instance()
+{
+  if(!m_instance) {
+    m_instance = new HeapMonitor();
+  }
+
+  return m_instance;
+}
+
+/**
+ * FreeRTOS already keeps the high-water mark for us, all we need is to ask from
+ * the right task.
+ */
+void HeapMonitor::sampleLoopTask()
+{
+  loopStackHighWater = uxTaskGetStackHighWaterMark(NULL);
+}
+
+void HeapMonitor::sampleBLETask()
+{
+  bleStackHighWater = uxTaskGetStackHighWaterMark(NULL);
+}
+
+heapStats_t HeapMonitor::getStats()
+{
+  heapStats_t stats;
+
+  stats.freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  stats.largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  stats.minFreeHeap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  stats.fragmentation = stats.freeHeap ? 100 - (uint8_t)(((uint64_t)stats.largestFreeBlock * 100) / stats.freeHeap) : 0;
+  stats.loopStackHighWater = loopStackHighWater;
+  stats.bleStackHighWater = bleStackHighWater;
+
+  return stats;
+}
+
+void HeapMonitor::trackAlloc(allocSite_t site, size_t bytes)
+{
+  portENTER_CRITICAL(&mux);
+  allocCounters[site].allocs++;
+  allocCounters[site].bytes += bytes;
+  portEXIT_CRITICAL(&mux);
+}
+
+void HeapMonitor::trackFree(allocSite_t site)
+{
+  portENTER_CRITICAL(&mux);
+  allocCounters[site].frees++;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * A copy, so the allocs and frees in it were counted at the same moment
+ */
+allocCounter_t HeapMonitor::getAllocCounter(allocSite_t site)
+{
+  allocCounter_t counter;
+
+  portENTER_CRITICAL(&mux);
+  counter = allocCounters[site];
+  portEXIT_CRITICAL(&mux);
+
+  return counter;
+}
+
+const char *HeapMonitor::allocSiteName(allocSite_t site)
+{
+  if(site >= ALLOC_SITE_COUNT) {
+    return "unknown";
+  }
+
+  return allocSiteNames[site];
+}
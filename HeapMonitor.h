@@ -0,0 +1,105 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFEHEAPMONITOR_H_
+#define LIFEHEAPMONITOR_H_
+
+#include "Arduino.h"
+#include "lifeblue.h"
+#include <esp_heap_caps.h>
+
+/**
+ * The places we allocate memory on a regular basis (i.e. not just once at boot)
+ * that we keep counters for when TRACK_ALLOCATIONS is defined.
+ */
+enum allocSite_t {
+  ALLOC_SITE_BLE_CLIENT = 0, // BLEDevice::createClient(), once, every poll shares it
+  ALLOC_SITE_BATTERY_DATA, // batteryInfo_t and its buffer
+  ALLOC_SITE_PUBLISH_TOPIC, // topic strings built for a publish
+  ALLOC_SITE_PUBLISH_JSON, // DynamicJsonDocument for a publish
+  ALLOC_SITE_PUBLISH_BUFFER, // serialized JSON for a publish
+  ALLOC_SITE_COUNT
+};
+
+struct allocCounter_t {
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t bytes; // total bytes ever allocated from this site
+};
+
+struct heapStats_t {
+  uint32_t freeHeap;
+  uint32_t largestFreeBlock;
+  uint32_t minFreeHeap; // lowest free heap since boot
+  uint8_t  fragmentation; // 0-100%, how much of the free heap isn't in the largest block
+  uint32_t loopStackHighWater; // bytes of the loop() task stack never used
+  uint32_t bleStackHighWater; // bytes of the BLE callback task stack never used
+};
+
+#ifdef TRACK_ALLOCATIONS
+#define TRACK_ALLOC(_site, _bytes) HeapMonitor::instance()->trackAlloc(_site, _bytes)
+#define TRACK_FREE(_site) HeapMonitor::instance()->trackFree(_site)
+#else
+#define TRACK_ALLOC(_site, _bytes)
+#define TRACK_FREE(_site)
+#endif
+
+/**
+ * Keeps an eye on the heap and the stacks of the tasks we run code in so that
+ * leaks and fragmentation show up in the metrics long before they turn into a
+ * crash.
+ *
+ * sampleLoopTask() and sampleBLETask() need to be called from the task in
+ * question since that's the only task we can reliably get the handle of, the
+ * BLE task in particular belongs to the BLE stack.
+ */
+class HeapMonitor
+{
+
+public:
+  void sampleLoopTask();
+  void sampleBLETask();
+  heapStats_t getStats();
+
+  void trackAlloc(allocSite_t, size_t);
+  void trackFree(allocSite_t);
+  allocCounter_t getAllocCounter(allocSite_t);
+
+  static const char *allocSiteName(allocSite_t);
+  static HeapMonitor *instance();
+
+private:
+  HeapMonitor() {};
+  HeapMonitor(HeapMonitor const &) {};
+  HeapMonitor& operator=(HeapMonitor const &) { return *this; };
+
+  uint32_t loopStackHighWater = 0;
+  uint32_t bleStackHighWater = 0;
+
+  // Bumped from the loop() and BLE callback tasks both
+  allocCounter_t allocCounters[ALLOC_SITE_COUNT] = {};
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+  static HeapMonitor *m_instance;
+};
+
+#endif
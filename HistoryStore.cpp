@@ -0,0 +1,618 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "HistoryStore.h"
+#include "BatteryManager.h"
+
+HistoryStore *HistoryStore::m_instance = NULL;
+
+static const char *historyChannelNames[HISTORY_CHANNELS] = {
+  "voltage",
+  "current",
+  "soc",
+  "temp",
+  "min_cell",
+  "max_cell"
+};
+
+/**
+ * Saved histories are written behind this header, the size of batteryHistory_t is
+ * in there so a history saved by a build with different HISTORY_* settings isn't
+ * read back as garbage.
+ */
+struct historyFileHeader_t {
+  uint32_t magic;
+  uint32_t entrySize;
+  uint32_t clock;
+  uint16_t count;
+};
+
+static uint8_t putVarint(uint8_t *out, uint32_t value)
+{
+  uint8_t length = 0;
+
+  while(value >= 0x80) {
+    out[length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+
+  out[length++] = value;
+
+  return length;
+}
+
+static uint8_t getVarint(const uint8_t *in, uint32_t *value)
+{
+  uint8_t length = 0;
+  uint8_t shift = 0;
+
+  *value = 0;
+
+  do {
+    *value |= (uint32_t)(in[length] & 0x7f) << shift;
+    shift += 7;
+  } while(in[length++] & 0x80);
+
+  return length;
+}
+
+/**
+ * Zigzag encoding maps small negative numbers to small positive ones
+ * (0, -1, 1, -2... becomes 0, 1, 2, 3...) so they pack into short varints too
+ */
+static uint32_t zigzag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static void addToRollup(historyRollup_t *rollup, const historySample_t *sample)
+{
+  for(int i = 0; i < HISTORY_CHANNELS; i++) {
+    if(sample->values[i] < rollup->min[i]) {
+      rollup->min[i] = sample->values[i];
+    }
+
+    if(sample->values[i] > rollup->max[i]) {
+      rollup->max[i] = sample->values[i];
+    }
+
+    rollup->sum[i] += sample->values[i];
+  }
+
+  rollup->count++;
+}
+
+const char *historyChannelName(historyChannel_t channel)
+{
+  if(channel >= HISTORY_CHANNELS) {
+    return "unknown";
+  }
+
+  return historyChannelNames[channel];
+}
+
+HistoryStore *HistoryStore::instance()
+{
+  if(!m_instance) {
+    m_instance = new HistoryStore();
+  }
+
+  return m_instance;
+}
+
+HistoryStore::HistoryStore()
+{
+  lock = xSemaphoreCreateMutex();
+}
+
+/**
+ * Binary search of the histories by address. Returns the index of the history if
+ * it's there, otherwise -(index it would go at) - 1.
+ */
+int32_t HistoryStore::search(const uint8_t *address)
+{
+  int32_t low = 0;
+  int32_t high = (int32_t)totalHistories - 1;
+  int32_t middle;
+  int compare;
+
+  while(low <= high) {
+    middle = (low + high) / 2;
+    compare = memcmp(histories[middle]->address, address, sizeof(histories[middle]->address));
+
+    if(compare == 0) {
+      return middle;
+    }
+
+    if(compare < 0) {
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  return -low - 1;
+}
+
+batteryHistory_t *HistoryStore::find(const uint8_t *address)
+{
+  int32_t index = search(address);
+
+  return (index >= 0) ? histories[index] : NULL;
+}
+
+/**
+ * Histories are only allocated once a battery has something to put in them, and
+ * the list of them grows as it needs to
+ */
+batteryHistory_t *HistoryStore::create(const uint8_t *address)
+{
+  batteryHistory_t *history;
+  batteryHistory_t **grown;
+  int32_t index = -search(address) - 1;
+  uint16_t size;
+
+  if(totalHistories >= HISTORY_MAX_BATTERIES) {
+    return NULL;
+  }
+
+  if(totalHistories == allocatedHistories) {
+    size = allocatedHistories ? allocatedHistories * 2 : 4;
+    size = (size > HISTORY_MAX_BATTERIES) ? HISTORY_MAX_BATTERIES : size;
+
+    grown = (batteryHistory_t **)realloc(histories, sizeof(batteryHistory_t *) * size);
+
+    if(!grown) {
+      Serial.println("- FAILED: Could not grow the battery history list");
+      return NULL;
+    }
+
+    histories = grown;
+    allocatedHistories = size;
+  }
+
+  history = (batteryHistory_t *)os_zalloc(sizeof(batteryHistory_t));
+
+  if(!history) {
+    Serial.println("- FAILED: Could not allocate battery history");
+    return NULL;
+  }
+
+  memcpy(history->address, address, sizeof(history->address));
+
+  memmove(&histories[index + 1], &histories[index], sizeof(batteryHistory_t *) * (totalHistories - index));
+  histories[index] = history;
+  totalHistories++;
+
+  return history;
+}
+
+/**
+ * The history clock, in seconds. It's the time since boot plus wherever the clock
+ * had got to when the history we loaded from flash was saved. Has to be called
+ * with the store locked.
+ */
+uint32_t HistoryStore::advanceClock()
+{
+  uint32_t ms = millis();
+
+  elapsed += ms - lastMillis; // millis() wraps after ~49 days, this doesn't
+  lastMillis = ms;
+
+  return clockBase + (uint32_t)(elapsed / 1000);
+}
+
+uint32_t HistoryStore::now()
+{
+  uint32_t time;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  time = advanceClock();
+  xSemaphoreGive(lock);
+
+  return time;
+}
+
+/**
+ * Adds a decoded frame to its battery's history. The sample is dated when the
+ * frame was decoded, not when it got here through the pipeline.
+ */
+void HistoryStore::record(const telemetrySnapshot_t *snapshot)
+{
+  batteryHistory_t *history;
+  historySample_t sample;
+  uint8_t *address = snapshot->battery->bdAddress;
+  uint32_t age = millis() - snapshot->timestamp;
+
+  sample.values[HISTORY_VOLTAGE] = snapshot->voltage;
+  sample.values[HISTORY_CURRENT] = snapshot->current;
+  sample.values[HISTORY_SOC] = snapshot->soc;
+  sample.values[HISTORY_TEMP] = (int16_t)snapshot->temp;
+  sample.values[HISTORY_MIN_CELL] = snapshot->minCell;
+  sample.values[HISTORY_MAX_CELL] = snapshot->maxCell;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  // Worked out in ms, rounding the clock and the age separately can put a sample
+  // a second before the one decoded ahead of it
+  advanceClock();
+  sample.time = clockBase + (uint32_t)((elapsed - ((age < elapsed) ? age : elapsed)) / 1000);
+  history = find(address);
+
+  if(!history) {
+    history = create(address);
+  }
+
+  if(history) {
+    append(history, &sample);
+    rollup(&history->minute, history->minutes, &history->firstMinute, &history->usedMinutes,
+           HISTORY_MINUTE_ROLLUPS, 60, &sample);
+    rollup(&history->hour, history->hours, &history->firstHour, &history->usedHours,
+           HISTORY_HOUR_ROLLUPS, 3600, &sample);
+  }
+
+  xSemaphoreGive(lock);
+}
+
+/**
+ * Frames restored after a deep sleep were recorded the first time around
+ */
+bool HistorySink::write(const telemetrySnapshot_t *snapshot)
+{
+  if(!snapshot->restored) {
+    HistoryStore::instance()->record(snapshot);
+  }
+
+  return true;
+}
+
+/**
+ * Encodes the sample onto the end of the newest block, starting a new block (and
+ * throwing the oldest away if the ring is full) when it might not fit.
+ */
+void HistoryStore::append(batteryHistory_t *history, historySample_t *sample)
+{
+  historyBlock_t *block = NULL;
+  uint8_t current;
+
+  if(history->usedBlocks) {
+    block = &history->blocks[(history->firstBlock + history->usedBlocks - 1) % HISTORY_BLOCKS];
+  }
+
+  if(!block || (block->length + HISTORY_MAX_SAMPLE_SIZE > HISTORY_BLOCK_SIZE) || (sample->time < block->end)) {
+
+    if(history->usedBlocks < HISTORY_BLOCKS) {
+      history->usedBlocks++;
+    } else {
+      history->firstBlock = (history->firstBlock + 1) % HISTORY_BLOCKS;
+    }
+
+    current = (history->firstBlock + history->usedBlocks - 1) % HISTORY_BLOCKS;
+    block = &history->blocks[current];
+
+    block->start = sample->time;
+    block->end = sample->time;
+    block->samples = 0;
+    block->length = 0;
+
+    memset(&history->last, 0, sizeof(history->last));
+    history->last.time = sample->time;
+  }
+
+  block->length += putVarint(&block->data[block->length], sample->time - history->last.time);
+
+  for(int i = 0; i < HISTORY_CHANNELS; i++) {
+    block->length += putVarint(&block->data[block->length], zigzag(sample->values[i] - history->last.values[i]));
+  }
+
+  block->samples++;
+  block->end = sample->time;
+  history->last = *sample;
+}
+
+/**
+ * Folds the sample into the rollup in progress, first moving that rollup into
+ * the ring if the sample belongs to the next period.
+ *
+ * A sample from before the period in progress goes into the ring entry for its
+ * own period, or into the current one if that's been thrown away (or never had
+ * any samples), so the ring never gets a duplicate or out of order period.
+ */
+void HistoryStore::rollup(historyRollup_t *current, historyRollup_t *ring, uint8_t *first, uint8_t *used,
+                          uint8_t size, uint32_t period, historySample_t *sample)
+{
+  uint32_t start = sample->time - (sample->time % period);
+  historyRollup_t *entry;
+  historyRollup_t *late;
+
+  if(current->count && (start < current->start)) {
+    late = current;
+
+    for(uint8_t i = *used; i > 0; i--) {
+      entry = &ring[(*first + i - 1) % size];
+
+      if(entry->start <= start) {
+        late = (entry->start == start) ? entry : current;
+        break;
+      }
+    }
+
+    addToRollup(late, sample);
+    return;
+  }
+
+  if(current->count && (current->start != start)) {
+    if(*used < size) {
+      (*used)++;
+    } else {
+      *first = (*first + 1) % size;
+    }
+
+    ring[(*first + *used - 1) % size] = *current;
+    current->count = 0;
+  }
+
+  if(!current->count) {
+    current->start = start;
+
+    for(int i = 0; i < HISTORY_CHANNELS; i++) {
+      current->min[i] = current->max[i] = sample->values[i];
+      current->sum[i] = 0;
+    }
+  }
+
+  addToRollup(current, sample);
+}
+
+/**
+ * Calls back with every sample for the battery between from and to (inclusive,
+ * on the history clock), oldest first. Returns how many samples were passed on.
+ */
+uint32_t HistoryStore::query(BLEAddress address, uint32_t from, uint32_t to, historySampleCallback callback, void *data)
+{
+  batteryHistory_t *history;
+  historyBlock_t *block;
+  historySample_t sample;
+  uint32_t value;
+  uint32_t total = 0;
+  uint16_t offset;
+  bool done = false;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  history = find(*address.getNative());
+
+  for(int b = 0; history && !done && (b < history->usedBlocks); b++) {
+    block = &history->blocks[(history->firstBlock + b) % HISTORY_BLOCKS];
+
+    if((block->end < from) || (block->start > to)) {
+      continue;
+    }
+
+    memset(&sample, 0, sizeof(sample));
+    sample.time = block->start;
+    offset = 0;
+
+    for(int s = 0; s < block->samples; s++) {
+      offset += getVarint(&block->data[offset], &value);
+      sample.time += value;
+
+      for(int i = 0; i < HISTORY_CHANNELS; i++) {
+        offset += getVarint(&block->data[offset], &value);
+        sample.values[i] += unzigzag(value);
+      }
+
+      if(sample.time > to) {
+        done = true;
+        break;
+      }
+
+      if(sample.time < from) {
+        continue;
+      }
+
+      total++;
+
+      if(!callback(&sample, data)) {
+        done = true;
+        break;
+      }
+    }
+  }
+
+  xSemaphoreGive(lock);
+
+  return total;
+}
+
+/**
+ * Calls back with every minute or hour rollup for the battery that overlaps from
+ * to to, oldest first, finishing with the one still in progress. Returns how many
+ * rollups were passed on.
+ */
+uint32_t HistoryStore::queryRollups(BLEAddress address, historyResolution_t resolution, uint32_t from, uint32_t to,
+                                    historyRollupCallback callback, void *data)
+{
+  batteryHistory_t *history;
+  historyRollup_t *ring;
+  historyRollup_t *rollup;
+  uint8_t first, used, size;
+  uint32_t period;
+  uint32_t total = 0;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  history = find(*address.getNative());
+
+  if(history) {
+    if(resolution == HISTORY_HOUR) {
+      ring = history->hours;
+      first = history->firstHour;
+      used = history->usedHours;
+      size = HISTORY_HOUR_ROLLUPS;
+      period = 3600;
+    } else {
+      ring = history->minutes;
+      first = history->firstMinute;
+      used = history->usedMinutes;
+      size = HISTORY_MINUTE_ROLLUPS;
+      period = 60;
+    }
+
+    // used + 1 for the rollup in progress
+    for(int i = 0; i <= used; i++) {
+      rollup = (i < used) ? &ring[(first + i) % size] : ((resolution == HISTORY_HOUR) ? &history->hour : &history->minute);
+
+      if(!rollup->count || (rollup->start + period <= from) || (rollup->start > to)) {
+        continue;
+      }
+
+      total++;
+
+      if(!callback(rollup, data)) {
+        break;
+      }
+    }
+  }
+
+  xSemaphoreGive(lock);
+
+  return total;
+}
+
+/**
+ * Writes every battery's history to flash. Flash wears out, so this should only
+ * be done every so often (see HISTORY_PERSIST_INTERVAL).
+ */
+bool HistoryStore::save(fs::FS &fs, const char *path)
+{
+  historyFileHeader_t header;
+  File file = fs.open(path, FILE_WRITE);
+  bool result = true;
+
+  if(!file) {
+    Serial.printf("- FAILED: Could not open '%s' for writing history\n", path);
+    return false;
+  }
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  header.magic = HISTORY_FILE_MAGIC;
+  header.entrySize = sizeof(batteryHistory_t);
+  header.clock = advanceClock();
+  header.count = totalHistories;
+
+  result = file.write((uint8_t *)&header, sizeof(header)) == sizeof(header);
+
+  for(int i = 0; result && (i < totalHistories); i++) {
+    result = file.write((uint8_t *)histories[i], sizeof(batteryHistory_t)) == sizeof(batteryHistory_t);
+  }
+
+  xSemaphoreGive(lock);
+
+  file.close();
+
+  if(!result) {
+    Serial.printf("- FAILED: Could not write history to '%s'\n", path);
+  }
+
+  return result;
+}
+
+/**
+ * Loads the histories saved by save(), this is meant to be called once at boot
+ * before anything has been recorded. The history clock carries on from where it
+ * was when the file was saved.
+ */
+bool HistoryStore::load(fs::FS &fs, const char *path)
+{
+  historyFileHeader_t header;
+  batteryHistory_t *history;
+  File file = fs.open(path, FILE_READ);
+  uint8_t address[6];
+  bool result = true;
+
+  if(!file) {
+    return false;
+  }
+
+  if((file.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) ||
+     (header.magic != HISTORY_FILE_MAGIC) || (header.entrySize != sizeof(batteryHistory_t))) {
+    Serial.printf("- Ignoring history in '%s', it's from an incompatible build\n", path);
+    file.close();
+    return false;
+  }
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  for(int i = 0; result && (i < header.count); i++) {
+    if(file.read(address, sizeof(address)) != sizeof(address)) {
+      result = false;
+      break;
+    }
+
+    history = find(address);
+
+    if(!history) {
+      history = create(address);
+    }
+
+    if(!history) {
+      break;
+    }
+
+    // address is the first thing in batteryHistory_t and we already have it
+    result = file.read((uint8_t *)history + sizeof(address), sizeof(batteryHistory_t) - sizeof(address)) ==
+             sizeof(batteryHistory_t) - sizeof(address);
+
+    if(!result) {
+      memset((uint8_t *)history + sizeof(address), 0, sizeof(batteryHistory_t) - sizeof(address));
+    }
+  }
+
+  clockBase = header.clock + 1;
+  elapsed = 0;
+  lastMillis = millis();
+
+  xSemaphoreGive(lock);
+
+  file.close();
+
+  Serial.printf("- Loaded history for %u batteries from '%s'\n", totalHistories, path);
+
+  return result;
+}
+
+uint16_t HistoryStore::getTotalHistories()
+{
+  return totalHistories;
+}
+
+size_t HistoryStore::getMemoryUsed()
+{
+  return (sizeof(batteryHistory_t *) * allocatedHistories) + (sizeof(batteryHistory_t) * totalHistories);
+}
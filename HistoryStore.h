@@ -0,0 +1,201 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFEHISTORYSTORE_H_
+#define LIFEHISTORYSTORE_H_
+
+#include "Arduino.h"
+#include <BLEDevice.h>
+#include <FS.h>
+#include "lifeblue.h"
+#include "TelemetryPipeline.h"
+
+// Raw samples are kept in a ring of this many blocks per battery
+#ifndef HISTORY_BLOCKS
+#define HISTORY_BLOCKS 4
+#endif
+
+#ifndef HISTORY_BLOCK_SIZE
+#define HISTORY_BLOCK_SIZE 256
+#endif
+
+#ifndef HISTORY_MINUTE_ROLLUPS
+#define HISTORY_MINUTE_ROLLUPS 30
+#endif
+
+#ifndef HISTORY_HOUR_ROLLUPS
+#define HISTORY_HOUR_ROLLUPS 24
+#endif
+
+// Each history is ~5.5KB, so on a big bank only the first batteries found get one
+#ifndef HISTORY_MAX_BATTERIES
+#define HISTORY_MAX_BATTERIES 16
+#endif
+
+#define HISTORY_FILE_PATH "/history.bin"
+#define HISTORY_FILE_MAGIC 0x3148424c // "LBH1"
+
+// Worst case for one encoded sample, a 5 byte varint for the time and each channel
+#define HISTORY_MAX_SAMPLE_SIZE (5 * (HISTORY_CHANNELS + 1))
+
+enum historyChannel_t {
+  HISTORY_VOLTAGE = 0, // mV
+  HISTORY_CURRENT, // mA
+  HISTORY_SOC, // %
+  HISTORY_TEMP, // tenths of a degree C
+  HISTORY_MIN_CELL, // mV
+  HISTORY_MAX_CELL, // mV
+  HISTORY_CHANNELS
+};
+
+enum historyResolution_t {
+  HISTORY_MINUTE = 0,
+  HISTORY_HOUR
+};
+
+/**
+ * Times are in seconds on the history clock (see HistoryStore::now())
+ */
+struct historySample_t {
+  uint32_t time;
+  int32_t values[HISTORY_CHANNELS];
+};
+
+struct historyRollup_t {
+  uint32_t start; // start of the minute / hour this covers
+  uint16_t count; // samples in it, 0 if empty
+  int32_t min[HISTORY_CHANNELS];
+  int32_t max[HISTORY_CHANNELS];
+  int32_t sum[HISTORY_CHANNELS]; // average is sum / count
+};
+
+/**
+ * A block of encoded samples. The first sample in a block is stored against zero,
+ * so every block can be decoded on its own and the oldest one can simply be
+ * overwritten when the ring is full.
+ */
+struct historyBlock_t {
+  uint32_t start; // time of the first sample
+  uint32_t end; // time of the last sample
+  uint16_t samples;
+  uint16_t length; // bytes of data used
+  uint8_t data[HISTORY_BLOCK_SIZE];
+};
+
+struct batteryHistory_t {
+  uint8_t address[6];
+
+  historyBlock_t blocks[HISTORY_BLOCKS];
+  uint8_t firstBlock; // oldest block in the ring
+  uint8_t usedBlocks;
+  historySample_t last; // last sample encoded, what the next one is a delta from
+
+  historyRollup_t minute; // rollups still in progress
+  historyRollup_t hour;
+  historyRollup_t minutes[HISTORY_MINUTE_ROLLUPS];
+  historyRollup_t hours[HISTORY_HOUR_ROLLUPS];
+  uint8_t firstMinute;
+  uint8_t usedMinutes;
+  uint8_t firstHour;
+  uint8_t usedHours;
+};
+
+// Return false to stop the query early
+typedef bool (*historySampleCallback)(const historySample_t *, void *);
+typedef bool (*historyRollupCallback)(const historyRollup_t *, void *);
+
+const char *historyChannelName(historyChannel_t);
+
+/**
+ * Keeps a compressed history of every battery's samples in RAM, along with one
+ * minute and one hour min / max / average rollups that are kept up to date as
+ * each sample comes in.
+ *
+ * Samples are stored as the difference from the sample before them, zigzag
+ * encoded and packed as varints, so a typical sample is 7-8 bytes rather than 28.
+ *
+ * History is kept by battery address rather than with the batteryInfo_t so it can
+ * be loaded back from flash at boot before the batteries have been found again.
+ *
+ * Queries call back with the store locked, so the callbacks should be quick.
+ */
+class HistoryStore
+{
+
+public:
+  void record(const telemetrySnapshot_t *);
+
+  uint32_t query(BLEAddress, uint32_t, uint32_t, historySampleCallback, void *);
+  uint32_t queryRollups(BLEAddress, historyResolution_t, uint32_t, uint32_t, historyRollupCallback, void *);
+
+  uint32_t now();
+
+  bool save(fs::FS &, const char *);
+  bool load(fs::FS &, const char *);
+
+  uint16_t getTotalHistories();
+  size_t getMemoryUsed();
+
+  static HistoryStore *instance();
+
+private:
+  HistoryStore();
+  HistoryStore(HistoryStore const &) {};
+  HistoryStore& operator=(HistoryStore const &) { return *this; };
+
+  int32_t search(const uint8_t *);
+  batteryHistory_t *find(const uint8_t *);
+  batteryHistory_t *create(const uint8_t *);
+
+  void append(batteryHistory_t *, historySample_t *);
+  void rollup(historyRollup_t *, historyRollup_t *, uint8_t *, uint8_t *, uint8_t, uint32_t, historySample_t *);
+  uint32_t advanceClock();
+
+  batteryHistory_t **histories = NULL; // sorted by address
+  uint16_t totalHistories = 0;
+  uint16_t allocatedHistories = 0;
+
+  uint32_t clockBase = 0; // seconds, carried over from flash so time keeps going up across reboots
+  uint64_t elapsed = 0; // ms since boot
+  uint32_t lastMillis = 0;
+
+  SemaphoreHandle_t lock;
+
+  static HistoryStore *m_instance;
+};
+
+/**
+ * Feeds decoded frames from the telemetry pipeline into the HistoryStore. Every
+ * sample counts, so if it ever falls behind the oldest are dropped rather than
+ * leaving a gap at the end.
+ */
+class HistorySink : public TelemetrySink
+{
+
+public:
+  HistorySink() : TelemetrySink("history", SINK_DROP_OLDEST) {};
+
+protected:
+  bool write(const telemetrySnapshot_t *);
+};
+
+#endif
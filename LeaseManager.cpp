@@ -0,0 +1,334 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "LeaseManager.h"
+#include "BatteryManager.h"
+
+LeaseManager *LeaseManager::m_instance = NULL;
+
+LeaseManager *LeaseManager::instance()
+{
+  if(!m_instance) {
+    m_instance = new LeaseManager();
+  }
+
+  return m_instance;
+}
+
+/**
+ * Turns leasing on, until this is called every battery is ours to poll. The id
+ * has to be different for every gateway sharing the bank.
+ */
+void LeaseManager::begin(const char *id)
+{
+  strncpy(gateways[LEASE_SELF], id, LEASE_GATEWAY_ID_SIZE - 1);
+  totalGateways = 1;
+  enabled = true;
+
+  Serial.printf("- Sharing batteries with other gateways as '%s'\n", gateways[LEASE_SELF]);
+}
+
+bool LeaseManager::isEnabled()
+{
+  return enabled;
+}
+
+const char *LeaseManager::getGatewayId()
+{
+  return gateways[LEASE_SELF];
+}
+
+/**
+ * Finds (or adds) a gateway by its id, LEASE_NO_GATEWAY if there's no room
+ */
+uint8_t LeaseManager::gatewayIndex(const char *id)
+{
+  for(uint8_t i = LEASE_SELF; i <= totalGateways; i++) {
+    if(strncmp(gateways[i], id, LEASE_GATEWAY_ID_SIZE - 1) == 0) {
+      return i;
+    }
+  }
+
+  if(totalGateways == LEASE_MAX_GATEWAYS) {
+    return LEASE_NO_GATEWAY;
+  }
+
+  totalGateways++;
+  strncpy(gateways[totalGateways], id, LEASE_GATEWAY_ID_SIZE - 1);
+
+  Serial.printf("- Found gateway '%s'\n", gateways[totalGateways]);
+
+  return totalGateways;
+}
+
+bool LeaseManager::isLive(leasePeer_t *peer)
+{
+  return (peer->gateway != LEASE_NO_GATEWAY) && ((millis() - peer->heard) < LEASE_DURATION);
+}
+
+/**
+ * The battery's entry for a gateway. If create is set and there isn't one, a free
+ * or expired entry is taken over for it.
+ */
+leasePeer_t *LeaseManager::peer(batteryInfo_t *battery, uint8_t gateway, bool create)
+{
+  leasePeer_t *spare = NULL;
+  leasePeer_t *peer;
+
+  for(int i = 0; i < LEASE_MAX_GATEWAYS; i++) {
+    peer = &battery->lease.peers[i];
+
+    if(peer->gateway == gateway) {
+      return peer;
+    }
+
+    if(!spare && !isLive(peer)) {
+      spare = peer;
+    }
+  }
+
+  if(!create || !spare) {
+    return NULL;
+  }
+
+  memset(spare, 0, sizeof(leasePeer_t));
+  spare->gateway = gateway;
+
+  return spare;
+}
+
+/**
+ * An announcement from a gateway (ourselves included, the broker sends our own
+ * messages back to us) about a battery. These have to be handed over in the
+ * order they came from the broker, that order is what decides who holds what.
+ */
+void LeaseManager::received(batteryInfo_t *battery, const char *gateway, int8_t rssi, bool hold, uint32_t sent)
+{
+  leasePeer_t *entry;
+  uint8_t index;
+  bool wasLive;
+
+  if(!enabled || !battery) {
+    return;
+  }
+
+  index = gatewayIndex(gateway);
+
+  if((index == LEASE_NO_GATEWAY) || !(entry = peer(battery, index, true))) {
+    Serial.printf("- FAILED: Too many gateways, ignoring '%s'\n", gateway);
+    return;
+  }
+
+  wasLive = isLive(entry);
+
+  if((index == LEASE_SELF) && !wasLive) {
+    battery->lease.joined = millis();
+  }
+
+  entry->rssi = rssi;
+
+  // For everyone else it's when we heard them. For us it's when the message was
+  // sent, which is before anyone else could have heard it.
+  entry->heard = (index == LEASE_SELF) ? sent : millis();
+
+  if(!hold) {
+    entry->contending = 0;
+  } else if(!entry->contending || !wasLive) {
+    entry->contending = ++sequence; // back of the line
+  }
+}
+
+/**
+ * The gateway holding the battery: of the live gateways asking for it, the one
+ * whose request came first
+ */
+uint8_t LeaseManager::holder(batteryInfo_t *battery)
+{
+  leasePeer_t *first = NULL;
+  leasePeer_t *peer;
+
+  for(int i = 0; i < LEASE_MAX_GATEWAYS; i++) {
+    peer = &battery->lease.peers[i];
+
+    if(peer->contending && isLive(peer) && (!first || (peer->contending < first->contending))) {
+      first = peer;
+    }
+  }
+
+  return first ? first->gateway : LEASE_NO_GATEWAY;
+}
+
+/**
+ * The gateway that should hold the battery, the one that hears it best. Ties go
+ * to the lowest gateway id so everyone picks the same one.
+ */
+uint8_t LeaseManager::preferred(batteryInfo_t *battery)
+{
+  uint8_t best = LEASE_SELF;
+  int8_t bestRssi = battery->rssi;
+  leasePeer_t *peer;
+
+  for(int i = 0; i < LEASE_MAX_GATEWAYS; i++) {
+    peer = &battery->lease.peers[i];
+
+    if((peer->gateway == LEASE_SELF) || !isLive(peer)) {
+      continue;
+    }
+
+    if((peer->rssi > bestRssi) || ((peer->rssi == bestRssi) && (strcmp(gateways[peer->gateway], gateways[best]) < 0))) {
+      best = peer->gateway;
+      bestRssi = peer->rssi;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Whether we're connected to the battery right now, we don't let go of a
+ * battery part way through polling it
+ */
+bool LeaseManager::isPolling(batteryInfo_t *battery)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  BLEClient *client = batteryManager->getBLEClient();
+
+  return (batteryManager->getCurrentBattery() == battery) && client && client->isConnected();
+}
+
+/**
+ * Whether we've been hearing our own announcements about the battery for long
+ * enough to have heard every other gateway's too
+ */
+bool LeaseManager::isSettled(batteryInfo_t *battery)
+{
+  leasePeer_t *self = peer(battery, LEASE_SELF, false);
+
+  return self && isLive(self) && ((millis() - battery->lease.joined) >= LEASE_DURATION);
+}
+
+/**
+ * Whether this gateway can poll the battery right now. It has to be ours, and
+ * the last announcement that made it back to us has to be recent enough that
+ * nobody else could have decided we've gone away.
+ */
+bool LeaseManager::mayPoll(batteryInfo_t *battery)
+{
+  leasePeer_t *self;
+
+  if(!enabled) {
+    return true;
+  }
+
+  if(!battery->lease.holding || !(self = peer(battery, LEASE_SELF, false))) {
+    return false;
+  }
+
+  return ((millis() - self->heard) < (LEASE_DURATION - LEASE_MARGIN)) && (holder(battery) == LEASE_SELF);
+}
+
+/**
+ * Decides which batteries we want and queues an announcement for each battery
+ * that's due one, or where we've changed our mind. Call this every time through
+ * the main loop.
+ */
+void LeaseManager::loop()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  batteryInfo_t *battery;
+  leaseState_t *state;
+  leaseMessage_t message;
+  bool want;
+  bool owned;
+
+  if(!enabled) {
+    return;
+  }
+
+  for(uint16_t i = 0; i < batteryManager->getTotalBatteries(); i++) {
+    battery = batteryManager->getBattery(i);
+    state = &battery->lease;
+
+    want = isSettled(battery) && (preferred(battery) == LEASE_SELF);
+
+    if(!want && state->holding && isPolling(battery)) {
+      want = true; // let go once this poll is done
+    }
+
+    if((want != state->holding) || !state->announced || ((millis() - state->announced) >= LEASE_RENEW_INTERVAL)) {
+      if(queue.isFull()) {
+        break; // the rest will go next time
+      }
+
+      state->holding = want;
+      state->announced = millis();
+
+      message.battery = battery;
+      message.rssi = battery->rssi;
+      message.hold = want;
+      message.sent = millis();
+
+      queue.push(message);
+    }
+
+    owned = mayPoll(battery);
+
+    if(owned != state->owned) {
+      Serial.printf("- %s %s\n", owned ? "Now polling" : "No longer polling", battery->address);
+      state->owned = owned;
+    }
+  }
+}
+
+/**
+ * Copies the oldest announcement into message without removing it, so it can
+ * stay queued if the publish fails. Call shift() once it's been published.
+ */
+bool LeaseManager::peek(leaseMessage_t *message)
+{
+  if(queue.isEmpty()) {
+    return false;
+  }
+
+  *message = queue.first();
+
+  return true;
+}
+
+void LeaseManager::shift()
+{
+  if(!queue.isEmpty()) {
+    queue.shift();
+  }
+}
+
+uint16_t LeaseManager::getTotalOwned()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  uint16_t total = 0;
+
+  for(uint16_t i = 0; i < batteryManager->getTotalBatteries(); i++) {
+    total += batteryManager->getBattery(i)->lease.owned ? 1 : 0;
+  }
+
+  return total;
+}
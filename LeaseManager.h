@@ -0,0 +1,155 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFELEASEMGR_H_
+#define LIFELEASEMGR_H_
+
+#include "Arduino.h"
+#include <CircularBuffer.h>
+
+// ms a gateway's claim on a battery lasts without being renewed
+#ifndef LEASE_DURATION
+#define LEASE_DURATION 30000
+#endif
+
+// ms between announcements for each battery, has to be well under LEASE_DURATION
+#ifndef LEASE_RENEW_INTERVAL
+#define LEASE_RENEW_INTERVAL 10000
+#endif
+
+// ms before our lease runs out that we stop starting polls, has to cover a whole
+// poll (up to POLL_TIMEOUT) plus clocks running at different rates
+#ifndef LEASE_MARGIN
+#define LEASE_MARGIN 13000
+#endif
+
+// Gateways we can keep track of, including ourselves
+#ifndef LEASE_MAX_GATEWAYS
+#define LEASE_MAX_GATEWAYS 8
+#endif
+
+#ifndef LEASE_QUEUE_SIZE
+#define LEASE_QUEUE_SIZE 32
+#endif
+
+#define LEASE_GATEWAY_ID_SIZE 24
+#define LEASE_NO_GATEWAY 0 // so a zeroed leaseState_t has no peers in it
+#define LEASE_SELF 1 // we're always the first gateway
+
+/**
+ * What one gateway last told us about a battery
+ */
+struct leasePeer_t {
+  uint8_t gateway; // index into the gateway list, LEASE_NO_GATEWAY if the slot is free
+  int8_t rssi; // how well it hears the battery
+  uint32_t contending; // when (in message order) it asked to hold the battery, 0 if it isn't
+  uint32_t heard; // millis() we heard from it, for ourselves millis() when the message we got back was sent
+};
+
+/**
+ * Per battery lease state, lives in batteryInfo_t
+ */
+struct leaseState_t {
+  leasePeer_t peers[LEASE_MAX_GATEWAYS];
+  bool holding; // we're asking to hold it
+  bool owned; // what mayPoll() said last time loop() looked, for logging
+  uint32_t announced; // millis() we last announced
+  uint32_t joined; // millis() our announcements started coming back (again)
+};
+
+struct batteryInfo_t;
+
+/**
+ * An announcement for the sketch to publish: this gateway hears the battery at
+ * rssi, and does / doesn't want to hold it. sent goes out with it so we can tell
+ * when our own announcement comes back.
+ */
+struct leaseMessage_t {
+  batteryInfo_t *battery;
+  int8_t rssi;
+  bool hold;
+  uint32_t sent; // millis()
+};
+
+/**
+ * Shares batteries between several gateways. Every gateway announces every
+ * battery it can hear, with its RSSI, to all of the others (over MQTT). The
+ * gateway with the best RSSI asks to hold the battery, and whoever's request
+ * went through the broker first holds it until it gives it up or stops
+ * renewing. Everyone sees the broker's messages in the same order so everyone
+ * agrees on the holder without any further negotiation.
+ *
+ * A gateway that has only just started hearing itself back (at boot, or after
+ * losing the broker) doesn't know who got in first for what, so it listens for
+ * a whole LEASE_DURATION, by which time every live holder has renewed, before
+ * asking to hold anything.
+ *
+ * A holder that isn't the best any more finishes its poll, then lets go. Our
+ * own lease is only good for LEASE_DURATION (less LEASE_MARGIN) after the last
+ * announcement that made it back to us through the broker, and everyone else
+ * waits for the full LEASE_DURATION after they last heard from us before
+ * taking over, so a gateway that loses the broker stops polling before anyone
+ * else starts. The flip side is nothing gets polled without the broker.
+ */
+class LeaseManager
+{
+
+public:
+  void begin(const char *);
+  bool isEnabled();
+  const char *getGatewayId();
+
+  void received(batteryInfo_t *, const char *, int8_t, bool, uint32_t);
+  void loop();
+  bool mayPoll(batteryInfo_t *);
+
+  bool peek(leaseMessage_t *);
+  void shift();
+
+  uint16_t getTotalOwned();
+
+  static LeaseManager *instance();
+
+private:
+  LeaseManager() {};
+  LeaseManager(LeaseManager const &) {};
+  LeaseManager& operator=(LeaseManager const &) { return *this; };
+
+  uint8_t gatewayIndex(const char *);
+  leasePeer_t *peer(batteryInfo_t *, uint8_t, bool);
+  bool isLive(leasePeer_t *);
+  uint8_t holder(batteryInfo_t *);
+  uint8_t preferred(batteryInfo_t *);
+  bool isPolling(batteryInfo_t *);
+  bool isSettled(batteryInfo_t *);
+
+  bool enabled = false;
+  char gateways[LEASE_MAX_GATEWAYS + 1][LEASE_GATEWAY_ID_SIZE] = {}; // indexed from LEASE_SELF
+  uint8_t totalGateways = 0;
+  uint32_t sequence = 0; // counts requests to hold, which is how we know whose came first
+
+  CircularBuffer<leaseMessage_t, LEASE_QUEUE_SIZE> queue;
+
+  static LeaseManager *m_instance;
+};
+
+#endif
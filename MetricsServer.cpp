@@ -0,0 +1,616 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "MetricsServer.h"
+#include "BatteryManager.h"
+#include "AlarmManager.h"
+#include "HeapMonitor.h"
+#include "ScanManager.h"
+
+MetricsServer *MetricsServer::m_instance = NULL;
+
+/**
+ * A per battery value, rendered once for every battery under the same metric name
+ */
+struct batteryMetric_t {
+  const char *name;
+  const char *type;
+  const char *help;
+  int64_t (*value)(const telemetrySnapshot_t *); // frame values from the snapshot, counters from the battery
+};
+
+static int64_t batteryVoltage(const telemetrySnapshot_t *latest) { return latest->voltage; }
+static int64_t batteryCurrent(const telemetrySnapshot_t *latest) { return latest->current; }
+static int64_t batteryRemaining(const telemetrySnapshot_t *latest) { return latest->ampHrs; }
+static int64_t batterySoc(const telemetrySnapshot_t *latest) { return latest->soc; }
+static int64_t batteryTemp(const telemetrySnapshot_t *latest) { return (int16_t)latest->temp; }
+static int64_t batteryCycles(const telemetrySnapshot_t *latest) { return latest->cycleCount; }
+static int64_t batteryStatus(const telemetrySnapshot_t *latest) { return latest->status; }
+static int64_t batteryAfeStatus(const telemetrySnapshot_t *latest) { return latest->afeStatus; }
+static int64_t batteryRssi(const telemetrySnapshot_t *latest) { return latest->rssi; }
+static int64_t batteryCurrentAvg(const telemetrySnapshot_t *latest) { return latest->currentAvg; }
+static int64_t batteryPowerAvg(const telemetrySnapshot_t *latest) { return latest->powerAvg; }
+static int64_t batteryChargeSinceFull(const telemetrySnapshot_t *latest) { return latest->chargeSinceFull; }
+static int64_t batteryTimeToEmpty(const telemetrySnapshot_t *latest) { return latest->timeToEmpty; }
+static int64_t batteryTimeToFull(const telemetrySnapshot_t *latest) { return latest->timeToFull; }
+static int64_t batteryPolls(const telemetrySnapshot_t *latest) { return latest->battery->metrics.polls; }
+static int64_t batteryDecodes(const telemetrySnapshot_t *latest) { return latest->battery->metrics.decodes; }
+static int64_t batteryConnectFailures(const telemetrySnapshot_t *latest) { return latest->battery->metrics.connectFailures; }
+static int64_t batteryDiscoveryFailures(const telemetrySnapshot_t *latest) { return latest->battery->metrics.discoveryFailures; }
+static int64_t batteryChecksumRejects(const telemetrySnapshot_t *latest) { return latest->battery->metrics.checksumRejects; }
+static int64_t batteryResyncs(const telemetrySnapshot_t *latest) { return latest->battery->metrics.resyncs; }
+static int64_t batteryTimeouts(const telemetrySnapshot_t *latest) { return latest->battery->metrics.timeouts; }
+static int64_t batteryRequeues(const telemetrySnapshot_t *latest) { return latest->battery->metrics.requeues; }
+static int64_t batteryPublishFailures(const telemetrySnapshot_t *latest) { return latest->battery->metrics.publishFailures; }
+static int64_t batteryLinkMtu(const telemetrySnapshot_t *latest) { return latest->battery->link.mtu; }
+static int64_t batteryLinkInterval(const telemetrySnapshot_t *latest) { return latest->battery->link.interval * 1250; }
+
+static const batteryMetric_t batteryMetrics[] = {
+  { "voltage_millivolts", "gauge", "Pack voltage", batteryVoltage },
+  { "current_milliamps", "gauge", "Current, negative when discharging", batteryCurrent },
+  { "remaining_milliamp_hours", "gauge", "Remaining capacity", batteryRemaining },
+  { "state_of_charge_percent", "gauge", "State of charge", batterySoc },
+  { "temperature_decicelsius", "gauge", "Temperature in tenths of a degree C", batteryTemp },
+  { "cycles", "gauge", "Charge cycles reported by the battery", batteryCycles },
+  { "status", "gauge", "Status bitmask", batteryStatus },
+  { "afe_status", "gauge", "AFE status bitmask", batteryAfeStatus },
+  { "rssi_dbm", "gauge", "Signal strength when the battery was found", batteryRssi },
+  { "current_average_milliamps", "gauge", "Smoothed current", batteryCurrentAvg },
+  { "power_average_milliwatts", "gauge", "Smoothed power", batteryPowerAvg },
+  { "charge_since_full_milliamp_hours", "gauge", "Net charge since the last full charge", batteryChargeSinceFull },
+  { "time_to_empty_seconds", "gauge", "Projected time to empty, 0 if not discharging", batteryTimeToEmpty },
+  { "time_to_full_seconds", "gauge", "Projected time to full, 0 if not charging", batteryTimeToFull },
+  { "polls_total", "counter", "Poll attempts", batteryPolls },
+  { "decodes_total", "counter", "Frames decoded", batteryDecodes },
+  { "connect_failures_total", "counter", "Failed connects", batteryConnectFailures },
+  { "discovery_failures_total", "counter", "Failed service or characteristic discovery", batteryDiscoveryFailures },
+  { "checksum_rejects_total", "counter", "Frames thrown away for a bad checksum", batteryChecksumRejects },
+  { "resyncs_total", "counter", "Frames abandoned part way through, the next one was used", batteryResyncs },
+  { "timeouts_total", "counter", "Polls given up on without a good frame", batteryTimeouts },
+  { "requeues_total", "counter", "Polls put back on the queue after a failure", batteryRequeues },
+  { "publish_failures_total", "counter", "Failed MQTT publishes", batteryPublishFailures },
+  { "link_mtu_bytes", "gauge", "ATT MTU the battery agreed to, 0 until it's been polled", batteryLinkMtu },
+  { "link_interval_microseconds", "gauge", "Connection interval the battery agreed to, 0 if it hasn't", batteryLinkInterval }
+};
+
+#define BATTERY_METRIC_COUNT (sizeof(batteryMetrics) / sizeof(batteryMetrics[0]))
+
+/**
+ * The bank aggregates, worked out from the same snapshots as the batteries so
+ * the two always agree
+ */
+struct metricsBank_t {
+  uint16_t batteries;
+  int32_t current; // mA
+  uint32_t remaining; // mAh
+  uint32_t capacity; // mAh
+  uint16_t soc; // %
+  uint32_t minVoltage; // mV
+  uint32_t maxVoltage;
+  uint16_t minCell; // mV, 0 if no battery has cells
+  uint16_t maxCell;
+};
+
+static void summarizeBank(const telemetrySnapshot_t *latest, uint16_t totalLatest, metricsBank_t *bank)
+{
+  memset(bank, 0, sizeof(metricsBank_t));
+
+  bank->minVoltage = UINT32_MAX;
+  bank->minCell = UINT16_MAX;
+
+  for(uint16_t i = 0; i < totalLatest; i++) {
+    bank->batteries++;
+    bank->current += latest[i].current;
+    bank->remaining += latest[i].ampHrs;
+    bank->capacity += (latest[i].soc > 0) ? ((uint64_t)latest[i].ampHrs * 100) / latest[i].soc : 0;
+
+    if(latest[i].voltage < bank->minVoltage) {
+      bank->minVoltage = latest[i].voltage;
+    }
+
+    if(latest[i].voltage > bank->maxVoltage) {
+      bank->maxVoltage = latest[i].voltage;
+    }
+
+    if(latest[i].minCell > latest[i].maxCell) {
+      continue; // no cells
+    }
+
+    if(latest[i].minCell < bank->minCell) {
+      bank->minCell = latest[i].minCell;
+    }
+
+    if(latest[i].maxCell > bank->maxCell) {
+      bank->maxCell = latest[i].maxCell;
+    }
+  }
+
+  if(bank->minCell > bank->maxCell) {
+    bank->minCell = 0;
+  }
+
+  bank->soc = bank->capacity ? ((uint64_t)bank->remaining * 100) / bank->capacity : 0;
+}
+
+/**
+ * printf onto the end of the buffer, growing it if it's too small
+ */
+static void bufferPrintf(renderBuffer_t *buffer, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void bufferPrintf(renderBuffer_t *buffer, const char *format, ...)
+{
+  va_list args;
+  size_t size;
+  char *data;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(buffer->data + buffer->length, buffer->size - buffer->length, format, args);
+  va_end(args);
+
+  if(length < 0) {
+    return;
+  }
+
+  if(buffer->length + length >= buffer->size) {
+    size = buffer->size ? buffer->size * 2 : 1024;
+
+    while(size <= buffer->length + length) {
+      size *= 2;
+    }
+
+    data = (char *)realloc(buffer->data, size);
+
+    if(!data) {
+      Serial.println("- FAILED: Out of memory rendering metrics");
+      return;
+    }
+
+    buffer->data = data;
+    buffer->size = size;
+
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->length, buffer->size - buffer->length, format, args);
+    va_end(args);
+  }
+
+  buffer->length += length;
+}
+
+/**
+ * Battery names come from whatever the battery advertises, so they get escaped
+ * before going into a label or a JSON string. The escaping is the same for both.
+ */
+static void bufferEscaped(renderBuffer_t *buffer, const char *value)
+{
+  for(; *value; value++) {
+    if((*value == '"') || (*value == '\\')) {
+      bufferPrintf(buffer, "\\%c", *value);
+    } else if((uint8_t)*value < 0x20) {
+      bufferPrintf(buffer, " ");
+    } else {
+      bufferPrintf(buffer, "%c", *value);
+    }
+  }
+}
+
+
+MetricsServer *MetricsServer::instance()
+{
+  if(!m_instance) {
+    m_instance = new MetricsServer();
+  }
+
+  return m_instance;
+}
+
+void MetricsServer::begin(uint16_t port)
+{
+  if(server) {
+    return;
+  }
+
+  server = new WiFiServer(port);
+  server->begin();
+}
+
+MetricsServer::MetricsServer()
+{
+  lock = xSemaphoreCreateMutex();
+}
+
+WiFiServer *MetricsServer::getServer()
+{
+  return server;
+}
+
+/**
+ * Called by the MetricsSink (so from the loop task) for every decoded frame. The
+ * snapshot replaces the battery's last one and the next request will re-render
+ * the responses. Returns false without waiting if a request is being served, the
+ * sink will offer it again.
+ */
+bool MetricsServer::update(const telemetrySnapshot_t *snapshot)
+{
+  telemetrySnapshot_t *grown;
+  uint16_t i;
+
+  if(xSemaphoreTake(lock, 0) != pdTRUE) {
+    return false;
+  }
+
+  for(i = 0; (i < totalLatest) && (latest[i].battery != snapshot->battery); i++);
+
+  if((i == totalLatest) && (totalLatest == allocatedLatest)) {
+    grown = (telemetrySnapshot_t *)realloc(latest, (allocatedLatest + 4) * sizeof(telemetrySnapshot_t));
+
+    if(!grown) {
+      Serial.println("- FAILED: Out of memory keeping metrics");
+      xSemaphoreGive(lock);
+      return true; // it's not going to get any better by trying again
+    }
+
+    latest = grown;
+    allocatedLatest += 4;
+  }
+
+  if(i == totalLatest) {
+    totalLatest++;
+  }
+
+  latest[i] = *snapshot;
+  dirty = true;
+
+  xSemaphoreGive(lock);
+
+  return true;
+}
+
+bool MetricsSink::write(const telemetrySnapshot_t *snapshot)
+{
+  return MetricsServer::instance()->update(snapshot);
+}
+
+uint32_t MetricsServer::getTotalRequests()
+{
+  return totalRequests;
+}
+
+uint32_t MetricsServer::getTotalRenders()
+{
+  return totalRenders;
+}
+
+void MetricsServer::loop()
+{
+  WiFiClient client;
+
+  if(!server) {
+    return;
+  }
+
+  client = server->available();
+
+  if(!client) {
+    return;
+  }
+
+  handle(client);
+  client.stop();
+}
+
+/**
+ * Reads the request line, ignores the rest of the request and writes back the
+ * cached response for the path.
+ */
+void MetricsServer::handle(WiFiClient &client)
+{
+  char request[METRICS_HTTP_REQUEST_SIZE] = {0};
+  char header[160];
+  renderBuffer_t *body = NULL;
+  const char *contentType = NULL;
+  const char *status = "200 OK";
+  uint32_t started = millis();
+  size_t length = 0;
+  char *path;
+  char *end;
+  int c;
+
+  while(client.connected() && ((millis() - started) < METRICS_HTTP_TIMEOUT) && (length < sizeof(request) - 1)) {
+    if(!client.available()) {
+      delay(1);
+      continue;
+    }
+
+    c = client.read();
+
+    if(c == '\n') {
+      break;
+    }
+
+    request[length++] = c;
+  }
+
+  // Closing with unread data makes the stack reset the connection, which can lose our response
+  while(client.available()) {
+    client.read();
+  }
+
+  totalRequests++;
+
+  if(strncmp(request, "GET ", 4) != 0) {
+    status = "405 Method Not Allowed";
+  } else {
+    path = request + 4;
+    end = strchr(path, ' ');
+
+    if(end) {
+      *end = '\0';
+    }
+
+    if(strcmp(path, "/metrics") == 0) {
+      body = &prometheus;
+      contentType = "text/plain; version=0.0.4";
+    } else if((strcmp(path, "/json") == 0) || (strcmp(path, "/") == 0)) {
+      body = &json;
+      contentType = "application/json";
+    } else {
+      status = "404 Not Found";
+    }
+  }
+
+  if(!body) {
+    length = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    client.write((const uint8_t *)header, length);
+    return;
+  }
+
+  // Held until the body's gone so update() can't have it re-rendered part way through
+  xSemaphoreTake(lock, portMAX_DELAY);
+
+  if(dirty || ((millis() - lastRender) >= METRICS_HTTP_MAX_AGE)) {
+    render();
+  }
+
+  length = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                    status, contentType, (unsigned int)body->length);
+
+  client.write((const uint8_t *)header, length);
+  client.write((const uint8_t *)body->data, body->length);
+
+  xSemaphoreGive(lock);
+}
+
+/**
+ * Call with lock held
+ */
+void MetricsServer::render()
+{
+  dirty = false;
+
+  prometheus.length = 0;
+  json.length = 0;
+
+  renderPrometheus(&prometheus);
+  renderJson(&json);
+
+  lastRender = millis();
+  totalRenders++;
+}
+
+void MetricsServer::renderPrometheus(renderBuffer_t *out)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  ScanManager *scanManager = ScanManager::instance();
+  AlarmManager *alarmManager = AlarmManager::instance();
+  TelemetryPipeline *pipeline = TelemetryPipeline::instance();
+  heapStats_t heap = HeapMonitor::instance()->getStats();
+  uint16_t totalBatteries = batteryManager->getTotalBatteries();
+  metricsBank_t bank;
+  histogram_t *histogram;
+  histogram_t combined;
+  uint32_t cumulative;
+
+  bufferPrintf(out, "# HELP lifeblue_gateway_uptime_seconds Time since boot\n# TYPE lifeblue_gateway_uptime_seconds gauge\n");
+  bufferPrintf(out, "lifeblue_gateway_uptime_seconds %lu\n", (unsigned long)(millis() / 1000));
+  bufferPrintf(out, "# TYPE lifeblue_gateway_heap_free_bytes gauge\nlifeblue_gateway_heap_free_bytes %u\n", heap.freeHeap);
+  bufferPrintf(out, "# TYPE lifeblue_gateway_heap_largest_free_block_bytes gauge\nlifeblue_gateway_heap_largest_free_block_bytes %u\n", heap.largestFreeBlock);
+  bufferPrintf(out, "# TYPE lifeblue_gateway_heap_min_free_bytes gauge\nlifeblue_gateway_heap_min_free_bytes %u\n", heap.minFreeHeap);
+  bufferPrintf(out, "# TYPE lifeblue_gateway_heap_fragmentation_percent gauge\nlifeblue_gateway_heap_fragmentation_percent %u\n", heap.fragmentation);
+  bufferPrintf(out, "# TYPE lifeblue_gateway_batteries gauge\nlifeblue_gateway_batteries %u\n", totalBatteries);
+  bufferPrintf(out, "# TYPE lifeblue_gateway_sweeps_total counter\nlifeblue_gateway_sweeps_total %u\n", batteryManager->getTotalSweeps());
+  bufferPrintf(out, "# TYPE lifeblue_gateway_last_sweep_milliseconds gauge\nlifeblue_gateway_last_sweep_milliseconds %u\n", batteryManager->getLastSweepDuration());
+  bufferPrintf(out, "# TYPE lifeblue_gateway_scans_total counter\nlifeblue_gateway_scans_total %u\n", scanManager->getTotalScans());
+  bufferPrintf(out, "# TYPE lifeblue_gateway_last_scan_milliseconds gauge\nlifeblue_gateway_last_scan_milliseconds %u\n", scanManager->getLastScanDuration());
+  bufferPrintf(out, "# TYPE lifeblue_gateway_http_requests_total counter\nlifeblue_gateway_http_requests_total %u\n", totalRequests);
+
+  bufferPrintf(out, "# HELP lifeblue_sink_queued Snapshots waiting to be written\n# TYPE lifeblue_sink_queued gauge\n");
+
+  for(uint8_t i = 0; i < pipeline->getTotalSinks(); i++) {
+    bufferPrintf(out, "lifeblue_sink_queued{sink=\"%s\"} %u\n", pipeline->getSink(i)->getName(), pipeline->getSink(i)->getQueued());
+  }
+
+  bufferPrintf(out, "# TYPE lifeblue_sink_written_total counter\n");
+
+  for(uint8_t i = 0; i < pipeline->getTotalSinks(); i++) {
+    bufferPrintf(out, "lifeblue_sink_written_total{sink=\"%s\"} %u\n", pipeline->getSink(i)->getName(), pipeline->getSink(i)->getWritten());
+  }
+
+  bufferPrintf(out, "# HELP lifeblue_sink_dropped_total Snapshots dropped or replaced by a newer one before being written\n# TYPE lifeblue_sink_dropped_total counter\n");
+
+  for(uint8_t i = 0; i < pipeline->getTotalSinks(); i++) {
+    bufferPrintf(out, "lifeblue_sink_dropped_total{sink=\"%s\"} %u\n", pipeline->getSink(i)->getName(), pipeline->getSink(i)->getDropped());
+  }
+
+  summarizeBank(latest, totalLatest, &bank);
+
+  if(bank.batteries) {
+    bufferPrintf(out, "# HELP lifeblue_bank_batteries Batteries that have reported\n# TYPE lifeblue_bank_batteries gauge\nlifeblue_bank_batteries %u\n", bank.batteries);
+    bufferPrintf(out, "# TYPE lifeblue_bank_current_milliamps gauge\nlifeblue_bank_current_milliamps %d\n", bank.current);
+    bufferPrintf(out, "# TYPE lifeblue_bank_remaining_milliamp_hours gauge\nlifeblue_bank_remaining_milliamp_hours %u\n", bank.remaining);
+    bufferPrintf(out, "# TYPE lifeblue_bank_capacity_milliamp_hours gauge\nlifeblue_bank_capacity_milliamp_hours %u\n", bank.capacity);
+    bufferPrintf(out, "# TYPE lifeblue_bank_state_of_charge_percent gauge\nlifeblue_bank_state_of_charge_percent %u\n", bank.soc);
+    bufferPrintf(out, "# TYPE lifeblue_bank_voltage_min_millivolts gauge\nlifeblue_bank_voltage_min_millivolts %u\n", bank.minVoltage);
+    bufferPrintf(out, "# TYPE lifeblue_bank_voltage_max_millivolts gauge\nlifeblue_bank_voltage_max_millivolts %u\n", bank.maxVoltage);
+    bufferPrintf(out, "# TYPE lifeblue_bank_cell_min_millivolts gauge\nlifeblue_bank_cell_min_millivolts %u\n", bank.minCell);
+    bufferPrintf(out, "# TYPE lifeblue_bank_cell_max_millivolts gauge\nlifeblue_bank_cell_max_millivolts %u\n", bank.maxCell);
+  }
+
+  bufferPrintf(out, "# HELP lifeblue_battery_info Battery names, join on battery\n# TYPE lifeblue_battery_info gauge\n");
+
+  for(int i = 0; i < totalLatest; i++) {
+    bufferPrintf(out, "lifeblue_battery_info{battery=\"%s\",name=\"", latest[i].battery->id);
+    bufferEscaped(out, latest[i].battery->bname);
+    bufferPrintf(out, "\"} 1\n");
+  }
+
+  // Every sample of a metric has to be together, so it's metric by metric rather than battery by battery
+  for(size_t m = 0; m < BATTERY_METRIC_COUNT; m++) {
+    bufferPrintf(out, "# HELP lifeblue_battery_%s %s\n# TYPE lifeblue_battery_%s %s\n",
+                 batteryMetrics[m].name, batteryMetrics[m].help, batteryMetrics[m].name, batteryMetrics[m].type);
+
+    for(int i = 0; i < totalLatest; i++) {
+      bufferPrintf(out, "lifeblue_battery_%s{battery=\"%s\"} %lld\n", batteryMetrics[m].name, latest[i].battery->id,
+                   (long long)batteryMetrics[m].value(&latest[i]));
+    }
+  }
+
+  bufferPrintf(out, "# HELP lifeblue_battery_cell_millivolts Cell voltage\n# TYPE lifeblue_battery_cell_millivolts gauge\n");
+
+  for(int i = 0; i < totalLatest; i++) {
+    for(int c = 0; c < latest[i].totalCells; c++) {
+      bufferPrintf(out, "lifeblue_battery_cell_millivolts{battery=\"%s\",cell=\"%d\"} %u\n", latest[i].battery->id, c + 1,
+                   latest[i].cells[c]);
+    }
+  }
+
+  bufferPrintf(out, "# HELP lifeblue_battery_alarm Whether the alarm is active\n# TYPE lifeblue_battery_alarm gauge\n");
+
+  for(int i = 0; i < totalLatest; i++) {
+    for(int a = 0; a < alarmManager->getTotalRules(); a++) {
+      bufferPrintf(out, "lifeblue_battery_alarm{battery=\"%s\",alarm=\"%s\"} %d\n", latest[i].battery->id,
+                   alarmManager->getRule(a)->name, (latest[i].alarms & (1UL << a)) ? 1 : 0);
+    }
+  }
+
+  // Per battery histograms would be most of the response, they're on MQTT so here it's the whole bank
+  bufferPrintf(out, "# HELP lifeblue_poll_stage_seconds Time spent in each stage of a poll, all batteries\n# TYPE lifeblue_poll_stage_seconds histogram\n");
+
+  for(int s = 0; s < POLL_STAGE_COUNT; s++) {
+    memset(&combined, 0, sizeof(combined));
+
+    for(int i = 0; i < totalBatteries; i++) {
+      histogram = &batteryManager->getBattery(i)->metrics.stages[s];
+
+      for(int b = 0; b <= METRICS_HISTOGRAM_BOUNDS; b++) {
+        combined.buckets[b] += histogram->buckets[b];
+      }
+
+      combined.count += histogram->count;
+      combined.sum += histogram->sum;
+    }
+
+    cumulative = 0;
+
+    // Our buckets are counts per bucket, Prometheus wants them cumulative
+    for(int b = 0; b < METRICS_HISTOGRAM_BOUNDS; b++) {
+      cumulative += combined.buckets[b];
+      bufferPrintf(out, "lifeblue_poll_stage_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %u\n", pollStageName((pollStage_t)s),
+                   (float)metricsHistogramBounds[b] / 1000000, cumulative);
+    }
+
+    bufferPrintf(out, "lifeblue_poll_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", pollStageName((pollStage_t)s), combined.count);
+    bufferPrintf(out, "lifeblue_poll_stage_seconds_sum{stage=\"%s\"} %.6f\n", pollStageName((pollStage_t)s), (double)combined.sum / 1000000);
+    bufferPrintf(out, "lifeblue_poll_stage_seconds_count{stage=\"%s\"} %u\n", pollStageName((pollStage_t)s), combined.count);
+  }
+}
+
+void MetricsServer::renderJson(renderBuffer_t *out)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  ScanManager *scanManager = ScanManager::instance();
+  AlarmManager *alarmManager = AlarmManager::instance();
+  heapStats_t heap = HeapMonitor::instance()->getStats();
+  uint16_t totalBatteries = batteryManager->getTotalBatteries();
+  const telemetrySnapshot_t *snapshot;
+  batteryInfo_t *battery;
+  metricsBank_t bank;
+  bool firstAlarm;
+
+  bufferPrintf(out, "{\"gateway\":{\"uptime_ms\":%lu,\"batteries\":%u,\"sweeps\":%u,\"last_sweep_ms\":%u,"
+                    "\"scans\":%u,\"last_scan_ms\":%u,\"heap\":{\"free\":%u,\"largest_block\":%u,\"min_free\":%u,\"fragmentation\":%u}},",
+               (unsigned long)millis(), totalBatteries, batteryManager->getTotalSweeps(), batteryManager->getLastSweepDuration(),
+               scanManager->getTotalScans(), scanManager->getLastScanDuration(), heap.freeHeap, heap.largestFreeBlock, heap.minFreeHeap, heap.fragmentation);
+
+  summarizeBank(latest, totalLatest, &bank);
+
+  if(bank.batteries) {
+    bufferPrintf(out, "\"bank\":{\"batteries\":%u,\"current\":%d,\"soc\":%u,\"remaining\":%u,\"capacity\":%u,"
+                      "\"voltage\":{\"min\":%u,\"max\":%u},\"cells\":{\"min\":%u,\"max\":%u,\"delta\":%d}},",
+                 bank.batteries, bank.current, bank.soc, bank.remaining, bank.capacity,
+                 bank.minVoltage, bank.maxVoltage,
+                 bank.minCell, bank.maxCell, bank.maxCell - bank.minCell);
+  }
+
+  bufferPrintf(out, "\"batteries\":[");
+
+  for(int i = 0; i < totalLatest; i++) {
+    snapshot = &latest[i];
+    battery = snapshot->battery;
+
+    bufferPrintf(out, "%s{\"battery_id\":\"%s\",\"battery_name\":\"", i ? "," : "", battery->id);
+    bufferEscaped(out, battery->bname);
+    bufferPrintf(out, "\",\"RSSI\":%d,\"voltage\":%u,\"current\":%d,\"soc\":%u,\"temp\":%d,\"cycles\":%u,\"ampHrs\":%u,"
+                      "\"status\":%u,\"afe_status\":%u,\"cells\":[",
+                 snapshot->rssi, snapshot->voltage, snapshot->current, snapshot->soc, (int16_t)snapshot->temp,
+                 snapshot->cycleCount, snapshot->ampHrs, snapshot->status, snapshot->afeStatus);
+
+    for(int c = 0; c < snapshot->totalCells; c++) {
+      bufferPrintf(out, "%s%u", c ? "," : "", snapshot->cells[c]);
+    }
+
+    bufferPrintf(out, "],\"estimates\":{\"charge_since_full\":%d,\"current_avg\":%d,\"power_avg\":%d,\"time_to_empty\":%u,\"time_to_full\":%u},",
+                 snapshot->chargeSinceFull, snapshot->currentAvg, snapshot->powerAvg, snapshot->timeToEmpty,
+                 snapshot->timeToFull);
+
+    bufferPrintf(out, "\"metrics\":{\"polls\":%u,\"decodes\":%u,\"connect_failures\":%u,\"discovery_failures\":%u,"
+                      "\"checksum_rejects\":%u,\"resyncs\":%u,\"timeouts\":%u,\"requeues\":%u,\"publish_failures\":%u,"
+                      "\"mtu\":%u,\"interval_us\":%u},\"alarms\":[",
+                 battery->metrics.polls, battery->metrics.decodes, battery->metrics.connectFailures,
+                 battery->metrics.discoveryFailures, battery->metrics.checksumRejects, battery->metrics.resyncs,
+                 battery->metrics.timeouts, battery->metrics.requeues,
+                 battery->metrics.publishFailures, battery->link.mtu, battery->link.interval * 1250);
+
+    firstAlarm = true;
+
+    for(int a = 0; a < alarmManager->getTotalRules(); a++) {
+      if(snapshot->alarms & (1UL << a)) {
+        bufferPrintf(out, "%s\"%s\"", firstAlarm ? "" : ",", alarmManager->getRule(a)->name);
+        firstAlarm = false;
+      }
+    }
+
+    bufferPrintf(out, "]}");
+  }
+
+  bufferPrintf(out, "]}\n");
+}
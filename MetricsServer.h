@@ -0,0 +1,136 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFEMETRICSSERVER_H_
+#define LIFEMETRICSSERVER_H_
+
+#include "Arduino.h"
+#include <WiFi.h>
+#include "lifeblue.h"
+#include "TelemetryPipeline.h"
+
+#ifndef METRICS_HTTP_PORT
+#define METRICS_HTTP_PORT 8080
+#endif
+
+// How long to wait for a client to send its request, in ms
+#ifndef METRICS_HTTP_TIMEOUT
+#define METRICS_HTTP_TIMEOUT 1000
+#endif
+
+// Even with no new frames the gateway metrics (uptime, heap) are re-rendered after this many ms
+#ifndef METRICS_HTTP_MAX_AGE
+#define METRICS_HTTP_MAX_AGE 10000
+#endif
+
+#define METRICS_HTTP_REQUEST_SIZE 128
+
+/**
+ * A rendered response. It only ever grows, so once it's big enough re-rendering
+ * it doesn't touch the heap.
+ */
+struct renderBuffer_t {
+  char *data;
+  size_t length;
+  size_t size;
+};
+
+/**
+ * A small HTTP server for local integrations that don't want to go through MQTT:
+ *
+ * GET /metrics - everything in Prometheus text format
+ * GET /json    - the same as a JSON document
+ *
+ * Both responses are rendered into cached buffers at most once per decoded frame
+ * and served straight out of the cache until the next one, so scraping every few
+ * seconds costs next to nothing.
+ *
+ * The batteries are rendered from the MetricsServer's own copy of each one's
+ * latest snapshot (see update()), never from the batteryInfo_t the BLE task is
+ * decoding into. That copy and the cached responses are only touched with lock
+ * held. The counters and histograms are still read as they are, a count being
+ * one frame out doesn't matter to a scrape.
+ *
+ * loop() serves one client at a time and needs calling often, the sketch runs it
+ * in its own task so a scrape isn't held up by the main loop's waits.
+ */
+class MetricsServer
+{
+
+public:
+  void begin(uint16_t);
+  void loop();
+  bool update(const telemetrySnapshot_t *);
+
+  uint32_t getTotalRequests();
+  uint32_t getTotalRenders();
+
+  // Only needed on the host, to find the port when begin() was given 0
+  WiFiServer *getServer();
+
+  static MetricsServer *instance();
+
+private:
+  MetricsServer();
+  MetricsServer(MetricsServer const &) {};
+  MetricsServer& operator=(MetricsServer const &) { return *this; };
+
+  void handle(WiFiClient &);
+  void render();
+  void renderPrometheus(renderBuffer_t *);
+  void renderJson(renderBuffer_t *);
+
+  WiFiServer *server = NULL;
+  SemaphoreHandle_t lock; // latest, the rendered responses and dirty
+
+  telemetrySnapshot_t *latest = NULL; // each battery's last decoded frame, in the order they were first decoded
+  uint16_t totalLatest = 0;
+  uint16_t allocatedLatest = 0;
+
+  renderBuffer_t prometheus = {};
+  renderBuffer_t json = {};
+
+  bool dirty = true;
+  uint32_t lastRender = 0;
+
+  uint32_t totalRequests = 0;
+  uint32_t totalRenders = 0;
+
+  static MetricsServer *m_instance;
+};
+
+/**
+ * Hands each decoded frame to the MetricsServer, which only ever shows the
+ * latest one for each battery, so a battery's frames replace each other in the
+ * queue.
+ */
+class MetricsSink : public TelemetrySink
+{
+
+public:
+  MetricsSink() : TelemetrySink("metrics", SINK_LATEST) {};
+
+protected:
+  bool write(const telemetrySnapshot_t *);
+};
+
+#endif
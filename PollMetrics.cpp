@@ -0,0 +1,61 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "PollMetrics.h"
+
+static const char *pollStageNames[POLL_STAGE_COUNT] = {
+  "connect",
+  "discovery",
+  "subscribe",
+  "first_fragment",
+  "terminator",
+  "decode",
+  "total"
+};
+
+/**
+ * Add a single observation (in us) to a histogram. The bucket list is short
+ * so a linear walk is cheaper than anything clever.
+ */
+void histogramRecord(histogram_t *histogram, uint32_t value)
+{
+  uint8_t i;
+
+  for(i = 0; (i < METRICS_HISTOGRAM_BOUNDS) && (value > metricsHistogramBounds[i]); i++);
+
+  histogram->buckets[i]++;
+  histogram->count++;
+  histogram->sum += value;
+
+  if(value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+const char *pollStageName(pollStage_t stage)
+{
+  if(stage >= POLL_STAGE_COUNT) {
+    return "unknown";
+  }
+
+  return pollStageNames[stage];
+}
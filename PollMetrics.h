@@ -0,0 +1,83 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFEPOLLMETRICS_H_
+#define LIFEPOLLMETRICS_H_
+
+#include "Arduino.h"
+
+/**
+ * The stages of a single poll of a battery, in the order they happen. Each one
+ * is timed from the end of the previous one, except POLL_STAGE_TOTAL which is
+ * the whole poll from the start of the connect to the end of the decode.
+ */
+enum pollStage_t {
+  POLL_STAGE_CONNECT = 0,
+  POLL_STAGE_DISCOVERY,
+  POLL_STAGE_SUBSCRIBE,
+  POLL_STAGE_FIRST_FRAGMENT,
+  POLL_STAGE_TERMINATOR,
+  POLL_STAGE_DECODE,
+  POLL_STAGE_TOTAL,
+  POLL_STAGE_COUNT
+};
+
+/**
+ * Upper bounds (inclusive, in microseconds) of the histogram buckets. There is
+ * one extra bucket on the end for anything bigger than the last bound.
+ */
+#define METRICS_HISTOGRAM_BOUNDS 13
+
+static const uint32_t metricsHistogramBounds[METRICS_HISTOGRAM_BOUNDS] = {
+  250, 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000
+};
+
+struct histogram_t {
+  uint32_t buckets[METRICS_HISTOGRAM_BOUNDS + 1];
+  uint32_t count;
+  uint32_t max; // in us
+  uint64_t sum; // in us
+};
+
+/**
+ * Everything we keep track of about polling a single battery. It lives in
+ * batteryInfo_t and is never reset, so everything here is cumulative since boot.
+ */
+struct pollMetrics_t {
+  histogram_t stages[POLL_STAGE_COUNT];
+
+  uint32_t polls; // poll attempts
+  uint32_t decodes; // frames decoded successfully
+  uint32_t connectFailures;
+  uint32_t discoveryFailures; // service / characteristic not found or can't notify
+  uint32_t checksumRejects;
+  uint32_t resyncs; // frames abandoned part way through (lost fragments or garbage), the next one is used instead
+  uint32_t timeouts; // polls given up on without a good frame, see POLL_TIMEOUT and FRAME_MAX_REJECTS
+  uint32_t requeues;
+  uint32_t publishFailures;
+};
+
+void histogramRecord(histogram_t *, uint32_t);
+const char *pollStageName(pollStage_t);
+
+#endif
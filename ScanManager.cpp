@@ -0,0 +1,169 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#include "ScanManager.h"
+#include "lifeblue.h"
+
+ScanManager *ScanManager::m_instance = NULL;
+
+ScanManager *ScanManager::instance()
+{
+  if(!m_instance) {
+    m_instance = new ScanManager();
+  }
+
+  return m_instance;
+}
+
+const char *ScanManager::scanModeName(scanMode_t mode)
+{
+  switch(mode) {
+    case SCAN_DISCOVERY:
+      return "discovery";
+    case SCAN_REFRESH:
+      return "refresh";
+  }
+
+  return "unknown";
+}
+
+/**
+ * Call just before the scan is started, getInterval(), getWindow() and
+ * getDuration() are how it should be run
+ */
+void ScanManager::begin(scanMode_t mode)
+{
+  uint16_t known = BatteryManager::instance()->getTotalBatteries();
+
+  this->mode = mode;
+
+  target = (known > SCAN_EXPECTED_BATTERIES) ? known : SCAN_EXPECTED_BATTERIES;
+
+  seen = 0;
+  totalScans++;
+  started = millis();
+
+  Serial.printf("- Starting a BLE %s scan, looking for %d batteries\n", scanModeName(mode), target);
+}
+
+/**
+ * Called from the BT task for each advertisement as it's heard. Anything that
+ * isn't one of our batteries is ignored here and now, new batteries are added
+ * and the ones we know have their RSSI brought up to date.
+ */
+void ScanManager::advertised(BLEAdvertisedDevice *device)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  batteryInfo_t *battery;
+
+  if(!device->haveServiceUUID() || !device->isAdvertisingService(serviceUUID)) {
+    return;
+  }
+
+  if(!(battery = batteryManager->findBattery(device->getAddress()))) {
+    if(!batteryManager->addBattery(device)) {
+      return;
+    }
+
+    battery = batteryManager->findBattery(device->getAddress());
+    Serial.printf("- Found battery %s\n", battery->address);
+  }
+
+  battery->rssi = device->getRSSI();
+
+  if(battery->lastScan != totalScans) {
+    battery->lastScan = totalScans;
+    seen++;
+  }
+}
+
+/**
+ * Whether every battery we were looking for has turned up, there's no need to
+ * listen any longer
+ */
+bool ScanManager::isComplete()
+{
+  return target && (seen >= target);
+}
+
+/**
+ * Call once the scan has stopped, either because it ran its full time or
+ * because isComplete() said it could
+ */
+void ScanManager::finished()
+{
+  lastFinished = millis();
+  lastScanDuration = lastFinished - started;
+
+  Serial.printf("- BLE %s scan saw %d of %d batteries in %dms\n", scanModeName(mode), seen, target, lastScanDuration);
+}
+
+scanMode_t ScanManager::getMode()
+{
+  return mode;
+}
+
+uint16_t ScanManager::getInterval()
+{
+  return (mode == SCAN_REFRESH) ? SCAN_REFRESH_INTERVAL : SCAN_DISCOVERY_INTERVAL;
+}
+
+uint16_t ScanManager::getWindow()
+{
+  return (mode == SCAN_REFRESH) ? SCAN_REFRESH_WINDOW : SCAN_DISCOVERY_WINDOW;
+}
+
+/**
+ * The longest the scan runs, in seconds
+ */
+uint32_t ScanManager::getDuration()
+{
+  return (mode == SCAN_REFRESH) ? SCAN_REFRESH_TIME : SCAN_DISCOVERY_TIME;
+}
+
+uint16_t ScanManager::getSeen()
+{
+  return seen;
+}
+
+uint32_t ScanManager::getTotalScans()
+{
+  return totalScans;
+}
+
+uint32_t ScanManager::getLastScanDuration()
+{
+  return lastScanDuration;
+}
+
+/**
+ * Whether it's been SCAN_REFRESH_PERIOD since the last scan finished
+ */
+bool ScanManager::isRefreshDue()
+{
+  if(!SCAN_REFRESH_PERIOD || !totalScans) {
+    return false;
+  }
+
+  return (millis() - lastFinished) >= SCAN_REFRESH_PERIOD;
+}
@@ -0,0 +1,124 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifndef LIFESCANMGR_H_
+#define LIFESCANMGR_H_
+
+#include "Arduino.h"
+#include "BatteryManager.h"
+#include <BLEDevice.h>
+
+/**
+ * Scan timings, intervals and windows in ms. A discovery scan listens the whole
+ * time, a refresh only part of it so the WiFi (which shares the radio) keeps up.
+ */
+#ifndef SCAN_DISCOVERY_TIME
+#define SCAN_DISCOVERY_TIME 10 // seconds, the longest a discovery scan runs
+#endif
+
+#ifndef SCAN_DISCOVERY_INTERVAL
+#define SCAN_DISCOVERY_INTERVAL 100
+#endif
+
+#ifndef SCAN_DISCOVERY_WINDOW
+#define SCAN_DISCOVERY_WINDOW 100
+#endif
+
+#ifndef SCAN_REFRESH_TIME
+#define SCAN_REFRESH_TIME 10 // seconds, the longest a refresh runs
+#endif
+
+#ifndef SCAN_REFRESH_INTERVAL
+#define SCAN_REFRESH_INTERVAL 100
+#endif
+
+#ifndef SCAN_REFRESH_WINDOW
+#define SCAN_REFRESH_WINDOW 40
+#endif
+
+// ms between background refreshes, 0 for none
+#ifndef SCAN_REFRESH_PERIOD
+#define SCAN_REFRESH_PERIOD 3600000
+#endif
+
+// Batteries in the bank, if you know. Any scan stops as soon as it has found this many, 0 if you don't.
+#ifndef SCAN_EXPECTED_BATTERIES
+#define SCAN_EXPECTED_BATTERIES 0
+#endif
+
+enum scanMode_t {
+  SCAN_DISCOVERY = 0, // looking for batteries we don't know about (boot, someone asked for a rescan)
+  SCAN_REFRESH // checking the ones we know are still there, and how well we hear them
+};
+
+/**
+ * Decides how each BLE scan is run and when it can stop. Advertisements are
+ * handed over as they arrive (see advertised()) and batteries are added straight
+ * away, rather than sifting through everything that was heard once the scan
+ * has run its full time.
+ *
+ * A scan of either kind is complete once it has seen every battery it was
+ * looking for: SCAN_EXPECTED_BATTERIES, or all of the ones we already know about
+ * if that's more. With nothing to look for (a discovery scan at boot with
+ * SCAN_EXPECTED_BATTERIES at 0) it runs its full time.
+ */
+class ScanManager
+{
+
+public:
+  void begin(scanMode_t);
+  void advertised(BLEAdvertisedDevice *);
+  bool isComplete();
+  void finished();
+
+  scanMode_t getMode();
+  uint16_t getInterval();
+  uint16_t getWindow();
+  uint32_t getDuration();
+
+  uint16_t getSeen();
+  uint32_t getTotalScans();
+  uint32_t getLastScanDuration();
+  bool isRefreshDue();
+
+  static const char *scanModeName(scanMode_t);
+  static ScanManager *instance();
+
+private:
+  ScanManager() {};
+  ScanManager(ScanManager const &) {};
+  ScanManager& operator=(ScanManager const &) { return *this; };
+
+  scanMode_t mode = SCAN_DISCOVERY;
+  uint16_t target = 0; // batteries to see before we can stop early, 0 to run the full time
+  volatile uint16_t seen = 0; // batteries seen this scan, known or new
+
+  uint32_t totalScans = 0; // the current scan's number once begin() is called, batteryInfo_t::lastScan is one of these
+  uint32_t started = 0; // millis()
+  uint32_t lastScanDuration = 0; // ms
+  uint32_t lastFinished = 0; // millis()
+
+  static ScanManager *m_instance;
+};
+
+#endif
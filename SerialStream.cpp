@@ -0,0 +1,171 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#include "SerialStream.h"
+#include "AlarmManager.h"
+#include "BatteryManager.h"
+
+static uint8_t *put8(uint8_t *p, uint8_t value)
+{
+  *p++ = value;
+  return p;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t value)
+{
+  *p++ = value & 0xff;
+  *p++ = value >> 8;
+  return p;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value)
+{
+  *p++ = value & 0xff;
+  *p++ = (value >> 8) & 0xff;
+  *p++ = (value >> 16) & 0xff;
+  *p++ = value >> 24;
+  return p;
+}
+
+uint32_t SerialSink::getTotalAlarms()
+{
+  return totalAlarms;
+}
+
+/**
+ * The payload is already in place after the header, fills in the header and CRC
+ * around it and sends the lot
+ */
+void SerialSink::writeRecord(streamRecordType_t type, uint8_t *end, uint16_t length)
+{
+  record[0] = STREAM_SYNC_0;
+  record[1] = STREAM_SYNC_1;
+  record[2] = type;
+  put16(&record[3], length);
+
+  put16(end, streamCrc(0xffff, &record[2], STREAM_HEADER_LENGTH - 2 + length));
+
+  out.write(record, STREAM_HEADER_LENGTH + length + STREAM_CRC_LENGTH);
+}
+
+void SerialSink::writeAlarm(const telemetrySnapshot_t *snapshot, uint8_t rule)
+{
+  AlarmManager *alarmManager = AlarmManager::instance();
+  const char *name = alarmManager->getRule(rule)->name;
+  uint8_t nameLength = strlen(name);
+  uint8_t *p = &record[STREAM_HEADER_LENGTH];
+
+  if(STREAM_ALARM_LENGTH(nameLength) > STREAM_SNAPSHOT_LENGTH(MAX_BATTERY_CELLS)) {
+    nameLength = STREAM_SNAPSHOT_LENGTH(MAX_BATTERY_CELLS) - STREAM_ALARM_LENGTH(0);
+  }
+
+  memcpy(p, snapshot->battery->bdAddress, 6);
+  p += 6;
+  p = put32(p, snapshot->timestamp);
+  p = put8(p, rule);
+  p = put8(p, (snapshot->alarms >> rule) & 1);
+  p = put32(p, alarmManager->getRuleValue(alarmManager->getRule(rule), snapshot));
+  p = put8(p, nameLength);
+  memcpy(p, name, nameLength);
+  p += nameLength;
+
+  writeRecord(STREAM_RECORD_ALARM, p, STREAM_ALARM_LENGTH(nameLength));
+  totalAlarms++;
+}
+
+/**
+ * The active alarms on every battery as they are now, after snapshots (and any
+ * alarm records with them) were dropped
+ */
+void SerialSink::writeAlarmStates()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  batteryInfo_t *battery;
+  uint8_t *p;
+
+  for(uint16_t i = 0; i < batteryManager->getTotalBatteries(); i++) {
+    battery = batteryManager->getBattery(i);
+
+    if(!battery->id[0]) {
+      continue; // never decoded, so no alarms either
+    }
+
+    p = &record[STREAM_HEADER_LENGTH];
+
+    memcpy(p, battery->bdAddress, 6);
+    p += 6;
+    p = put32(p, millis());
+    p = put32(p, battery->alarms.active);
+
+    writeRecord(STREAM_RECORD_ALARM_STATE, p, STREAM_ALARM_STATE_LENGTH);
+  }
+}
+
+bool SerialSink::write(const telemetrySnapshot_t *snapshot)
+{
+  uint8_t *p = &record[STREAM_HEADER_LENGTH];
+
+  memcpy(p, snapshot->battery->bdAddress, 6);
+  p += 6;
+  p = put32(p, snapshot->timestamp);
+  p = put32(p, snapshot->decodes);
+  p = put8(p, (snapshot->restored ? STREAM_FLAG_RESTORED : 0) | (snapshot->seenFull ? STREAM_FLAG_SEEN_FULL : 0));
+  p = put8(p, snapshot->rssi);
+  p = put32(p, snapshot->voltage);
+  p = put32(p, snapshot->current);
+  p = put32(p, snapshot->ampHrs);
+  p = put16(p, snapshot->cycleCount);
+  p = put16(p, snapshot->soc);
+  p = put16(p, snapshot->temp);
+  p = put16(p, snapshot->status);
+  p = put16(p, snapshot->afeStatus);
+  p = put16(p, snapshot->minCell);
+  p = put16(p, snapshot->maxCell);
+  p = put32(p, snapshot->alarms);
+  p = put32(p, snapshot->chargeSinceFull);
+  p = put32(p, snapshot->currentAvg);
+  p = put32(p, snapshot->powerAvg);
+  p = put32(p, snapshot->timeToEmpty);
+  p = put32(p, snapshot->timeToFull);
+  p = put8(p, snapshot->totalCells);
+
+  for(uint8_t i = 0; i < snapshot->totalCells; i++) {
+    p = put16(p, snapshot->cells[i]);
+  }
+
+  writeRecord(STREAM_RECORD_SNAPSHOT, p, STREAM_SNAPSHOT_LENGTH(snapshot->totalCells));
+
+  // Restored frames had their alarms sent when they were first decoded
+  for(uint8_t i = 0; !snapshot->restored && (i < AlarmManager::instance()->getTotalRules()); i++) {
+    if(snapshot->alarmsChanged & (1UL << i)) {
+      writeAlarm(snapshot, i);
+    }
+  }
+
+  if(getDropped() != resynced) {
+    resynced = getDropped();
+    writeAlarmStates();
+  }
+
+  return true;
+}
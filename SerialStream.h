@@ -0,0 +1,71 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifndef LIFESERIALSTREAM_H_
+#define LIFESERIALSTREAM_H_
+
+#include "Arduino.h"
+#include "TelemetryPipeline.h"
+#include "SerialStreamFormat.h"
+
+// Snapshots waiting to go out, at SERIAL_BAUD the port keeps up with anything short of a huge bank
+#ifndef SERIAL_STREAM_QUEUE_SIZE
+#define SERIAL_STREAM_QUEUE_SIZE 16
+#endif
+
+#define SERIAL_STREAM_RECORD_SIZE (STREAM_HEADER_LENGTH + STREAM_SNAPSHOT_LENGTH(MAX_BATTERY_CELLS) + STREAM_CRC_LENGTH)
+
+/**
+ * Writes every decoded frame, and the alarms it raised or cleared, to a serial
+ * port as binary records (see SerialStreamFormat.h) for a wired host to read
+ * with tools/streamreader. The records go out alongside the usual text log, the
+ * reader picks them out by their sync bytes and CRC.
+ *
+ * Each record is built up front and handed to the port in one write() so text
+ * printed from another task can't land in the middle of it. If snapshots had to
+ * be dropped the alarm records that went with them are lost, so the next write
+ * follows up with the state of every alarm on every battery.
+ */
+class SerialSink : public TelemetrySink
+{
+
+public:
+  SerialSink(Print &out) : TelemetrySink("serial", SINK_DROP_OLDEST, SERIAL_STREAM_QUEUE_SIZE), out(out) {};
+
+  uint32_t getTotalAlarms();
+
+protected:
+  bool write(const telemetrySnapshot_t *);
+
+private:
+  void writeRecord(streamRecordType_t, uint8_t *, uint16_t);
+  void writeAlarm(const telemetrySnapshot_t *, uint8_t);
+  void writeAlarmStates();
+
+  Print &out;
+  uint8_t record[SERIAL_STREAM_RECORD_SIZE];
+  uint32_t totalAlarms = 0;
+  uint32_t resynced = 0; // getDropped() when the alarm states were last written
+};
+
+#endif
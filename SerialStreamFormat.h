@@ -0,0 +1,114 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifndef LIFESTREAMFORMAT_H_
+#define LIFESTREAMFORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The binary records SerialSink writes out of the serial port (see
+ * SerialStream.h). This header has nothing from the Arduino side in it so the
+ * host reader in tools/streamreader can use it as-is.
+ *
+ * Every record is:
+ *
+ *   0xa5 0x5a        sync, neither byte turns up in the text log it's mixed in with
+ *   type             uint8_t, streamRecordType_t
+ *   length           uint16_t, bytes of payload
+ *   payload
+ *   crc              uint16_t, CRC-16/CCITT-FALSE of type, length and payload
+ *
+ * Everything is little endian. A reader skips record types it doesn't know and
+ * anything on the end of a payload past the fields it knows about, new fields
+ * only ever go on the end.
+ */
+#define STREAM_SYNC_0 0xa5
+#define STREAM_SYNC_1 0x5a
+
+#define STREAM_HEADER_LENGTH 5 // sync, type and length
+#define STREAM_CRC_LENGTH 2
+
+// Anything longer is a corrupt length, not a record
+#define STREAM_MAX_PAYLOAD 1024
+
+enum streamRecordType_t {
+  /**
+   * A decoded frame (telemetrySnapshot_t):
+   *
+   *   address[6], timestamp (uint32_t ms), decodes (uint32_t), flags (uint8_t, streamFlags_t),
+   *   rssi (int8_t), voltage (uint32_t mV), current (int32_t mA), ampHrs (uint32_t mAh),
+   *   cycleCount (uint16_t), soc (uint16_t %), temp (int16_t tenths of a degree C),
+   *   status (uint16_t), afeStatus (uint16_t), minCell (uint16_t mV), maxCell (uint16_t mV),
+   *   alarms (uint32_t, a bit per rule), chargeSinceFull (int32_t mAh), currentAvg (int32_t mA),
+   *   powerAvg (int32_t mW), timeToEmpty (uint32_t s), timeToFull (uint32_t s),
+   *   totalCells (uint8_t), cells (uint16_t mV each)
+   */
+  STREAM_RECORD_SNAPSHOT = 1,
+
+  /**
+   * An alarm raised or cleared, written straight after the snapshot of the frame
+   * that did it:
+   *
+   *   address[6], timestamp (uint32_t ms), rule (uint8_t), active (uint8_t),
+   *   value (int32_t), name length (uint8_t), name
+   */
+  STREAM_RECORD_ALARM = 2,
+
+  /**
+   * Which alarms are active on a battery. Snapshots dropped because the port
+   * couldn't keep up take their alarm records with them, so after a drop one of
+   * these is written for every battery with its state at the time:
+   *
+   *   address[6], timestamp (uint32_t ms), alarms (uint32_t, a bit per rule)
+   */
+  STREAM_RECORD_ALARM_STATE = 3
+};
+
+enum streamFlags_t {
+  STREAM_FLAG_RESTORED = 0x01, // put back after a deep sleep, not freshly decoded
+  STREAM_FLAG_SEEN_FULL = 0x02 // chargeSinceFull is counted from a full charge
+};
+
+#define STREAM_SNAPSHOT_LENGTH(cells) (67 + (cells) * 2)
+#define STREAM_ALARM_LENGTH(name) (17 + (name))
+#define STREAM_ALARM_STATE_LENGTH 14
+
+/**
+ * CRC-16/CCITT-FALSE, start with 0xffff
+ */
+static inline uint16_t streamCrc(uint16_t crc, const uint8_t *data, size_t length)
+{
+  while(length--) {
+    crc ^= (uint16_t)*data++ << 8;
+
+    for(uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+
+  return crc;
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "SleepManager.h"
+#include "AlarmManager.h"
+#include <esp_sleep.h>
+
+SleepManager *SleepManager::m_instance = NULL;
+
+// Zeroed on power on, left alone by a deep sleep
+RTC_DATA_ATTR static sleepState_t sleepState;
+
+SleepManager *SleepManager::instance()
+{
+  if(!m_instance) {
+    m_instance = new SleepManager();
+  }
+
+  return m_instance;
+}
+
+/**
+ * Call once at boot, after the BatteryManager is created. If we're waking up from
+ * our own deep sleep, the batteries and scheduler state are put back the way
+ * they were and this returns true.
+ */
+bool SleepManager::restore()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+
+  if(!batteryManager->getPollInterval()) {
+    batteryManager->setPollInterval(SLEEP_INTERVAL); // the interval is how long we sleep, it can't be 0
+  }
+
+  if((esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) || (sleepState.magic != SLEEP_MAGIC)) {
+    memset(&sleepState, 0, sizeof(sleepState_t));
+    return false;
+  }
+
+  Serial.printf("- Woke up from sleep %u (%u ms), restoring %u batteries\n", sleepState.totalSleeps,
+                sleepState.sleptFor, sleepState.totalBatteries);
+
+  batteryManager->setTotalSweeps(sleepState.totalSweeps);
+  batteryManager->setDeadbands(&sleepState.deadbands);
+
+  if(sleepState.pollInterval) {
+    batteryManager->setPollInterval(sleepState.pollInterval);
+  }
+
+  sweepsAtWake = sleepState.totalSweeps;
+
+  for(uint16_t i = 0; i < sleepState.totalBatteries; i++) {
+    restoreBattery(&sleepState.batteries[i]);
+  }
+
+  if(sleepState.totalBatteries && (++sleepState.wakesSinceScan < SLEEP_RESCAN_WAKES)) {
+    scan = false;
+  } else {
+    sleepState.wakesSinceScan = 0;
+  }
+
+  return true;
+}
+
+/**
+ * Puts one battery back. Its publish and estimator timestamps were saved as ages,
+ * they're turned back into millis() counting the time we were asleep, so
+ * DEADBAND_MAX_AGE still holds and the estimator integrates across sleeps.
+ */
+void SleepManager::restoreBattery(sleepBattery_t *saved)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  batteryInfo_t *battery;
+
+  if(!batteryManager->addBattery(BLEAddress(saved->bdAddress), saved->addressType, saved->bname, saved->rssi) ||
+     !(battery = batteryManager->findBattery(BLEAddress(saved->bdAddress)))) {
+    return;
+  }
+
+  battery->link = saved->link;
+  battery->published = saved->published;
+  battery->published.decodes = 0;
+  battery->published.timestamp = millis() - (saved->published.timestamp + sleepState.sleptFor);
+
+  battery->estimator = saved->estimator;
+  battery->estimator.lastUpdate = millis() - (saved->estimator.lastUpdate + sleepState.sleptFor);
+
+  AlarmManager::instance()->restore(battery, &saved->alarms, sleepState.alarmsLost);
+
+  if(!saved->pending) {
+    return;
+  }
+
+  battery->voltage = saved->voltage;
+  battery->current = saved->current;
+  battery->ampHrs = saved->ampHrs;
+  battery->cycleCount = saved->cycleCount;
+  battery->soc = saved->soc;
+  battery->temp = saved->temp;
+  battery->status = saved->status;
+  battery->afeStatus = saved->afeStatus;
+
+  if(saved->totalCells && batteryManager->allocateCells(battery, saved->totalCells)) {
+    memcpy(battery->cells, saved->cells, saved->totalCells * sizeof(uint16_t));
+  }
+
+  batteryManager->restoreFrame(battery);
+}
+
+/**
+ * Whether the bank has to be scanned this boot: a cold start, a bank too big to
+ * keep in RTC memory, or every SLEEP_RESCAN_WAKES wakes to pick up new batteries
+ */
+bool SleepManager::needsScan()
+{
+  return scan;
+}
+
+/**
+ * Whether this wake's sweep is done, or has taken so long we're going to publish
+ * what we have anyway
+ */
+bool SleepManager::isSweepDone()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+
+  if(millis() >= SLEEP_POLL_TIMEOUT) {
+    return true;
+  }
+
+  return (batteryManager->getTotalSweeps() != sweepsAtWake) && batteryManager->isIdle();
+}
+
+/**
+ * Call once everything from this wake has been published. The time it took from
+ * waking up is the number low power mode is all about, see getWakeToPublish().
+ */
+void SleepManager::published()
+{
+  if(!wakeToPublish) {
+    wakeToPublish = millis();
+  }
+}
+
+/**
+ * ms from waking up (boot, really, the ROM bootloader isn't counted) until
+ * everything was published, 0 until it has been
+ */
+uint32_t SleepManager::getWakeToPublish()
+{
+  return wakeToPublish;
+}
+
+uint32_t SleepManager::getTotalSleeps()
+{
+  return sleepState.totalSleeps;
+}
+
+void SleepManager::saveBattery(sleepBattery_t *saved, batteryInfo_t *battery)
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+
+  memset(saved, 0, sizeof(sleepBattery_t));
+
+  memcpy(saved->bdAddress, battery->bdAddress, sizeof(esp_bd_addr_t));
+  saved->addressType = battery->addressType;
+  saved->rssi = battery->rssi;
+  strncpy(saved->bname, battery->bname, sizeof(saved->bname) - 1);
+  saved->link = battery->link;
+
+  saved->published = battery->published;
+  saved->published.timestamp = millis() - battery->published.timestamp;
+
+  saved->alarms = battery->alarms;
+  saved->estimator = battery->estimator;
+  saved->estimator.lastUpdate = millis() - battery->estimator.lastUpdate;
+
+  if(!(saved->pending = batteryManager->needsPublish(battery))) {
+    return;
+  }
+
+  saved->voltage = battery->voltage;
+  saved->current = battery->current;
+  saved->ampHrs = battery->ampHrs;
+  saved->cycleCount = battery->cycleCount;
+  saved->soc = battery->soc;
+  saved->temp = battery->temp;
+  saved->status = battery->status;
+  saved->afeStatus = battery->afeStatus;
+  saved->totalCells = (battery->totalCells < MAX_BATTERY_CELLS) ? battery->totalCells : MAX_BATTERY_CELLS;
+
+  memcpy(saved->cells, battery->cells, saved->totalCells * sizeof(uint16_t));
+}
+
+void SleepManager::save()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  uint16_t totalBatteries = batteryManager->getTotalBatteries();
+
+  if(totalBatteries > SLEEP_MAX_BATTERIES) {
+    Serial.printf("- FAILED: Only %u of %u batteries fit in RTC memory, the rest will be scanned for\n",
+                  SLEEP_MAX_BATTERIES, totalBatteries);
+
+    totalBatteries = SLEEP_MAX_BATTERIES;
+    sleepState.wakesSinceScan = SLEEP_RESCAN_WAKES;
+  }
+
+  sleepState.totalSweeps = batteryManager->getTotalSweeps();
+  sleepState.pollInterval = batteryManager->getPollInterval();
+  sleepState.deadbands = *batteryManager->getDeadbands();
+  sleepState.alarmsLost = AlarmManager::instance()->hasPending() || AlarmManager::instance()->needsResync();
+  sleepState.totalBatteries = totalBatteries;
+
+  for(uint16_t i = 0; i < totalBatteries; i++) {
+    saveBattery(&sleepState.batteries[i], batteryManager->getBattery(i));
+  }
+
+  sleepState.magic = SLEEP_MAGIC;
+}
+
+/**
+ * Saves everything to RTC memory and goes into deep sleep until the next poll
+ * interval, counted from when we woke up. Turn the WiFi and display off first.
+ * Never returns, waking up starts again from setup().
+ */
+void SleepManager::sleep()
+{
+  uint32_t interval = BatteryManager::instance()->getPollInterval();
+  uint32_t awake = millis();
+
+  if(!interval) {
+    interval = SLEEP_INTERVAL;
+  }
+
+  save();
+
+  sleepState.sleptFor = ((awake + SLEEP_MIN_SLEEP) < interval) ? (interval - awake) : SLEEP_MIN_SLEEP;
+  sleepState.totalSleeps++;
+
+  Serial.printf("- Awake for %u ms, sleeping for %u ms\n", awake, sleepState.sleptFor);
+  Serial.flush();
+
+  esp_sleep_enable_timer_wakeup((uint64_t)sleepState.sleptFor * 1000);
+  esp_deep_sleep_start();
+}
@@ -0,0 +1,152 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFESLEEPMGR_H_
+#define LIFESLEEPMGR_H_
+
+#include "Arduino.h"
+#include "BatteryManager.h"
+
+// ms from one wake to the next when the poll interval hasn't been set
+#ifndef SLEEP_INTERVAL
+#define SLEEP_INTERVAL 300000
+#endif
+
+// ms after waking we give up on finishing the sweep and publish what we have
+#ifndef SLEEP_POLL_TIMEOUT
+#define SLEEP_POLL_TIMEOUT 60000
+#endif
+
+// ms after waking we go back to sleep whether everything's been published or not
+#ifndef SLEEP_AWAKE_TIMEOUT
+#define SLEEP_AWAKE_TIMEOUT 90000
+#endif
+
+// Shortest sleep, for when a wake has run past the interval
+#ifndef SLEEP_MIN_SLEEP
+#define SLEEP_MIN_SLEEP 1000
+#endif
+
+// Wakes between full scans, so batteries added to the bank are found
+#ifndef SLEEP_RESCAN_WAKES
+#define SLEEP_RESCAN_WAKES 48
+#endif
+
+// Batteries kept in RTC memory (8k on the ESP32, each one is about 200 bytes)
+#ifndef SLEEP_MAX_BATTERIES
+#define SLEEP_MAX_BATTERIES 24
+#endif
+
+#define SLEEP_MAGIC 0x4c425a34 // "LBZ4", bump it when sleepState_t changes
+
+/**
+ * What we keep about a battery while we're asleep: enough to connect to it again
+ * without a scan, its last frame if that never got published, what it looked
+ * like when it was last published so the deadbands carry on working, and its
+ * alarm and estimator state so neither starts again from scratch every wake.
+ */
+struct sleepBattery_t {
+  esp_bd_addr_t bdAddress;
+  uint8_t addressType;
+  int8_t rssi;
+  char bname[20];
+  linkParams_t link; // so we don't have to negotiate it again
+
+  bool pending; // decoded and not published yet, the rest of the frame is only valid if this is set
+  uint32_t voltage;
+  int32_t current;
+  uint32_t ampHrs;
+  uint16_t cycleCount;
+  uint16_t soc;
+  uint16_t temp;
+  uint16_t status;
+  uint16_t afeStatus;
+  uint8_t totalCells;
+  uint16_t cells[MAX_BATTERY_CELLS];
+
+  publishState_t published; // timestamp is how long before we went to sleep, not a millis()
+  alarmState_t alarms;
+  stateEstimator_t estimator; // lastUpdate is how long before we went to sleep, like published
+};
+
+/**
+ * Everything that survives a deep sleep, it lives in RTC memory
+ */
+struct sleepState_t {
+  uint32_t magic; // SLEEP_MAGIC once there's something here worth restoring
+  uint32_t totalSleeps;
+  uint32_t sleptFor; // ms we asked to sleep for last time
+  uint16_t wakesSinceScan;
+
+  uint32_t totalSweeps;
+  uint32_t pollInterval;
+  publishDeadbands_t deadbands;
+  bool alarmsLost; // alarm transitions were still waiting to be published when we went to sleep
+
+  uint16_t totalBatteries;
+  sleepBattery_t batteries[SLEEP_MAX_BATTERIES];
+};
+
+/**
+ * Low power mode (LOW_POWER). The gateway wakes up, polls every battery once
+ * with the WiFi off, brings the WiFi up to publish it all in one go, then goes
+ * into deep sleep until the next poll interval comes around.
+ *
+ * Deep sleep loses everything in RAM, so what we need to start polling again
+ * straight away (the batteries we found, the sweep count, what's been set over
+ * MQTT) is kept in RTC memory. Waking up from that skips the splash screen and
+ * the scan. Frames that couldn't be published before we had to sleep are kept
+ * too, and go out with the next batch.
+ */
+class SleepManager
+{
+
+public:
+  bool restore();
+  bool needsScan();
+
+  bool isSweepDone();
+  void published();
+  uint32_t getWakeToPublish();
+  uint32_t getTotalSleeps();
+
+  void sleep();
+
+  static SleepManager *instance();
+
+private:
+  SleepManager() {};
+  SleepManager(SleepManager const &) {};
+  SleepManager& operator=(SleepManager const &) { return *this; };
+
+  void save();
+  void saveBattery(sleepBattery_t *, batteryInfo_t *);
+  void restoreBattery(sleepBattery_t *);
+
+  bool scan = true; // nothing (or not everything) came back from RTC memory, the bank has to be scanned
+  uint32_t sweepsAtWake = 0;
+  uint32_t wakeToPublish = 0; // ms, 0 until everything from this wake is published
+
+  static SleepManager *m_instance;
+};
+
+#endif
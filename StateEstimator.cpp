@@ -0,0 +1,109 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "StateEstimator.h"
+
+/**
+ * One step of an exponentially weighted moving average for a sample dt ms after
+ * the last one. The weight is dt / (tau + dt) (in Q16), which is close to
+ * 1 - e^(-dt/tau) for short gaps and never goes past 1 for long ones, so
+ * irregular poll intervals are weighted properly without needing exp().
+ */
+static int64_t ewmaUpdate(int64_t average, int32_t sample, uint32_t dt)
+{
+  int64_t alpha = ((int64_t)dt << 16) / ((int64_t)ESTIMATOR_TAU + dt);
+  int64_t target = (int64_t)sample * ESTIMATOR_ONE;
+
+  return average + ((target - average) * alpha) / 65536;
+}
+
+/**
+ * Feed a decoded frame into the estimator. now is millis(), current is in mA
+ * (negative when discharging), voltage in mV, ampHrs is the remaining capacity in
+ * mAh as reported by the battery and soc is in %.
+ *
+ * Charge is integrated with the trapezoid rule between this sample and the last,
+ * unless the gap is longer than ESTIMATOR_MAX_GAP in which case we start over
+ * rather than guess at what happened in between.
+ */
+void estimatorUpdate(stateEstimator_t *estimator, uint32_t now, int32_t current, uint32_t voltage, uint32_t ampHrs, uint16_t soc)
+{
+  uint32_t dt = now - estimator->lastUpdate;
+  int32_t power = ((int64_t)voltage * current) / 1000;
+  int32_t averageCurrent;
+  uint64_t capacity;
+
+  if(!estimator->haveSample || (dt > ESTIMATOR_MAX_GAP)) {
+    estimator->ewmaCurrent = current * ESTIMATOR_ONE;
+    estimator->ewmaPower = (int64_t)power * ESTIMATOR_ONE;
+  } else {
+    estimator->charge += ((int64_t)estimator->lastCurrent + current) * dt / 2;
+    estimator->ewmaCurrent = (int32_t)ewmaUpdate(estimator->ewmaCurrent, current, dt);
+    estimator->ewmaPower = ewmaUpdate(estimator->ewmaPower, power, dt);
+  }
+
+  if(soc >= 100) {
+    estimator->charge = 0;
+    estimator->seenFull = true;
+  }
+
+  estimator->lastCurrent = current;
+  estimator->lastUpdate = now;
+  estimator->haveSample = true;
+
+  averageCurrent = estimatorCurrent(estimator);
+  capacity = (soc > 0) ? ((uint64_t)ampHrs * 100) / soc : 0;
+
+  estimator->timeToEmpty = 0;
+  estimator->timeToFull = 0;
+
+  if(averageCurrent < -ESTIMATOR_IDLE_CURRENT) {
+    estimator->timeToEmpty = ((uint64_t)ampHrs * 3600) / -averageCurrent;
+  } else if((averageCurrent > ESTIMATOR_IDLE_CURRENT) && (capacity > ampHrs)) {
+    estimator->timeToFull = ((capacity - ampHrs) * 3600) / averageCurrent;
+  }
+}
+
+/**
+ * Net charge (in mAh) into (+) or out of (-) the battery since the last time it
+ * was full, or since boot if we haven't seen it full yet (see seenFull)
+ */
+int32_t estimatorChargeSinceFull(stateEstimator_t *estimator)
+{
+  return estimator->charge / MAH_IN_MA_MS;
+}
+
+/**
+ * Smoothed current in mA
+ */
+int32_t estimatorCurrent(stateEstimator_t *estimator)
+{
+  return estimator->ewmaCurrent / ESTIMATOR_ONE;
+}
+
+/**
+ * Smoothed power in mW
+ */
+int32_t estimatorPower(stateEstimator_t *estimator)
+{
+  return estimator->ewmaPower / ESTIMATOR_ONE;
+}
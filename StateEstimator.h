@@ -0,0 +1,74 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFESTATEESTIMATOR_H_
+#define LIFESTATEESTIMATOR_H_
+
+#include "Arduino.h"
+
+// Time constant of the smoothed current and power, in ms
+#ifndef ESTIMATOR_TAU
+#define ESTIMATOR_TAU 60000
+#endif
+
+// Gaps between samples longer than this (in ms) aren't integrated, we have no idea what happened
+#ifndef ESTIMATOR_MAX_GAP
+#define ESTIMATOR_MAX_GAP 600000
+#endif
+
+// Below this (in mA, either way) the battery is considered idle and we don't project anything
+#ifndef ESTIMATOR_IDLE_CURRENT
+#define ESTIMATOR_IDLE_CURRENT 100
+#endif
+
+// The smoothed values are kept as fixed point with this many fractional bits
+#define ESTIMATOR_FRACTION_BITS 8
+#define ESTIMATOR_ONE (1 << ESTIMATOR_FRACTION_BITS)
+
+#define MAH_IN_MA_MS 3600000LL
+
+/**
+ * Streaming estimates for a single battery. Everything here is updated in O(1)
+ * from each decoded frame using integer maths only, and copes with the time
+ * between frames being all over the place (requeues, rescans, etc.)
+ */
+struct stateEstimator_t {
+  uint32_t lastUpdate; // millis() of the last sample
+  bool haveSample; // false until the first sample
+  bool seenFull; // true once we've seen a full charge, before that charge is counted since boot
+
+  int32_t lastCurrent; // mA, for the trapezoid
+  int64_t charge; // mA*ms in (+) or out (-) of the battery since the last full charge
+
+  int32_t ewmaCurrent; // mA, fixed point
+  int64_t ewmaPower; // mW, fixed point, a 48V bank at 200A is already past what fits in an int32_t
+
+  uint32_t timeToEmpty; // seconds, 0 if not discharging
+  uint32_t timeToFull; // seconds, 0 if not charging
+};
+
+void estimatorUpdate(stateEstimator_t *, uint32_t, int32_t, uint32_t, uint32_t, uint16_t);
+int32_t estimatorChargeSinceFull(stateEstimator_t *);
+int32_t estimatorCurrent(stateEstimator_t *);
+int32_t estimatorPower(stateEstimator_t *);
+
+#endif
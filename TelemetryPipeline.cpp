@@ -0,0 +1,322 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "TelemetryPipeline.h"
+
+TelemetryPipeline *TelemetryPipeline::m_instance = NULL;
+
+TelemetrySink::TelemetrySink(const char *name, sinkPolicy_t policy, uint8_t size)
+{
+  this->name = name;
+  this->policy = policy;
+
+  queue = (telemetrySnapshot_t *)os_zalloc(size * sizeof(telemetrySnapshot_t));
+
+  if(!queue) {
+    Serial.printf("- FAILED: Could not allocate the queue for the %s sink, it won't get anything\n", name);
+    return;
+  }
+
+  this->size = size;
+}
+
+TelemetrySink::~TelemetrySink()
+{
+  free(queue);
+}
+
+const char *TelemetrySink::getName()
+{
+  return name;
+}
+
+sinkPolicy_t TelemetrySink::getPolicy()
+{
+  return policy;
+}
+
+uint8_t TelemetrySink::getQueued()
+{
+  uint8_t queued;
+
+  portENTER_CRITICAL(&mux);
+  queued = count;
+  portEXIT_CRITICAL(&mux);
+
+  return queued;
+}
+
+uint8_t TelemetrySink::getQueueSize()
+{
+  return size;
+}
+
+uint32_t TelemetrySink::getWritten()
+{
+  return written;
+}
+
+uint32_t TelemetrySink::getDropped()
+{
+  return dropped;
+}
+
+/**
+ * Where the battery's snapshot is in the queue, -1 if it isn't. Call with the
+ * mux held.
+ */
+int8_t TelemetrySink::find(batteryInfo_t *battery)
+{
+  for(uint8_t i = 0; i < count; i++) {
+    if(queue[(head + i) % size].battery == battery) {
+      return (head + i) % size;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Queues a snapshot, called from the BLE task. This never waits on the sink, if
+ * the queue is full the policy decides what gets dropped.
+ */
+void TelemetrySink::offer(const telemetrySnapshot_t *snapshot)
+{
+  int8_t index;
+
+  if(!size) {
+    return;
+  }
+
+  portENTER_CRITICAL(&mux);
+
+  if((policy == SINK_LATEST) && ((index = find(snapshot->battery)) >= 0)) {
+    queue[index] = *snapshot; // keeps its place, only the frame changes
+    dropped++;
+    portEXIT_CRITICAL(&mux);
+    return;
+  }
+
+  if(count == size) {
+    dropped++;
+
+    if(policy == SINK_DROP_NEWEST) {
+      portEXIT_CRITICAL(&mux);
+      return;
+    }
+
+    head = (head + 1) % size;
+    count--;
+  }
+
+  queue[(head + count) % size] = *snapshot;
+  count++;
+
+  portEXIT_CRITICAL(&mux);
+}
+
+bool TelemetrySink::take(telemetrySnapshot_t *snapshot)
+{
+  bool found = false;
+
+  portENTER_CRITICAL(&mux);
+
+  if(count) {
+    *snapshot = queue[head];
+    head = (head + 1) % size;
+    count--;
+    found = true;
+  }
+
+  portEXIT_CRITICAL(&mux);
+
+  return found;
+}
+
+/**
+ * Puts a snapshot that couldn't be written back at the front of the queue. It's
+ * taken off while it's being written (rather than peeked at) so the BLE task can
+ * carry on dropping the oldest without pulling it out from under us. If a newer
+ * snapshot has replaced it in the meantime there's no point keeping it.
+ */
+void TelemetrySink::putBack(const telemetrySnapshot_t *snapshot)
+{
+  portENTER_CRITICAL(&mux);
+
+  if(((policy == SINK_LATEST) && (find(snapshot->battery) >= 0)) ||
+     ((count == size) && (policy != SINK_DROP_NEWEST))) {
+    dropped++;
+    portEXIT_CRITICAL(&mux);
+    return;
+  }
+
+  if(count == size) {
+    count--; // SINK_DROP_NEWEST, the newest makes way for it
+    dropped++;
+  }
+
+  head = (head + size - 1) % size;
+  queue[head] = *snapshot;
+  count++;
+
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Writes up to max queued snapshots, oldest first. Called from the loop task,
+ * stops at the first one that can't be written and returns false.
+ */
+bool TelemetrySink::drain(uint8_t max)
+{
+  telemetrySnapshot_t snapshot;
+
+  for(uint8_t i = 0; i < max; i++) {
+    if(!take(&snapshot)) {
+      return true;
+    }
+
+    if(!write(&snapshot)) {
+      putBack(&snapshot);
+      return false;
+    }
+
+    written++;
+  }
+
+  return true;
+}
+
+TelemetryPipeline *TelemetryPipeline::instance()
+{
+  if(!m_instance) {
+    m_instance = new TelemetryPipeline();
+  }
+
+  return m_instance;
+}
+
+bool TelemetryPipeline::addSink(TelemetrySink *sink)
+{
+  if(totalSinks == TELEMETRY_MAX_SINKS) {
+    Serial.printf("- FAILED: No room for the %s sink\n", sink->getName());
+    return false;
+  }
+
+  sinks[totalSinks++] = sink;
+
+  return true;
+}
+
+uint8_t TelemetryPipeline::getTotalSinks()
+{
+  return totalSinks;
+}
+
+TelemetrySink *TelemetryPipeline::getSink(uint8_t index)
+{
+  return (index < totalSinks) ? sinks[index] : NULL;
+}
+
+/**
+ * Copies what we need out of the battery, it's taken as soon as the frame is
+ * decoded so the cells and bank extremes are the ones from this frame
+ */
+void TelemetryPipeline::snapshot(batteryInfo_t *battery, telemetrySnapshot_t *snapshot)
+{
+  memset(snapshot, 0, sizeof(telemetrySnapshot_t));
+
+  snapshot->battery = battery;
+  snapshot->decodes = battery->metrics.decodes;
+  snapshot->timestamp = millis();
+
+  snapshot->rssi = battery->rssi;
+  snapshot->voltage = battery->voltage;
+  snapshot->current = battery->current;
+  snapshot->ampHrs = battery->ampHrs;
+  snapshot->cycleCount = battery->cycleCount;
+  snapshot->soc = battery->soc;
+  snapshot->temp = battery->temp;
+  snapshot->status = battery->status;
+  snapshot->afeStatus = battery->afeStatus;
+  snapshot->minCell = battery->bank.minCell;
+  snapshot->maxCell = battery->bank.maxCell;
+
+  snapshot->totalCells = (battery->totalCells < MAX_BATTERY_CELLS) ? battery->totalCells : MAX_BATTERY_CELLS;
+
+  if(battery->cells) {
+    memcpy(snapshot->cells, battery->cells, snapshot->totalCells * sizeof(uint16_t));
+  }
+
+  snapshot->alarms = battery->alarms.active;
+  snapshot->alarmsChanged = battery->alarms.changed;
+
+  snapshot->chargeSinceFull = estimatorChargeSinceFull(&battery->estimator);
+  snapshot->seenFull = battery->estimator.seenFull;
+  snapshot->currentAvg = estimatorCurrent(&battery->estimator);
+  snapshot->powerAvg = estimatorPower(&battery->estimator);
+  snapshot->timeToEmpty = battery->estimator.timeToEmpty;
+  snapshot->timeToFull = battery->estimator.timeToFull;
+}
+
+/**
+ * Called from processBuffer() for every decoded frame
+ */
+void TelemetryPipeline::submit(batteryInfo_t *battery, bool restored)
+{
+  telemetrySnapshot_t frame;
+
+  if(!totalSinks) {
+    return;
+  }
+
+  snapshot(battery, &frame);
+  frame.restored = restored;
+
+  for(uint8_t i = 0; i < totalSinks; i++) {
+    sinks[i]->offer(&frame);
+  }
+}
+
+/**
+ * Gives every sink a turn at writing what it has queued. Call this every time
+ * through the main loop.
+ */
+void TelemetryPipeline::loop()
+{
+  for(uint8_t i = 0; i < totalSinks; i++) {
+    sinks[i]->drain(TELEMETRY_DRAIN_BATCH);
+  }
+}
+
+/**
+ * Whether any sink still has snapshots it hasn't written
+ */
+bool TelemetryPipeline::hasPending()
+{
+  for(uint8_t i = 0; i < totalSinks; i++) {
+    if(sinks[i]->getQueued()) {
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,164 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef LIFETELEMETRY_H_
+#define LIFETELEMETRY_H_
+
+#include "Arduino.h"
+#include "BatteryManager.h"
+
+#ifndef TELEMETRY_MAX_SINKS
+#define TELEMETRY_MAX_SINKS 4
+#endif
+
+// Snapshots a sink can have waiting unless it asks for more or less
+#ifndef TELEMETRY_QUEUE_SIZE
+#define TELEMETRY_QUEUE_SIZE 8
+#endif
+
+// Snapshots a sink gets to write each time through the loop, so one busy sink doesn't keep the others waiting
+#ifndef TELEMETRY_DRAIN_BATCH
+#define TELEMETRY_DRAIN_BATCH 4
+#endif
+
+/**
+ * A battery as it was when a frame was decoded. It's copied once and every sink
+ * gets the same copy, so what they send out doesn't depend on when they get
+ * round to it or on the next frame landing part way through.
+ */
+struct telemetrySnapshot_t {
+  batteryInfo_t *battery; // for its address and name, those don't change
+  uint32_t decodes; // battery->metrics.decodes when it was taken
+  uint32_t timestamp; // millis()
+  bool restored; // put back after a deep sleep (see BatteryManager::restoreFrame()), not freshly decoded
+
+  int8_t rssi;
+  uint32_t voltage; // mV
+  int32_t current; // mA
+  uint32_t ampHrs; // mAh
+  uint16_t cycleCount;
+  uint16_t soc; // %
+  uint16_t temp; // tenths of a degree C
+  uint16_t status;
+  uint16_t afeStatus;
+  uint16_t minCell; // mV
+  uint16_t maxCell; // mV
+  uint8_t totalCells;
+  uint16_t cells[MAX_BATTERY_CELLS];
+  uint32_t alarms; // active alarms, a bit per AlarmManager rule
+  uint32_t alarmsChanged; // the ones that raised or cleared on this frame
+
+  int32_t chargeSinceFull; // mAh
+  bool seenFull;
+  int32_t currentAvg; // mA
+  int32_t powerAvg; // mW
+  uint32_t timeToEmpty; // seconds
+  uint32_t timeToFull; // seconds
+};
+
+/**
+ * What a sink does when a snapshot turns up and its queue is full
+ */
+enum sinkPolicy_t {
+  SINK_DROP_OLDEST = 0, // make room by throwing the oldest away
+  SINK_DROP_NEWEST, // throw the new one away
+  SINK_LATEST // only the newest for each battery is kept, if it's still full drop the oldest
+};
+
+/**
+ * Somewhere decoded frames go. Each sink has its own queue, filled from the BLE
+ * task as frames are decoded and emptied from the loop task by write(). A sink
+ * that can't keep up (MQTT with no broker, say) only fills its own queue, what
+ * happens then is down to its policy.
+ */
+class TelemetrySink
+{
+
+public:
+  TelemetrySink(const char *, sinkPolicy_t, uint8_t = TELEMETRY_QUEUE_SIZE);
+  virtual ~TelemetrySink();
+
+  const char *getName();
+  sinkPolicy_t getPolicy();
+  uint8_t getQueued();
+  uint8_t getQueueSize();
+  uint32_t getWritten();
+  uint32_t getDropped();
+
+  void offer(const telemetrySnapshot_t *);
+  bool drain(uint8_t);
+
+protected:
+  // false if the snapshot can't be written right now, it stays queued and is tried again next time
+  virtual bool write(const telemetrySnapshot_t *) = 0;
+
+private:
+  bool take(telemetrySnapshot_t *);
+  void putBack(const telemetrySnapshot_t *);
+  int8_t find(batteryInfo_t *);
+
+  const char *name;
+  sinkPolicy_t policy;
+
+  telemetrySnapshot_t *queue = NULL;
+  uint8_t size = 0;
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+  uint32_t written = 0;
+  uint32_t dropped = 0;
+
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+/**
+ * Takes each decoded frame once and hands it to every sink (MQTT, the HTTP
+ * cache, history...). Decoding only ever copies into the sinks' queues, it never
+ * waits on one of them.
+ */
+class TelemetryPipeline
+{
+
+public:
+  bool addSink(TelemetrySink *);
+  uint8_t getTotalSinks();
+  TelemetrySink *getSink(uint8_t);
+
+  void submit(batteryInfo_t *, bool = false);
+  void loop();
+  bool hasPending();
+
+  static void snapshot(batteryInfo_t *, telemetrySnapshot_t *);
+  static TelemetryPipeline *instance();
+
+private:
+  TelemetryPipeline() {};
+  TelemetryPipeline(TelemetryPipeline const &) {};
+  TelemetryPipeline& operator=(TelemetryPipeline const &) { return *this; };
+
+  TelemetrySink *sinks[TELEMETRY_MAX_SINKS] = {};
+  uint8_t totalSinks = 0;
+
+  static TelemetryPipeline *m_instance;
+};
+
+#endif
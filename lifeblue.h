@@ -25,26 +25,71 @@
 #ifndef LIFEBLUE_H_
 #define LIFEBLUE_H_
 
+#include <BLEDevice.h>
+
 #define CLIENT_DEVICE_NAME "lifeblue-client"
 
+// Upper limit only, storage for each battery is allocated when it's found
+#ifndef MAX_BATTERIES
+#define MAX_BATTERIES 256
+#endif
+
+#ifndef WIFI_CONNECT_ATTEMPTS
+#define WIFI_CONNECT_ATTEMPTS 3
+#endif
+
+//#define CAPTURE_BLE_FRAGMENTS // Uncomment to record raw notification fragments for tools/replay
+//#define TRACK_ALLOCATIONS // Uncomment to count allocations per call site in the gateway metrics
+//#define PERSIST_HISTORY // Uncomment to keep battery history on flash across reboots
+//#define MULTI_GATEWAY // Uncomment to share the bank with other gateways, mqttClientId has to be unique to each
+//#define LOW_POWER // Uncomment to deep sleep between sweeps, the poll interval (SLEEP_INTERVAL by default) is how often we wake
+//#define SERIAL_STREAM // Uncomment to send every decoded frame and alarm transition out of the serial port as binary records, see SerialStream.h
+
+// The binary stream has every frame on it, give it the bandwidth
 #ifndef SERIAL_BAUD
+#ifdef SERIAL_STREAM
+#define SERIAL_BAUD 921600
+#else
 #define SERIAL_BAUD 115200
 #endif
+#endif
 
-#ifndef MAX_BATTERIES
-#define MAX_BATTERIES 10
+#if defined(LOW_POWER) && defined(MULTI_GATEWAY)
+#error "LOW_POWER can't be used with MULTI_GATEWAY, leases need the gateway on the broker all the time"
 #endif
 
-#ifndef CELLS_PER_BATTERY
-#define CELLS_PER_BATTERY 4
+#ifndef HISTORY_PERSIST_INTERVAL
+#define HISTORY_PERSIST_INTERVAL 900000 // ms, keep this long, flash wears out
 #endif
 
-#ifndef WIFI_CONNECT_ATTEMPTS
-#define WIFI_CONNECT_ATTEMPTS 3
+
+// Battery frames that can be waiting to go out over MQTT. In low power mode a whole
+// sweep is decoded before the WiFi comes up, so there has to be room for all of it.
+#ifndef MQTT_SINK_QUEUE_SIZE
+#ifdef LOW_POWER
+#define MQTT_SINK_QUEUE_SIZE SLEEP_MAX_BATTERIES
+#else
+#define MQTT_SINK_QUEUE_SIZE 16
+#endif
 #endif
 
+#ifndef METRICS_PUBLISH_INTERVAL
+#define METRICS_PUBLISH_INTERVAL 60000 // ms
+#endif
 
-#define MQTT_OBJECT_SIZE JSON_ARRAY_SIZE(4) + 2*JSON_OBJECT_SIZE(9)
+#define MQTT_OBJECT_SIZE(cells) JSON_ARRAY_SIZE(cells) + JSON_OBJECT_SIZE(12) + JSON_OBJECT_SIZE(9) + JSON_OBJECT_SIZE(6)
+#define MQTT_METRICS_OBJECT_SIZE JSON_OBJECT_SIZE(13) + JSON_OBJECT_SIZE(POLL_STAGE_COUNT) + \
+                                 POLL_STAGE_COUNT * (JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(METRICS_HISTOGRAM_BOUNDS + 1)) + 32
+#define MQTT_ALARM_OBJECT_SIZE JSON_OBJECT_SIZE(7)
+#define MQTT_COMMAND_OBJECT_SIZE JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(5) + 128
+#define MQTT_ACK_OBJECT_SIZE JSON_OBJECT_SIZE(7)
+#define MQTT_LEASE_OBJECT_SIZE JSON_OBJECT_SIZE(4) + LEASE_GATEWAY_ID_SIZE
+#define MQTT_HISTORY_OBJECT_SIZE JSON_OBJECT_SIZE(5) + HISTORY_CHANNELS * JSON_OBJECT_SIZE(3)
+#define MQTT_BANK_OBJECT_SIZE JSON_OBJECT_SIZE(8) + 2*JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(7)
+#define MQTT_GATEWAY_METRICS_OBJECT_SIZE JSON_OBJECT_SIZE(13) + JSON_ARRAY_SIZE(METRICS_HISTOGRAM_BOUNDS) + \
+                                         JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(2) + \
+                                         JSON_OBJECT_SIZE(ALLOC_SITE_COUNT) + ALLOC_SITE_COUNT * JSON_OBJECT_SIZE(3) + \
+                                         JSON_OBJECT_SIZE(TELEMETRY_MAX_SINKS) + TELEMETRY_MAX_SINKS * JSON_OBJECT_SIZE(3)
 
 // The service UUID of the LiFeBlue battery
 static BLEUUID serviceUUID((uint16_t)0xffe0);
@@ -30,6 +30,21 @@
 #include "lifeblue.h" 
 #include "BatteryManager.h"
 #include "DisplayManager.h"
+#include "FrameCapture.h"
+#include "HeapMonitor.h"
+#include "AlarmManager.h"
+#include "HistoryStore.h"
+#include "MetricsServer.h"
+#include "CommandManager.h"
+#include "LeaseManager.h"
+#include "SleepManager.h"
+#include "TelemetryPipeline.h"
+#include "ScanManager.h"
+#include "SerialStream.h"
+
+#if defined(CAPTURE_BLE_FRAGMENTS) || defined(PERSIST_HISTORY)
+#include <SPIFFS.h>
+#endif
 
 #include "hex_dump.h"
 
@@ -38,7 +53,7 @@
 
 BatteryManager *batteryManager;
 BLEScan *bleScanner;
-bool scanning = false;
+volatile bool scanning = false; // cleared by scanDone(), under scanTimerMux
 DisplayManager *displayManager;
 PubSubClient *mqttClient = NULL;
 WiFiClient *wifiClient = NULL;
@@ -50,36 +65,66 @@ portMUX_TYPE scanTimerMux = portMUX_INITIALIZER_UNLOCKED;
 volatile bool scanTimerTick = false;
 uint8_t scanTotalInterrupts;
 
+uint32_t lastMetricsPublish = 0;
+uint32_t lastHistorySave = 0;
+uint32_t lastBankPublish = 0; // bank.updated as of the last bank publish
+
+bool woken = false; // back from a deep sleep (LOW_POWER), the batteries are already known
+
+bool mqttOutage = true; // we start out disconnected
+uint32_t mqttOutageStarted = 0; // on the history clock
+
 /**
- * Called after a BLE scan is complete where we look through the results
- * and pull any batteries we find out. We add them to the Battery Manager
- * as devices, which it then uses to connect to one at a time and get the
- * data from.
+ * Called once a scan has stopped, whether it ran its full time (from the BT
+ * task, see onBLEScanComplete()) or we stopped it early from loop(). Both can
+ * happen at once, only the first call for a scan does anything.
  */
-void onBLEScanComplete(BLEScanResults results)
+void scanDone()
 {
-   //batteryManager->reset();
-      
-   for(int i = 0; i < results.getCount(); i++) {
-     
-      if(!results.getDevice(i).haveServiceUUID()) {
-       continue;
-      }
+  bool wasScanning;
 
-      if(!results.getDevice(i).isAdvertisingService(serviceUUID)) {
-       continue;
-      }
+  portENTER_CRITICAL(&scanTimerMux);
+  wasScanning = scanning;
+  scanning = false;
+  portEXIT_CRITICAL(&scanTimerMux);
 
-      batteryManager->addBattery(new BLEAdvertisedDevice(results.getDevice(i)));
-            
-   }
-   
+  if(!wasScanning) {
+    return;
+  }
+
+  timerAlarmDisable(scanTimer);
+
+  ScanManager::instance()->finished();
+  CommandManager::instance()->scanComplete();
+
+  bleScanner->clearResults(); // the batteries were picked out as they were heard, see ScanCallbacks
+}
+
+/**
+ * Called after a BLE scan has run its full time. The batteries in the results
+ * have already been added as they were advertised, all that's left is to tidy up.
+ */
+void onBLEScanComplete(BLEScanResults results)
+{
    Serial.println("- Scan Complete");
-   scanning = false;
-   delete bleScanner;
-   
+   scanDone();
 }
 
+/**
+ * Hands each advertisement to the ScanManager as it's heard, so batteries are
+ * added straight away and the scan can stop as soon as they've all turned up
+ */
+class ScanCallbacks : public BLEAdvertisedDeviceCallbacks
+{
+public:
+  void onResult(BLEAdvertisedDevice device)
+  {
+    ScanManager::instance()->advertised(&device);
+  }
+};
+
+ScanCallbacks scanCallbacks;
+
 void IRAM_ATTR onScanTimer()
 {
   portENTER_CRITICAL_ISR(&scanTimerMux);
@@ -87,18 +132,23 @@ void IRAM_ATTR onScanTimer()
   portEXIT_CRITICAL_ISR(&scanTimerMux);
 }
 /**
- * Simple helper function to configure a BLE scan to start
+ * Simple helper function to configure a BLE scan to start. A discovery scan
+ * listens flat out, a refresh leaves the radio free for the WiFi part of the time.
  */
-void startDeviceScan() 
+void startDeviceScan(scanMode_t mode) 
 {
+  ScanManager *scanManager = ScanManager::instance();
+
   Serial.println("- Starting BLE Device Scan...");
   
   scanning = true;
+  scanManager->begin(mode);
   
   bleScanner = BLEDevice::getScan();
 
-  bleScanner->setInterval(1349);
-  bleScanner->setWindow(449);
+  bleScanner->setAdvertisedDeviceCallbacks(&scanCallbacks);
+  bleScanner->setInterval(scanManager->getInterval());
+  bleScanner->setWindow(scanManager->getWindow());
   bleScanner->setActiveScan(true);
 
   scanTimerTick = false;
@@ -107,7 +157,7 @@ void startDeviceScan()
   timerAlarmEnable(scanTimer);
   displayManager->scanningScreen(0);
   
-  bleScanner->start(10, onBLEScanComplete, false);
+  bleScanner->start(scanManager->getDuration(), onBLEScanComplete, false);
   
 }
 
@@ -134,6 +184,7 @@ void connectMqtt()
       delay(2000);
     } else {
       Serial.printf("- Connected to %s\n", mqttServer);
+      subscribeCommands();
       return;
     }
   }
@@ -167,6 +218,172 @@ void connectWiFi()
   }
 }
 
+#ifdef CAPTURE_BLE_FRAGMENTS
+/**
+ * When capturing, single character commands on the serial port control the
+ * capture ring:
+ *
+ * d - dump the capture to serial
+ * f - write the capture to flash (CAPTURE_FILE_PATH)
+ * p - print the capture previously written to flash
+ * c - clear the capture
+ */
+void handleCaptureCommands()
+{
+  File file;
+  
+  while(Serial.available() > 0) {
+    switch(Serial.read()) {
+      case 'd':
+        FrameCapture::instance()->dump(Serial);
+        break;
+      case 'f':
+        FrameCapture::instance()->dumpToFile(SPIFFS, CAPTURE_FILE_PATH);
+        break;
+      case 'p':
+        file = SPIFFS.open(CAPTURE_FILE_PATH, FILE_READ);
+        
+        if(!file) {
+          Serial.println("- No capture stored on flash");
+          break;
+        }
+        
+        while(file.available()) {
+          Serial.write(file.read());
+        }
+        
+        file.close();
+        break;
+      case 'c':
+        FrameCapture::instance()->clear();
+        Serial.println("- Capture cleared");
+        break;
+    }
+  }
+}
+#endif
+
+/**
+ * Serves /metrics and /json on the local network. Runs in its own task so a
+ * slow scrape never holds up polling or MQTT.
+ */
+void metricsServerTask(void *)
+{
+  while(WiFi.status() != WL_CONNECTED) {
+    delay(1000);
+  }
+
+  MetricsServer::instance()->begin(METRICS_HTTP_PORT);
+
+  Serial.printf("- Serving metrics on http://%s:%d/metrics\n", WiFi.localIP().toString().c_str(), METRICS_HTTP_PORT);
+
+  for(;;) {
+    MetricsServer::instance()->loop();
+    delay(10);
+  }
+}
+
+/**
+ * Publishes each battery's frames to <mqttTopic> as JSON, as long as they've moved
+ * past the deadbands. Only a battery's latest frame matters, so while MQTT is down
+ * they replace each other in the queue rather than piling up.
+ */
+class MqttSink : public TelemetrySink
+{
+
+public:
+  MqttSink() : TelemetrySink("mqtt", SINK_LATEST, MQTT_SINK_QUEUE_SIZE) {};
+
+protected:
+  bool write(const telemetrySnapshot_t *);
+};
+
+MqttSink *mqttSink = NULL;
+
+bool MqttSink::write(const telemetrySnapshot_t *snapshot)
+{
+  batteryInfo_t *battery = snapshot->battery;
+  char buffer[1024] = {NULL};
+  DynamicJsonDocument doc(MQTT_OBJECT_SIZE(snapshot->totalCells));
+  JsonArray cells;
+  JsonObject status;
+  JsonObject estimates;
+  char *topicBuffer;
+  bool published;
+
+  if(!mqttClient->connected()) {
+    return false; // it'll go out once we're back
+  }
+
+  if(!batteryManager->needsPublish(snapshot)) {
+    return true;
+  }
+
+#ifdef DUMP_HEX_BATTERY_BUFFER
+  hex_dump((char *)snapshot, sizeof(telemetrySnapshot_t), "MQTT -- telemetrySnapshot_t");
+#endif
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_OBJECT_SIZE(snapshot->totalCells));
+
+  // mqttTopic includes '%s' so we count that, and the address it 17 chars (+ null) 
+  topicBuffer = (char *)os_zalloc(strlen(mqttTopic) - 2 + 17 + 1);
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_TOPIC, strlen(mqttTopic) - 2 + 17 + 1);
+  
+  sprintf(topicBuffer, mqttTopic, (char *)battery->id);
+  
+  Serial.printf("- Publishing %s [%s] (RSSI %d) to %s\n", (char *)battery->bname, (char *)battery->id, snapshot->rssi, topicBuffer);
+
+  cells = doc.createNestedArray("cells");
+  status = doc.createNestedObject("status");
+
+  doc["battery_name"] = (char *)battery->bname;
+  doc["RSSI"] = snapshot->rssi;
+  doc["battery_id"] = (char *)battery->id;
+  doc["voltage"] = snapshot->voltage;
+  doc["current"] = snapshot->current;
+  doc["soc"] = snapshot->soc;
+  doc["temp"] = snapshot->temp;
+  doc["cycles"] = snapshot->cycleCount;
+  doc["ampHrs"] = snapshot->ampHrs;
+
+  for(int i = 0; i < snapshot->totalCells; i++) {
+    cells.add(snapshot->cells[i]);
+  }
+  
+  status["cell_high_voltage"] = (bool)(snapshot->status & LIFE_CELL_HIGH_VOLTAGE);
+  status["cell_low_voltage"] = (bool)(snapshot->status & LIFE_CELL_LOW_VOLTAGE);
+  status["over_current_when_charge"] = (bool)(snapshot->status & LIFE_OVER_CURRENT_WHEN_CHARGE);
+  status["over_current_when_discharge"] = (bool)(snapshot->status & LIFE_OVER_CURRENT_WHEN_DISCHARGE);
+  status["low_temp_when_charge"] = (bool)(snapshot->status & LIFE_LOW_TEMP_WHEN_CHARGE);
+  status["low_temp_when_discharge"] = (bool)(snapshot->status & LIFE_LOW_TEMP_WHEN_DISCHARGE);
+  status["high_temp_when_charge"] = (bool)(snapshot->status & LIFE_HIGH_TEMP_WHEN_CHARGE);
+  status["high_temp_when_discharge"] = (bool)(snapshot->status & LIFE_HIGH_TEMP_WHEN_DISCHARGE);
+  status["short_circuited"] = (bool)(snapshot->afeStatus & LIFE_SHORT_CIRCUITED);
+
+  estimates = doc.createNestedObject("estimates");
+  estimates["charge_since_full"] = snapshot->chargeSinceFull;
+  estimates["since_full"] = snapshot->seenFull;
+  estimates["current_avg"] = snapshot->currentAvg;
+  estimates["power_avg"] = snapshot->powerAvg;
+  estimates["time_to_empty"] = snapshot->timeToEmpty;
+  estimates["time_to_full"] = snapshot->timeToFull;
+
+  serializeJson(doc, buffer);  
+
+  if(!(published = mqttClient->publish(topicBuffer, buffer))) {
+    Serial.printf("- FAILED: Could not publish to MQTT\n");
+    battery->metrics.publishFailures++;
+  } else {
+    batteryManager->markPublished(snapshot);
+  }
+  
+  free(topicBuffer);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+
+  return published;
+}
+
 /**
  * Initialize the program and start scanning for our batteries!
  */
@@ -185,10 +402,41 @@ void setup() {
 
   Serial.println("- Initializing Battery Manager");
   
-  batteryManager = BatteryManager::instance(MAX_BATTERIES, CELLS_PER_BATTERY);
+  batteryManager = BatteryManager::instance(MAX_BATTERIES);
 
   Serial.println("- Battery Manager Initialized");
 
+  // Before anything can be decoded (or restored after a sleep)
+  mqttSink = new MqttSink();
+  TelemetryPipeline::instance()->addSink(mqttSink);
+  TelemetryPipeline::instance()->addSink(new HistorySink());
+
+#ifdef SERIAL_STREAM
+  TelemetryPipeline::instance()->addSink(new SerialSink(Serial));
+#endif
+
+#ifndef LOW_POWER
+  TelemetryPipeline::instance()->addSink(new MetricsSink());
+#endif
+
+#ifdef LOW_POWER
+  woken = SleepManager::instance()->restore();
+#endif
+
+#if defined(CAPTURE_BLE_FRAGMENTS) || defined(PERSIST_HISTORY)
+  if(!SPIFFS.begin(true)) {
+    Serial.println("- FAILED: Could not mount SPIFFS, captures can only be dumped to serial and history won't persist");
+  }
+#endif
+
+#ifdef CAPTURE_BLE_FRAGMENTS
+  FrameCapture::instance();
+#endif
+
+#ifdef PERSIST_HISTORY
+  HistoryStore::instance()->load(SPIFFS, HISTORY_FILE_PATH);
+#endif
+
   scanTimer = timerBegin(0, 80, true);
   timerAttachInterrupt(scanTimer, &onScanTimer, true);
   timerAlarmWrite(scanTimer, 1000000, true);
@@ -202,7 +450,7 @@ void setup() {
   Serial.println("- Initializing Display");
   
   displayManager = DisplayManager::instance();
-  displayManager->setup();
+  displayManager->setup(!woken);
   
   Serial.println("- Initialized Display");
 
@@ -211,88 +459,690 @@ void setup() {
   wifiClient = new WiFiClient();
   mqttClient = new PubSubClient(*wifiClient);
   mqttClient->setServer(mqttServer, 1883);
-  mqttClient->setBufferSize(512);
+  mqttClient->setBufferSize(2048);
+  mqttClient->setCallback(onMqttMessage);
   
   Serial.println("- Initialized WiFI and MQTT");
-    
-  startDeviceScan();
+
+#ifdef MULTI_GATEWAY
+  LeaseManager::instance()->begin(mqttClientId);
+#endif
+
+#ifndef LOW_POWER
+  xTaskCreate(metricsServerTask, "metrics", 6144, NULL, 1, NULL); // nobody's going to scrape a gateway that's asleep
+#endif
+
+#ifdef LOW_POWER
+  if(SleepManager::instance()->needsScan()) {
+    startDeviceScan(SCAN_DISCOVERY);
+  }
+#else
+  startDeviceScan(SCAN_DISCOVERY);
+#endif
 
   randomSeed(micros());
 }
 
-void publishToMqtt(batteryInfo_t *battery)
+/**
+ * Builds the topic for one of our sub-topics by filling in mqttTopic with the
+ * given id and tacking the suffix on the end, i.e. ("gateway", "/metrics") gives
+ * /rv/sensors/batteries/gateway/metrics. The result needs to be free()'d
+ */
+char *buildTopic(const char *id, const char *suffix)
 {
-  char buffer[1024] = {NULL};
-  uint8_t cellsPerBattery;
-  DynamicJsonDocument doc(MQTT_OBJECT_SIZE);
-  JsonArray cells;
-  JsonObject status;
-  size_t outputSize;
-  char *topicBuffer;
-    
-  Serial.printf("\n\n ============ MQTT Publish Battery ========== \nIs battery buffer valid: %s\n", battery->is_valid ? "Yes" : "No");
+  char *topic = (char *)os_zalloc(strlen(mqttTopic) - 2 + strlen(id) + strlen(suffix) + 1);
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_TOPIC, strlen(mqttTopic) - 2 + strlen(id) + strlen(suffix) + 1);
 
-  if (battery->is_valid) {
-#ifdef DUMP_HEX_BATTERY_BUFFER
-    hex_dump((char *)battery->buffer, 512, "MQTT -- batteryInfo_t");
-#endif
-    Serial.println("Valid Battery buffer == processing MQTT publish");
+  sprintf(topic, mqttTopic, id);
+  strcat(topic, suffix);
 
-  // mqttTopic includes '%s' so we count that, and the address it 17 chars (+ null) 
-  topicBuffer = (char *)os_zalloc(strlen(mqttTopic) - 2 + 17 + 1);
+  return topic;
+}
+
+/**
+ * Serializes the document and publishes it to the topic, returns false if
+ * the publish failed
+ */
+bool publishJson(const char *topic, JsonDocument &doc)
+{
+  return publishJson(topic, doc, false);
+}
+
+bool publishJson(const char *topic, JsonDocument &doc, bool retained)
+{
+  size_t outputSize = measureJson(doc) + 1;
+  char *buffer = (char *)os_zalloc(outputSize);
+  bool result;
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_BUFFER, outputSize);
+
+  serializeJson(doc, buffer, outputSize);
+
+  result = mqttClient->publish(topic, buffer, retained);
   
-  sprintf(topicBuffer, mqttTopic, (char *)battery->id);
+  if(!result) {
+    Serial.printf("- FAILED: Could not publish to '%s'\n", topic);
+  }
   
-  Serial.println("MQTT Publish printing battery info:");
-  Serial.printf("==== %s RSSI value: %d ====\n", (char *)battery->bname, battery->device->getRSSI());
-  Serial.printf("- Publishing %s [%s] to %s\n", (char *)battery->bname, (char *)battery->id, topicBuffer);
-
+  free(buffer);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_BUFFER);
   
-  cellsPerBattery = batteryManager->getTotalCells();
+  return result;
+}
 
-  cells = doc.createNestedArray("cells");
-  status = doc.createNestedObject("status");
+/**
+ * Commands come in on <mqttTopic>/gateway/command as JSON, i.e.
+ *
+ * {"id": "1", "command": "poll", "battery": "c8:fd:19:00:00:01"}
+ * {"id": "2", "command": "set", "poll_interval": 30000, "deadband": {"voltage": 20, "current": 100, "soc": 1, "temp": 5, "max_age": 60000}}
+ * {"id": "3", "command": "rescan"}
+ *
+ * Anything left out of a set stays as it is. Every command is acknowledged on
+ * <mqttTopic>/gateway/command/ack with the id it was sent with.
+ */
+void subscribeCommands()
+{
+  char *topic = buildTopic("gateway", "/command");
 
-  doc["battery_name"] = (char *)battery->bname;
-  doc["RSSI"] = battery->device->getRSSI();
-  doc["battery_id"] = (char *)battery->id;
-  doc["voltage"] = battery->voltage;
-  doc["current"] = battery->current;
-  doc["soc"] = battery->soc;
-  doc["temp"] = battery->temp;
-  doc["cycles"] = battery->cycleCount;
-  doc["ampHrs"] = battery->ampHrs;
+  if(!mqttClient->subscribe(topic)) {
+    Serial.printf("- FAILED: Could not subscribe to '%s'\n", topic);
+  }
+
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
 
-  for(int i = 0; i < cellsPerBattery; i++) {
-    cells.add(battery->cells[i]);
+  if(LeaseManager::instance()->isEnabled()) {
+    topic = buildTopic("+", "/lease");
+
+    if(!mqttClient->subscribe(topic)) {
+      Serial.printf("- FAILED: Could not subscribe to '%s'\n", topic);
+    }
+
+    free(topic);
+    TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  }
+}
+
+void onMqttMessage(char *topic, byte *payload, unsigned int length)
+{
+  CommandManager *commandManager = CommandManager::instance();
+  DynamicJsonDocument doc(MQTT_COMMAND_OBJECT_SIZE);
+  publishDeadbands_t deadbands;
+  JsonObject deadband;
+  const char *id;
+
+  if(isLeaseTopic(topic)) {
+    onLeaseMessage(topic, payload, length);
+    return;
+  }
+
+  if(deserializeJson(doc, (const byte *)payload, length)) {
+    commandManager->reject(NULL, "invalid JSON");
+    return;
   }
-  
-  status["cell_high_voltage"] = battery->cell_high_voltage;
-  status["cell_low_voltage"] = battery->cell_low_voltage;
-  status["over_current_when_charge"] = battery->over_current_when_charge;
-  status["over_current_when_discharge"] = battery->over_current_when_discharge;
-  status["low_temp_when_charge"] = battery->low_temp_when_charge;
-  status["low_temp_when_discharge"] = battery->low_temp_when_discharge;
-  status["high_temp_when_charge"] = battery->high_temp_when_charge;
-  status["high_temp_when_discharge"] = battery->high_temp_when_discharge;
-  status["short_circuited"] = battery->short_circuited;
 
-  outputSize = serializeJson(doc, buffer);  
+  id = doc["id"] | "";
+
+  switch(CommandManager::commandType(doc["command"])) {
+    case COMMAND_POLL:
+      commandManager->poll(id, doc["battery"]);
+      break;
+    case COMMAND_SET:
+      deadbands = *batteryManager->getDeadbands();
+      deadband = doc["deadband"];
+
+      deadbands.voltage = deadband["voltage"] | deadbands.voltage;
+      deadbands.current = deadband["current"] | deadbands.current;
+      deadbands.soc = deadband["soc"] | deadbands.soc;
+      deadbands.temp = deadband["temp"] | deadbands.temp;
+      deadbands.maxAge = deadband["max_age"] | deadbands.maxAge;
+
+      commandManager->set(id, doc["poll_interval"] | batteryManager->getPollInterval(), &deadbands);
+      break;
+    case COMMAND_RESCAN:
+      commandManager->rescan(id);
+      break;
+    default:
+      commandManager->reject(id, "unknown command");
+      break;
+  }
+}
+
+bool isLeaseTopic(const char *topic)
+{
+  size_t length = strlen(topic);
+
+  return (length > 6) && !strcmp(topic + length - 6, "/lease");
+}
+
+/**
+ * Lease announcements from every gateway sharing the bank (us included) come in
+ * on <mqttTopic with the battery's address>/lease, i.e.
+ *
+ * {"gateway": "lifeblue-mon-2", "rssi": -71, "hold": true, "sent": 123456}
+ *
+ * See LeaseManager for what's done with them.
+ */
+void onLeaseMessage(const char *topic, byte *payload, unsigned int length)
+{
+  DynamicJsonDocument doc(MQTT_LEASE_OBJECT_SIZE);
+  size_t prefixLength = strstr(mqttTopic, "%s") - mqttTopic;
+  char address[18] = {NULL};
+  batteryInfo_t *battery;
+
+  if(strlen(topic) < (prefixLength + 17)) {
+    return;
+  }
+
+  strncpy(address, topic + prefixLength, 17);
+
+  if(!(battery = batteryManager->findBattery(BLEAddress(std::string(address))))) {
+    return; // one we didn't find in our scan
+  }
+
+  if(deserializeJson(doc, (const byte *)payload, length) || !doc["gateway"].is<const char *>()) {
+    Serial.printf("- FAILED: Bad lease announcement on '%s'\n", topic);
+    return;
+  }
+
+  LeaseManager::instance()->received(battery, doc["gateway"], doc["rssi"] | -127, doc["hold"] | false, doc["sent"] | 0);
+}
+
+/**
+ * Publishes every queued lease announcement, oldest first, to the battery's
+ * /lease topic. Never retained, a lease is only as good as its last renewal.
+ */
+void publishLeases()
+{
+  LeaseManager *leaseManager = LeaseManager::instance();
+  DynamicJsonDocument doc(MQTT_LEASE_OBJECT_SIZE);
+  leaseMessage_t message;
+  bool published;
+  char *topic;
 
   if(!mqttClient->connected()) {
-    Serial.printf("- MQTT Client not connected");
+    return;
   }
-  
-  if(!mqttClient->publish(topicBuffer, buffer)) {
-    Serial.printf("- FAILED: Could not publish to MQTT\n");
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_LEASE_OBJECT_SIZE);
+
+  while(leaseManager->peek(&message)) {
+    doc.clear();
+
+    doc["gateway"] = leaseManager->getGatewayId();
+    doc["rssi"] = message.rssi;
+    doc["hold"] = message.hold;
+    doc["sent"] = message.sent;
+
+    topic = buildTopic(message.battery->address, "/lease");
+    published = publishJson(topic, doc);
+
+    free(topic);
+    TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+
+    if(!published) {
+      break;
+    }
+
+    leaseManager->shift();
+  }
+
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+}
+
+/**
+ * Publishes every queued command acknowledgement, oldest first. latency_ms is
+ * how long the command took from arriving to being done, for a poll that's
+ * until the battery's fresh frame was decoded.
+ */
+void publishAcks()
+{
+  CommandManager *commandManager = CommandManager::instance();
+  DynamicJsonDocument doc(MQTT_ACK_OBJECT_SIZE);
+  command_t command;
+  char *topic;
+
+  if(!mqttClient->connected()) {
+    return;
+  }
+
+  topic = buildTopic("gateway", "/command/ack");
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_ACK_OBJECT_SIZE);
+
+  while(commandManager->peekAck(&command)) {
+    doc.clear();
+
+    doc["id"] = (const char *)command.id;
+    doc["command"] = CommandManager::commandTypeName(command.type);
+    doc["status"] = CommandManager::commandStatusName(command.status);
+    doc["latency_ms"] = command.completed - command.received;
+
+    if(command.battery) {
+      doc["battery_id"] = (const char *)command.battery->id;
+    }
+
+    if(command.error) {
+      doc["error"] = command.error;
+    }
+
+    if(!publishJson(topic, doc)) {
+      break;
+    }
+
+    commandManager->shiftAck();
+  }
+
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+}
+
+/**
+ * Publishes one alarm's state to <mqttTopic>/alarms/<rule name>, retained so anyone
+ * subscribing later still sees which alarms are active. detected is the millis()
+ * when the transition was picked up, latency_ms is how long it then took us to
+ * get it out.
+ */
+bool publishAlarm(batteryInfo_t *battery, uint8_t rule, bool active, int32_t value, uint32_t detected)
+{
+  DynamicJsonDocument doc(MQTT_ALARM_OBJECT_SIZE);
+  const char *name = AlarmManager::instance()->getRule(rule)->name;
+  char suffix[48];
+  char *topic;
+  bool result;
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_ALARM_OBJECT_SIZE);
+
+  doc["battery_name"] = (const char *)battery->bname;
+  doc["battery_id"] = (const char *)battery->id;
+  doc["alarm"] = name;
+  doc["active"] = active;
+  doc["value"] = value;
+  doc["detected_ms"] = detected;
+  doc["latency_ms"] = millis() - detected;
+
+  snprintf(suffix, sizeof(suffix), "/alarms/%s", name);
+
+  topic = buildTopic(battery->id, suffix);
+  result = publishJson(topic, doc, true);
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+
+  return result;
+}
+
+/**
+ * Publishes every queued alarm transition, oldest first. A transition only comes
+ * off the queue once it's been published so nothing is lost if MQTT is down. If
+ * the queue overflowed we can't trust the order of what's left, so it's thrown
+ * away and the current state of every alarm is published instead.
+ */
+void publishAlarms()
+{
+  AlarmManager *alarmManager = AlarmManager::instance();
+  alarmEvent_t event;
+  batteryInfo_t *battery;
+
+  if(!mqttClient->connected()) {
+    return;
   }
+
+  if(alarmManager->needsResync()) {
+    Serial.println("- Alarm queue overflowed, publishing the state of every alarm");
+
+    alarmManager->clearResync();
+
+    while(alarmManager->peek(&event)) {
+      alarmManager->shift();
+    }
+
+    for(int i = 0; i < batteryManager->getTotalBatteries(); i++) {
+      battery = batteryManager->getBattery(i);
+
+      if(!battery->id[0]) {
+        continue; // never decoded, so no alarms either
+      }
+
+      for(uint8_t j = 0; j < alarmManager->getTotalRules(); j++) {
+        publishAlarm(battery, j, battery->alarms.active & (1UL << j),
+                     alarmManager->getRuleValue(alarmManager->getRule(j), battery), millis());
+      }
+    }
+  }
+
+  while(alarmManager->peek(&event)) {
+    if(!publishAlarm(event.battery, event.rule, event.active, event.value, event.timestamp)) {
+      break;
+    }
+
+    alarmManager->shift();
+  }
+}
+
+struct historyBackfill_t {
+  historyRollup_t rollups[HISTORY_MINUTE_ROLLUPS + 1];
+  uint8_t total;
+};
+
+bool collectHistoryRollup(const historyRollup_t *rollup, void *data)
+{
+  historyBackfill_t *backfill = (historyBackfill_t *)data;
+
+  backfill->rollups[backfill->total++] = *rollup;
+
+  return backfill->total < (HISTORY_MINUTE_ROLLUPS + 1);
+}
+
+/**
+ * Publishes the battery's one minute rollups from the history clock time since
+ * onwards to <mqttTopic>/history, one message per minute. This is how we fill in
+ * the gap after MQTT has been down. age_s is how many seconds ago the minute
+ * started, since the history clock doesn't mean anything outside the gateway.
+ *
+ * The rollups are copied out first so the history isn't locked while we publish.
+ */
+void publishHistory(batteryInfo_t *battery, uint32_t since)
+{
+  HistoryStore *historyStore = HistoryStore::instance();
+  historyBackfill_t *backfill = (historyBackfill_t *)os_zalloc(sizeof(historyBackfill_t));
+  DynamicJsonDocument doc(MQTT_HISTORY_OBJECT_SIZE);
+  historyRollup_t *rollup;
+  JsonObject channel;
+  uint32_t now = historyStore->now();
+  char *topic;
+
+  if(!backfill) {
+    return;
+  }
+
+  historyStore->queryRollups(BLEAddress(battery->bdAddress), HISTORY_MINUTE, since, now, collectHistoryRollup, backfill);
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_HISTORY_OBJECT_SIZE);
+
+  topic = buildTopic(battery->id, "/history");
+
+  for(int i = 0; i < backfill->total; i++) {
+    rollup = &backfill->rollups[i];
+
+    doc.clear();
+    doc["battery_id"] = (const char *)battery->id;
+    doc["age_s"] = now - rollup->start;
+    doc["period_s"] = 60;
+    doc["samples"] = rollup->count;
+
+    for(int j = 0; j < HISTORY_CHANNELS; j++) {
+      channel = doc.createNestedObject(historyChannelName((historyChannel_t)j));
+      channel["min"] = rollup->min[j];
+      channel["max"] = rollup->max[j];
+      channel["avg"] = rollup->sum[j] / rollup->count;
+    }
+
+    if(!publishJson(topic, doc)) {
+      break;
+    }
+  }
+
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+
+  free(backfill);
+}
+
+/**
+ * Publishes the bank aggregates (totals and extremes across every battery) to
+ * mqttTopic with "bank" as the id, only when a frame has changed them since the
+ * last time.
+ */
+void publishBank()
+{
+  DynamicJsonDocument doc(MQTT_BANK_OBJECT_SIZE);
+  bankAggregates_t bank = batteryManager->getBankAggregates();
+  JsonObject voltage;
+  JsonObject current;
+  JsonObject cells;
+  char *topic;
+
+  if((bank.batteries == 0) || (bank.updated == lastBankPublish)) {
+    return;
+  }
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_BANK_OBJECT_SIZE);
+
+  doc["batteries"] = bank.batteries;
+  doc["current"] = bank.totalCurrent;
+  doc["soc"] = BatteryManager::getBankSoc(&bank);
+  doc["remaining"] = bank.totalRemaining;
+  doc["capacity"] = bank.totalCapacity;
+
+  // An extreme without a battery hasn't been set, so there's nobody to name
+  voltage = doc.createNestedObject("voltage");
+  voltage["min"] = bank.minVoltage.value;
+  if(bank.minVoltage.battery) {
+    voltage["min_battery"] = (const char *)bank.minVoltage.battery->id;
+  }
+  voltage["max"] = bank.maxVoltage.value;
+  if(bank.maxVoltage.battery) {
+    voltage["max_battery"] = (const char *)bank.maxVoltage.battery->id;
+  }
+  voltage["spread"] = bank.maxVoltage.value - bank.minVoltage.value;
+
+  current = doc.createNestedObject("current_sharing");
+  current["min"] = bank.minCurrent.value;
+  if(bank.minCurrent.battery) {
+    current["min_battery"] = (const char *)bank.minCurrent.battery->id;
+  }
+  current["max"] = bank.maxCurrent.value;
+  if(bank.maxCurrent.battery) {
+    current["max_battery"] = (const char *)bank.maxCurrent.battery->id;
+  }
+  current["spread"] = bank.maxCurrent.value - bank.minCurrent.value;
+
+  // Batteries that haven't sent any cells yet still count towards everything else
+  if(bank.cellBatteries) {
+    cells = doc.createNestedObject("cells");
+    cells["min"] = bank.minCell.value;
+    if(bank.minCell.battery) {
+      cells["min_battery"] = (const char *)bank.minCell.battery->id;
+      cells["min_cell"] = bank.minCell.cell + 1;
+    }
+    cells["max"] = bank.maxCell.value;
+    if(bank.maxCell.battery) {
+      cells["max_battery"] = (const char *)bank.maxCell.battery->id;
+      cells["max_cell"] = bank.maxCell.cell + 1;
+    }
+    cells["delta"] = bank.maxCell.value - bank.minCell.value;
+  }
+
+  topic = buildTopic("bank", "");
+
+  if(publishJson(topic, doc)) {
+    lastBankPublish = bank.updated;
+  }
+
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+}
+
+/**
+ * Publishes the poll metrics (see PollMetrics.h) for a single battery to
+ * <mqttTopic>/metrics. All counters and histograms are cumulative since boot,
+ * the histogram bucket bounds are published with the gateway metrics.
+ */
+void publishBatteryMetrics(batteryInfo_t *battery)
+{
+  DynamicJsonDocument doc(MQTT_METRICS_OBJECT_SIZE);
+  JsonObject stages;
+  JsonObject stage;
+  JsonArray buckets;
+  histogram_t *histogram;
+  char *topic;
+
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_METRICS_OBJECT_SIZE);
+
+  doc["battery_id"] = (const char *)battery->address;
+  doc["polls"] = battery->metrics.polls;
+  doc["decodes"] = battery->metrics.decodes;
+  doc["connect_failures"] = battery->metrics.connectFailures;
+  doc["discovery_failures"] = battery->metrics.discoveryFailures;
+  doc["checksum_rejects"] = battery->metrics.checksumRejects;
+  doc["resyncs"] = battery->metrics.resyncs;
+  doc["timeouts"] = battery->metrics.timeouts;
+  doc["requeues"] = battery->metrics.requeues;
+  doc["publish_failures"] = battery->metrics.publishFailures;
+  doc["mtu"] = battery->link.mtu;
+  doc["interval_us"] = battery->link.interval * 1250;
+
+  stages = doc.createNestedObject("stages");
+
+  for(int i = 0; i < POLL_STAGE_COUNT; i++) {
+    histogram = &battery->metrics.stages[i];
+
+    stage = stages.createNestedObject(pollStageName((pollStage_t)i));
+    stage["count"] = histogram->count;
+    stage["sum_us"] = histogram->sum;
+    stage["max_us"] = histogram->max;
+
+    buckets = stage.createNestedArray("buckets");
+
+    for(int j = 0; j <= METRICS_HISTOGRAM_BOUNDS; j++) {
+      buckets.add(histogram->buckets[j]);
+    }
+  }
+
+  topic = buildTopic(battery->address, "/metrics");
+  publishJson(topic, doc);
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+}
+
+/**
+ * Publishes gateway wide metrics to <mqttTopic with "gateway">/metrics and then
+ * the metrics for every battery.
+ */
+void publishMetrics()
+{
+  DynamicJsonDocument doc(MQTT_GATEWAY_METRICS_OBJECT_SIZE);
+  JsonArray bounds;
+  JsonObject heap;
+  JsonObject stack;
+  JsonObject allocations;
+  JsonObject site;
+  JsonObject sinks;
+  JsonObject sink;
+  TelemetryPipeline *pipeline = TelemetryPipeline::instance();
+  heapStats_t heapStats = HeapMonitor::instance()->getStats();
+  allocCounter_t counter;
+  char *topic;
+
+  Serial.println("- Publishing metrics");
   
-  free(topicBuffer);
+  TRACK_ALLOC(ALLOC_SITE_PUBLISH_JSON, MQTT_GATEWAY_METRICS_OBJECT_SIZE);
+
+  doc["uptime_ms"] = millis();
+  doc["batteries"] = batteryManager->getTotalBatteries();
+  doc["sweeps"] = batteryManager->getTotalSweeps();
+  doc["last_sweep_ms"] = batteryManager->getLastSweepDuration();
+  doc["scans"] = ScanManager::instance()->getTotalScans();
+  doc["last_scan_ms"] = ScanManager::instance()->getLastScanDuration();
+
+#ifdef LOW_POWER
+  doc["sleeps"] = SleepManager::instance()->getTotalSleeps();
+  doc["wake_to_publish_ms"] = SleepManager::instance()->getWakeToPublish();
+#endif
+
+  bounds = doc.createNestedArray("histogram_bounds_us");
+
+  for(int i = 0; i < METRICS_HISTOGRAM_BOUNDS; i++) {
+    bounds.add(metricsHistogramBounds[i]);
+  }
+
+  heap = doc.createNestedObject("heap");
+  heap["free"] = heapStats.freeHeap;
+  heap["largest_block"] = heapStats.largestFreeBlock;
+  heap["min_free"] = heapStats.minFreeHeap;
+  heap["fragmentation"] = heapStats.fragmentation;
+
+  stack = doc.createNestedObject("stack_high_water");
+  stack["loop"] = heapStats.loopStackHighWater;
+  stack["ble"] = heapStats.bleStackHighWater;
+
+  sinks = doc.createNestedObject("sinks");
+
+  for(int i = 0; i < pipeline->getTotalSinks(); i++) {
+    sink = sinks.createNestedObject(pipeline->getSink(i)->getName());
+    sink["queued"] = pipeline->getSink(i)->getQueued();
+    sink["written"] = pipeline->getSink(i)->getWritten();
+    sink["dropped"] = pipeline->getSink(i)->getDropped();
+  }
+
+#ifdef TRACK_ALLOCATIONS
+  allocations = doc.createNestedObject("allocations");
+
+  for(int i = 0; i < ALLOC_SITE_COUNT; i++) {
+    counter = HeapMonitor::instance()->getAllocCounter((allocSite_t)i);
+    
+    site = allocations.createNestedObject(HeapMonitor::allocSiteName((allocSite_t)i));
+    site["allocs"] = counter.allocs;
+    site["frees"] = counter.frees;
+    site["bytes"] = counter.bytes;
+  }
+#endif
+
+  topic = buildTopic("gateway", "/metrics");
+  publishJson(topic, doc);
+  free(topic);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_TOPIC);
+  TRACK_FREE(ALLOC_SITE_PUBLISH_JSON);
+
+  for(int i = 0; i < batteryManager->getTotalBatteries(); i++) {
+    publishBatteryMetrics(batteryManager->getBattery(i));
+  }
+}
+
+#ifdef LOW_POWER
+/**
+ * Once this wake's sweep is done and everything from it has been published, the
+ * gateway metrics go out with how long that took and we go back to sleep. If the
+ * WiFi or MQTT isn't there by SLEEP_AWAKE_TIMEOUT we sleep anyway, whatever
+ * didn't go out is kept for next time.
+ */
+void sleepWhenDone()
+{
+  SleepManager *sleepManager = SleepManager::instance();
+  bool pending = AlarmManager::instance()->hasPending() || TelemetryPipeline::instance()->hasPending();
 
+  if(!sleepManager->isSweepDone()) {
+    return;
+  }
+
+  if(mqttClient->connected() && !pending) {
+    sleepManager->published();
+    Serial.printf("- Published everything %u ms after waking\n", sleepManager->getWakeToPublish());
+
+    publishMetrics();
+    mqttClient->loop();
+    mqttClient->disconnect();
+  } else if(millis() < SLEEP_AWAKE_TIMEOUT) {
+    return;
   } else {
-    Serial.println("Skipping MQTT Publish, battery buffer is not valid.");
+    Serial.println("- FAILED: Could not publish before going back to sleep, keeping it for next time");
   }
+
+#ifdef PERSIST_HISTORY
+  HistoryStore::instance()->save(SPIFFS, HISTORY_FILE_PATH);
+#endif
+
+  WiFi.disconnect(true);
+  displayManager->off();
+  sleepManager->sleep();
 }
+#endif
 
 /**
  * This function is called over and over again every cycle and where the bulk of the
@@ -301,6 +1151,13 @@ void publishToMqtt(batteryInfo_t *battery)
  * via MQTT
  */
 void loop() {
+
+#ifdef CAPTURE_BLE_FRAGMENTS
+  handleCaptureCommands();
+#endif
+
+  // Alarms queued while they can't be published mustn't cut every wait short
+  AlarmManager::instance()->setDeliverable(mqttClient->connected());
   
   if(scanning) {
   
@@ -311,17 +1168,34 @@ void loop() {
   
       scanTotalInterrupts++;
   
-      displayManager->scanningScreen(scanTotalInterrupts * 10);
+      displayManager->scanningScreen(min(scanTotalInterrupts * 100 / ScanManager::instance()->getDuration(), (uint32_t)100));
             
-      if(scanTotalInterrupts == 10) {
+      if(scanTotalInterrupts >= ScanManager::instance()->getDuration()) {
         timerAlarmDisable(scanTimer);
       }
       
     }
+
+    // Everything we were looking for has turned up, no need to sit out the rest of the scan
+    if(ScanManager::instance()->isComplete()) {
+      bleScanner->stop();
+      scanDone();
+    }
         
     return;
   } 
 
+#ifdef LOW_POWER
+  // The whole bank is polled before the WiFi comes up, so the radio isn't split
+  // between the two and the WiFi is on for as short a time as possible
+  if(!SleepManager::instance()->isSweepDone()) {
+    displayManager->statusScreen();
+    batteryManager->loop();
+    TelemetryPipeline::instance()->loop(); // history keeps up, MQTT holds on to everything
+    return;
+  }
+#endif
+
   if(WiFi.status() != WL_CONNECTED) {
     
     if(wifiConnectAttempts < WIFI_CONNECT_ATTEMPTS) {
@@ -335,18 +1209,86 @@ void loop() {
       connectMqtt();
     }
   }
+
+  if(!mqttClient->connected() && !mqttOutage) {
+    mqttOutage = true;
+    mqttOutageStarted = HistoryStore::instance()->now();
+  }
   
+  publishAlarms(); // Alarms go out before anything else
+
+  CommandManager::instance()->loop();
+  LeaseManager::instance()->loop();
+
+  // Only rescan between polls, the BLE stack doesn't cope with scanning while connected
+  if(!(batteryManager->getBLEClient() && batteryManager->getBLEClient()->isConnected()) &&
+     CommandManager::instance()->takeRescan()) {
+    startDeviceScan(SCAN_DISCOVERY);
+    return;
+  }
+
+#ifndef LOW_POWER
+  // Now and again check the batteries are all still there and how well we hear them
+  if(batteryManager->isIdle() && ScanManager::instance()->isRefreshDue()) {
+    startDeviceScan(SCAN_REFRESH);
+    return;
+  }
+#endif
+
   displayManager->statusScreen();
 
   batteryManager->loop(); // Give the batteries a chance to update
 
+  HeapMonitor::instance()->sampleLoopTask();
+
   if(mqttClient->connected()) {
-    for(int i = 0; i < batteryManager->getTotalBatteries(); i++) {
-      publishToMqtt(batteryManager->getBattery(i));
+    publishAlarms();
+    publishLeases();
+
+    if(mqttOutage) {
+      Serial.println("- MQTT is back, publishing history for the outage");
+
+      for(int i = 0; i < batteryManager->getTotalBatteries(); i++) {
+        if(batteryManager->getBattery(i)->id[0]) {
+          publishHistory(batteryManager->getBattery(i), mqttOutageStarted);
+        }
+      }
+
+      mqttOutage = false;
+    }
+
+    TelemetryPipeline::instance()->loop();
+
+    publishBank();
+
+    if(!mqttSink->getQueued()) {
+      publishAcks(); // after the batteries, so a poll's frame is out before it's acknowledged
+    }
+
+    if((millis() - lastMetricsPublish) >= METRICS_PUBLISH_INTERVAL) {
+      publishMetrics();
+      lastMetricsPublish = millis();
     }
 
     mqttClient->loop();
+  } else {
+    TelemetryPipeline::instance()->loop(); // everything but MQTT carries on
   }
+
+#ifdef PERSIST_HISTORY
+  if((millis() - lastHistorySave) >= HISTORY_PERSIST_INTERVAL) {
+    HistoryStore::instance()->save(SPIFFS, HISTORY_FILE_PATH);
+    lastHistorySave = millis();
+  }
+#endif
+
+#ifdef LOW_POWER
+  sleepWhenDone();
+#endif
   
-  delay(5000);
+  // Sleep until the next cycle, or until a frame raises or clears an alarm. If
+  // someone has asked for a battery there's no sleeping, it's polled right away.
+  if(!batteryManager->hasRequestedPolls()) {
+    AlarmManager::instance()->waitForPending(5000);
+  }
 }
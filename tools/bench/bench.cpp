@@ -0,0 +1,238 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * lifeblue-bench: sweeps simulated banks of different sizes through the real
+ * BatteryManager and reports how the cost of each poll and the memory per
+ * battery change as the bank grows. Each bank size runs in its own process so
+ * it starts from a clean heap and fresh singletons.
+ *
+ * Usage: lifeblue-bench [-s sweeps] [-m mtu] [-v] [batteries ...]
+ *
+ *   -s  sweeps to run for each bank size (default 5)
+ *   -m  largest ATT MTU the batteries agree to (default 23, what they start with)
+ *   -v  show the firmware's own serial output
+ *
+ * Bank sizes default to 10, 50 and 200. Times are real CPU time on this machine,
+ * split into picking and connecting to the next battery (schedule) and handling
+ * its frame (decode). The sweep time is the firmware's own, on the virtual clock.
+ * notify/poll is how many notifications a poll's frame came in.
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "esp_heap_caps.h"
+#include "BatteryManager.h"
+#include "CommandManager.h"
+#include "HistoryStore.h"
+#include "../sim/SimPeer.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct benchResult_t {
+  size_t bytesPerBattery;
+  double scheduleMicros; // per poll
+  double decodeMicros; // per poll
+  uint32_t polls;
+  uint32_t sweepMillis; // the last sweep, virtual clock
+  uint32_t onDemandWait; // polls before a battery asked for with pollNow() was polled, worst case
+  double notificationsPerPoll;
+};
+
+static double elapsedMicros(std::chrono::steady_clock::time_point since)
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+}
+
+static std::string batteryAddress(int i)
+{
+  char address[18];
+
+  snprintf(address, sizeof(address), "c8:fd:19:00:%02x:%02x", (i >> 8) & 0xff, i & 0xff);
+
+  return address;
+}
+
+static benchResult_t runBank(int batteries, int sweeps, uint16_t mtu)
+{
+  benchResult_t result = {};
+  BatteryManager *batteryManager;
+  SimPeer peer;
+  std::chrono::steady_clock::time_point started;
+  std::string address;
+  std::string wanted;
+  double schedule = 0;
+  double decode = 0;
+  uint32_t waited;
+  size_t heapBefore;
+
+  peer.maxMtu = mtu;
+  hostSetBLEPeer(&peer);
+
+  batteryManager = BatteryManager::instance(batteries);
+  TelemetryPipeline::instance()->addSink(new HistorySink());
+  heapBefore = hostHeapUsed();
+
+  for(int i = 0; i < batteries; i++) {
+    address = batteryAddress(i);
+
+    peer.frames[address].voltage = 13200 + (i % 100);
+    peer.frames[address].current = -1000 - (i * 7 % 500);
+    peer.frames[address].cells[i % 4] += i % 30;
+
+    BLEAdvertisedDevice device(BLEAddress(address), "LB\n", -60 - (i % 30));
+    batteryManager->addBattery(&device);
+  }
+
+  result.bytesPerBattery = (hostHeapUsed() - heapBefore) / batteries;
+
+  for(int sweep = 0; sweep < sweeps; sweep++) {
+    // Part way through each sweep someone asks for a battery on the far side of it
+    wanted = batteryAddress((sweep * 37 + batteries / 2) % batteries);
+    waited = 0;
+
+    for(int poll = 0; poll < batteries; poll++) {
+      if(poll == batteries / 3) {
+        CommandManager::instance()->poll("bench", wanted.c_str());
+        waited = 1;
+      }
+
+      started = std::chrono::steady_clock::now();
+      batteryManager->loop();
+      schedule += elapsedMicros(started);
+
+      if(!peer.characteristic) {
+        continue;
+      }
+
+      if(waited) {
+        if(peer.client->getPeerAddress().toString() == wanted) {
+          result.onDemandWait = std::max(result.onDemandWait, waited);
+          waited = 0;
+        } else {
+          waited++;
+        }
+      }
+
+      started = std::chrono::steady_clock::now();
+      peer.deliver();
+      TelemetryPipeline::instance()->loop();
+      decode += elapsedMicros(started);
+
+      result.polls++;
+    }
+  }
+
+  // Finish off the last sweep so it has a duration
+  for(int poll = 0; (poll < batteries) && (batteryManager->getTotalSweeps() < (uint32_t)sweeps); poll++) {
+    batteryManager->loop();
+    peer.deliver();
+    TelemetryPipeline::instance()->loop();
+  }
+
+  result.scheduleMicros = schedule / result.polls;
+  result.decodeMicros = decode / result.polls;
+  result.notificationsPerPoll = (double)peer.notifications / result.polls;
+  result.sweepMillis = batteryManager->getLastSweepDuration();
+
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<int> banks;
+  benchResult_t result;
+  int sweeps = 5;
+  uint16_t mtu = 23;
+  bool verbose = false;
+  int fds[2];
+  int opt;
+  pid_t pid;
+
+  while((opt = getopt(argc, argv, "s:m:v")) != -1) {
+    switch(opt) {
+      case 's':
+        sweeps = atoi(optarg);
+        break;
+      case 'm':
+        mtu = (atoi(optarg) > 23) ? atoi(optarg) : 23; // the smallest BLE allows
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-s sweeps] [-m mtu] [-v] [batteries ...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  for(int i = optind; i < argc; i++) {
+    banks.push_back(atoi(argv[i]));
+  }
+
+  if(banks.empty()) {
+    banks = { 10, 50, 200 };
+  }
+
+  printf("%10s %12s %14s %14s %8s %10s %10s %12s\n", "batteries", "bytes/batt", "schedule us", "decode us",
+         "polls", "sweep s", "on-demand", "notify/poll");
+
+  for(int batteries : banks) {
+    if((batteries < 1) || (batteries > MAX_BATTERIES) || (pipe(fds) != 0)) {
+      fprintf(stderr, "Skipping %d batteries\n", batteries);
+      continue;
+    }
+
+    fflush(stdout);
+
+    if((pid = fork()) == 0) {
+      close(fds[0]);
+
+      if(!verbose) {
+        Serial.setOutput(NULL);
+      }
+
+      result = runBank(batteries, sweeps, mtu);
+      _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+
+    if((pid < 0) || (read(fds[0], &result, sizeof(result)) != sizeof(result))) {
+      fprintf(stderr, "Benchmark for %d batteries failed\n", batteries);
+      close(fds[0]);
+      return 1;
+    }
+
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    printf("%10d %12zu %14.2f %14.2f %8u %10.1f %10u %12.1f\n", batteries, result.bytesPerBattery, result.scheduleMicros,
+           result.decodeMicros, result.polls, result.sweepMillis / 1000.0, result.onDemandWait, result.notificationsPerPoll);
+  }
+
+  return 0;
+}
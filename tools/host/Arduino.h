@@ -0,0 +1,134 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Host (Linux) stand-in for the bits of the Arduino core the firmware uses, so
+ * the firmware sources can be compiled unmodified into the tools in this directory.
+ *
+ * Time is virtual: millis() / micros() only move when delay() is called or a tool
+ * moves the clock with hostClockSet() / hostClockAdvance(). That's what lets the
+ * tools run the firmware at full speed and get the same answer every time.
+ */
+
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+
+#define IRAM_ATTR
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(_m) ((void)(_m))
+#define portEXIT_CRITICAL(_m) ((void)(_m))
+#define portENTER_CRITICAL_ISR(_m) ((void)(_m))
+#define portEXIT_CRITICAL_ISR(_m) ((void)(_m))
+
+typedef void *TaskHandle_t;
+typedef unsigned int UBaseType_t;
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
+
+// Binary semaphores and mutexes. There's only one thread on the host, so taking one
+// that hasn't been given just moves the clock on by the timeout.
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef struct hostSemaphore *SemaphoreHandle_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffffUL
+#define pdMS_TO_TICKS(_ms) ((TickType_t)(_ms))
+
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreGive(SemaphoreHandle_t);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t);
+
+class Print
+{
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *, size_t);
+
+  size_t printf(const char *, ...) __attribute__ ((format (printf, 2, 3)));
+  size_t print(const char *);
+  size_t print(char);
+  size_t print(int);
+  size_t print(unsigned int);
+  size_t print(long);
+  size_t print(unsigned long);
+  size_t println(const char *);
+  size_t println(int);
+  size_t println();
+};
+
+class HardwareSerial : public Print
+{
+public:
+  void begin(unsigned long) {}
+  int available();
+  int read();
+  void flush();
+  size_t write(uint8_t);
+  size_t write(const uint8_t *, size_t);
+  operator bool() const { return true; }
+
+  // Host only, where output goes (NULL to silence it) and where input comes from
+  void setOutput(FILE *);
+  void setInput(FILE *);
+
+private:
+  FILE *output = stdout;
+  FILE *input = NULL;
+};
+
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+
+long random(long);
+long random(long, long);
+void randomSeed(unsigned long);
+
+// Host only, virtual clock control (in microseconds)
+uint64_t hostClockMicros();
+void hostClockSet(uint64_t);
+void hostClockAdvance(uint64_t);
+
+// Host only, called with the ms the firmware is about to wait on a semaphore
+// before the clock is moved past the wait, so a tool can deliver whatever would
+// have turned up in the meantime (moving the clock on as it goes)
+void hostSetIdle(void (*)(uint32_t));
+
+#endif
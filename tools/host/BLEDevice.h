@@ -0,0 +1,248 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Host stand-in for the ESP32 BLE Arduino library. Only the calls the firmware
+ * actually makes are here, with the same signatures.
+ *
+ * There's no radio of course. Whatever is on the "other end" of a BLEClient is
+ * decided by the BLEHostPeer installed with hostSetBLEPeer(), which gets told about
+ * connects, subscriptions and disconnects and pushes notifications back with
+ * BLERemoteCharacteristic::hostNotify(). Without a peer every connect succeeds and
+ * nothing is ever notified.
+ */
+
+#ifndef HOST_BLEDEVICE_H_
+#define HOST_BLEDEVICE_H_
+
+#include "Arduino.h"
+#include <functional>
+#include <vector>
+
+typedef uint8_t esp_bd_addr_t[6];
+
+typedef enum {
+  BLE_ADDR_TYPE_PUBLIC = 0x00,
+  BLE_ADDR_TYPE_RANDOM = 0x01,
+  BLE_ADDR_TYPE_RPA_PUBLIC = 0x02,
+  BLE_ADDR_TYPE_RPA_RANDOM = 0x03,
+} esp_ble_addr_type_t;
+
+typedef int esp_err_t;
+#define ESP_OK 0
+
+typedef enum {
+  ESP_BT_STATUS_SUCCESS = 0,
+  ESP_BT_STATUS_FAIL,
+} esp_bt_status_t;
+
+typedef enum {
+  ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT = 20,
+} esp_gap_ble_cb_event_t;
+
+typedef struct {
+  esp_bd_addr_t bda;
+  uint16_t min_int;
+  uint16_t max_int;
+  uint16_t latency;
+  uint16_t timeout;
+} esp_ble_conn_update_params_t;
+
+typedef union {
+  struct ble_update_conn_params_evt_param {
+    esp_bt_status_t status;
+    esp_bd_addr_t bda;
+    uint16_t min_int;
+    uint16_t max_int;
+    uint16_t latency;
+    uint16_t conn_int;
+    uint16_t timeout;
+  } update_conn_params;
+} esp_ble_gap_cb_param_t;
+
+typedef void (*gap_event_handler)(esp_gap_ble_cb_event_t, esp_ble_gap_cb_param_t *);
+
+// Answered by the BLEHostPeer straight away, the GAP handler is called before this returns
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *);
+
+class BLEUUID
+{
+public:
+  BLEUUID() {}
+  BLEUUID(uint16_t uuid) : uuid(uuid) {}
+
+  bool equals(const BLEUUID &other) const { return uuid == other.uuid; }
+  std::string toString() const;
+
+private:
+  uint16_t uuid = 0;
+};
+
+class BLEAddress
+{
+public:
+  BLEAddress(esp_bd_addr_t);
+  BLEAddress(std::string);
+
+  bool equals(const BLEAddress &) const;
+  bool operator==(const BLEAddress &other) const { return equals(other); }
+  bool operator<(const BLEAddress &) const;
+  esp_bd_addr_t *getNative();
+  std::string toString() const;
+
+private:
+  esp_bd_addr_t address;
+};
+
+class BLEAdvertisedDevice
+{
+public:
+  BLEAdvertisedDevice() : address(std::string("00:00:00:00:00:00")) {}
+
+  // Host only, the real one is only ever filled in by BLEScan
+  BLEAdvertisedDevice(BLEAddress address, std::string name, int rssi, bool advertisesService = true)
+    : address(address), name(name), rssi(rssi), advertisesService(advertisesService) {}
+
+  BLEAddress getAddress() { return address; }
+  esp_ble_addr_type_t getAddressType() { return BLE_ADDR_TYPE_PUBLIC; }
+  std::string getName() { return name; }
+  int getRSSI() { return rssi; }
+  bool haveName() { return !name.empty(); }
+  bool haveRSSI() { return true; }
+  bool haveServiceUUID() { return advertisesService; }
+  bool isAdvertisingService(BLEUUID uuid) { return advertisesService && uuid.equals(BLEUUID((uint16_t)0xffe0)); }
+
+private:
+  BLEAddress address;
+  std::string name;
+  int rssi = 0;
+  bool advertisesService = false;
+};
+
+class BLEScanResults
+{
+public:
+  int getCount() { return devices.size(); }
+  BLEAdvertisedDevice getDevice(uint32_t i) { return devices[i]; }
+
+  // Host only
+  void hostAdd(BLEAdvertisedDevice device) { devices.push_back(device); }
+
+private:
+  std::vector<BLEAdvertisedDevice> devices;
+};
+
+class BLERemoteCharacteristic;
+class BLEClient;
+
+typedef std::function<void(BLERemoteCharacteristic *, uint8_t *, size_t, bool)> notify_callback;
+
+class BLERemoteCharacteristic
+{
+public:
+  BLERemoteCharacteristic(BLEClient *client, BLEUUID uuid, uint16_t handle) : client(client), uuid(uuid), handle(handle) {}
+
+  bool canNotify() { return true; }
+  uint16_t getHandle() { return handle; }
+  BLEUUID getUUID() { return uuid; }
+  void registerForNotify(notify_callback, bool notifications = true);
+
+  // Host only, deliver a notification to whoever registered for it
+  void hostNotify(uint8_t *, size_t);
+
+private:
+  BLEClient *client;
+  BLEUUID uuid;
+  uint16_t handle;
+  notify_callback callback = nullptr;
+};
+
+class BLERemoteService
+{
+public:
+  BLERemoteService(BLEClient *client, BLEUUID uuid) : client(client), uuid(uuid) {}
+  ~BLERemoteService();
+
+  BLERemoteCharacteristic *getCharacteristic(BLEUUID);
+
+private:
+  BLEClient *client;
+  BLEUUID uuid;
+  BLERemoteCharacteristic *characteristic = NULL;
+};
+
+class BLEClient
+{
+public:
+  BLEClient();
+  ~BLEClient();
+
+  bool connect(BLEAdvertisedDevice *);
+  bool connect(BLEAddress, esp_ble_addr_type_t type = BLE_ADDR_TYPE_PUBLIC);
+  void disconnect();
+  bool isConnected();
+  BLERemoteService *getService(BLEUUID);
+  BLEAddress getPeerAddress();
+  int getRssi();
+  bool setMTU(uint16_t);
+  uint16_t getMTU();
+
+private:
+  bool connected = false;
+  uint16_t mtu = 23;
+  BLEAddress peerAddress;
+  BLERemoteService *service = NULL;
+};
+
+class BLEScan; // only the sketch scans, see sketchcheck/BLEDevice.h
+
+class BLEDevice
+{
+public:
+  static void init(std::string);
+  static BLEClient *createClient();
+  static void setCustomGapHandler(gap_event_handler);
+  static BLEScan *getScan();
+};
+
+/**
+ * Host only. Decides what the other end of a connection looks like.
+ */
+class BLEHostPeer
+{
+public:
+  virtual ~BLEHostPeer() {}
+
+  virtual bool connect(BLEClient *, BLEAddress) { return true; }
+  virtual bool hasService(BLEClient *, BLEUUID) { return true; }
+  virtual void subscribed(BLEClient *, BLERemoteCharacteristic *) {}
+  virtual void disconnected(BLEClient *) {}
+  virtual uint16_t mtu(BLEClient *, uint16_t requested) { return 23; } // the MTU it agrees to
+  virtual bool connParams(esp_ble_conn_update_params_t *) { return true; } // false to turn them down
+};
+
+void hostSetBLEPeer(BLEHostPeer *);
+
+// Host only, number of BLEClient objects currently allocated
+uint32_t hostLiveBLEClients();
+
+#endif
@@ -0,0 +1,117 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Host stand-in for the CircularBuffer library. Same semantics as the real
+ * one: push() onto a full buffer overwrites the head, unshift() onto a full
+ * buffer overwrites the tail.
+ */
+
+#ifndef HOST_CIRCULARBUFFER_H_
+#define HOST_CIRCULARBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+template<typename T, size_t S, typename IT = size_t>
+class CircularBuffer
+{
+public:
+  static const IT capacity = S;
+
+  bool unshift(T value)
+  {
+    head = (head == 0) ? S - 1 : head - 1;
+    buffer[head] = value;
+
+    if(count == S) {
+      tail = (tail == 0) ? S - 1 : tail - 1;
+      return false;
+    }
+
+    count++;
+    return true;
+  }
+
+  bool push(T value)
+  {
+    buffer[tail] = value;
+    tail = (tail + 1) % S;
+
+    if(count == S) {
+      head = (head + 1) % S;
+      return false;
+    }
+
+    count++;
+    return true;
+  }
+
+  T shift()
+  {
+    T result;
+
+    if(count == 0) {
+      return T();
+    }
+
+    result = buffer[head];
+    head = (head + 1) % S;
+    count--;
+
+    return result;
+  }
+
+  T pop()
+  {
+    if(count == 0) {
+      return T();
+    }
+
+    tail = (tail == 0) ? S - 1 : tail - 1;
+    count--;
+
+    return buffer[tail];
+  }
+
+  T first() const { return buffer[head]; }
+  T last() const { return buffer[(tail == 0) ? S - 1 : tail - 1]; }
+  T operator[](IT index) const { return buffer[(head + index) % S]; }
+
+  IT size() const { return count; }
+  IT available() const { return S - count; }
+  bool isEmpty() const { return count == 0; }
+  bool isFull() const { return count == S; }
+
+  void clear()
+  {
+    head = tail = count = 0;
+  }
+
+private:
+  T buffer[S];
+  IT head = 0;
+  IT tail = 0;
+  IT count = 0;
+};
+
+#endif
@@ -0,0 +1,78 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Host stand-in for the ESP32 FS library. A fs::FS is rooted at a directory
+ * on the host and Files are plain stdio files.
+ */
+
+#ifndef HOST_FS_H_
+#define HOST_FS_H_
+
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+class File : public Print
+{
+public:
+  File(FILE *fp = NULL) : fp(fp) {}
+
+  size_t write(uint8_t);
+  size_t write(const uint8_t *, size_t);
+  size_t read(uint8_t *, size_t);
+  int read();
+  int available();
+  size_t size();
+  bool seek(uint32_t);
+  void flush();
+  void close();
+  operator bool() const { return fp != NULL; }
+
+private:
+  FILE *fp;
+};
+
+class FS
+{
+public:
+  FS(const char *root = ".") : root(root) {}
+
+  File open(const char *, const char *mode = FILE_READ);
+  bool exists(const char *);
+  bool remove(const char *);
+  bool rename(const char *, const char *);
+
+protected:
+  std::string path(const char *);
+  std::string root;
+};
+
+}
+
+using fs::File;
+
+#endif
@@ -0,0 +1,69 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Host stand-in for the ESP32 WiFi library's WiFiServer / WiFiClient, on top of
+ * plain sockets. Servers only ever listen on the loopback interface.
+ */
+
+#ifndef HOST_WIFI_H_
+#define HOST_WIFI_H_
+
+#include "Arduino.h"
+
+class WiFiClient : public Print
+{
+public:
+  WiFiClient(int fd = -1) : fd(fd) {}
+
+  int connect(const char *, uint16_t);
+  uint8_t connected();
+  int available();
+  int read();
+  int read(uint8_t *, size_t);
+  size_t write(uint8_t);
+  size_t write(const uint8_t *, size_t);
+  void stop();
+  operator bool() const { return fd >= 0; }
+
+private:
+  int fd;
+};
+
+class WiFiServer
+{
+public:
+  WiFiServer(uint16_t port) : port(port) {}
+
+  void begin();
+  WiFiClient available();
+  void end();
+
+  // Host only, the port we actually got (begin() with port 0 picks a free one)
+  uint16_t hostPort();
+
+private:
+  uint16_t port;
+  int fd = -1;
+};
+
+#endif
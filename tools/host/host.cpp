@@ -0,0 +1,743 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Implementation of the host stand-ins in this directory
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "FS.h"
+#include "WiFi.h"
+#include "esp_heap_caps.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+
+static uint64_t clockMicros = 0;
+static BLEHostPeer defaultPeer;
+static BLEHostPeer *blePeer = &defaultPeer;
+static uint32_t liveBLEClients = 0;
+static gap_event_handler gapHandler = NULL;
+
+/**
+ * Print / HardwareSerial
+ */
+size_t Print::write(const uint8_t *buf, size_t len)
+{
+  for(size_t i = 0; i < len; i++) {
+    write(buf[i]);
+  }
+
+  return len;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char stackBuffer[256];
+  char *buffer = stackBuffer;
+  va_list args;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(stackBuffer, sizeof(stackBuffer), format, args);
+  va_end(args);
+
+  if(len < 0) {
+    return 0;
+  }
+
+  if((size_t)len >= sizeof(stackBuffer)) {
+    buffer = (char *)malloc(len + 1);
+
+    va_start(args, format);
+    vsnprintf(buffer, len + 1, format, args);
+    va_end(args);
+  }
+
+  write((const uint8_t *)buffer, len);
+
+  if(buffer != stackBuffer) {
+    free(buffer);
+  }
+
+  return len;
+}
+
+size_t Print::print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(int n) { return printf("%d", n); }
+size_t Print::print(unsigned int n) { return printf("%u", n); }
+size_t Print::print(long n) { return printf("%ld", n); }
+size_t Print::print(unsigned long n) { return printf("%lu", n); }
+size_t Print::println(const char *s) { return print(s) + println(); }
+size_t Print::println(int n) { return print(n) + println(); }
+size_t Print::println() { return write((const uint8_t *)"\r\n", 2); }
+
+int HardwareSerial::available()
+{
+  int c;
+
+  if(!input) {
+    return 0;
+  }
+
+  c = fgetc(input);
+
+  if(c == EOF) {
+    return 0;
+  }
+
+  ungetc(c, input);
+  return 1;
+}
+
+int HardwareSerial::read()
+{
+  return input ? fgetc(input) : -1;
+}
+
+void HardwareSerial::flush()
+{
+  if(output) {
+    fflush(output);
+  }
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if(output) {
+    fputc(c, output);
+  }
+
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+  if(output) {
+    fwrite(buf, 1, len, output);
+  }
+
+  return len;
+}
+
+void HardwareSerial::setOutput(FILE *fp)
+{
+  output = fp;
+}
+
+void HardwareSerial::setInput(FILE *fp)
+{
+  input = fp;
+}
+
+/**
+ * Virtual clock
+ */
+unsigned long millis() { return (uint32_t)(clockMicros / 1000); }
+unsigned long micros() { return (uint32_t)clockMicros; }
+void delay(unsigned long ms) { clockMicros += (uint64_t)ms * 1000; }
+void delayMicroseconds(unsigned int us) { clockMicros += us; }
+
+uint64_t hostClockMicros() { return clockMicros; }
+void hostClockSet(uint64_t us) { clockMicros = us; }
+void hostClockAdvance(uint64_t us) { clockMicros += us; }
+
+long random(long max) { return (max > 0) ? (rand() % max) : 0; }
+long random(long min, long max) { return (max > min) ? min + random(max - min) : min; }
+void randomSeed(unsigned long seed) { srand(seed); }
+
+/**
+ * FreeRTOS / heap
+ */
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+  return 4096;
+}
+
+struct hostSemaphore {
+  bool given;
+};
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return new hostSemaphore();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  SemaphoreHandle_t sem = new hostSemaphore();
+
+  sem->given = true;
+  return sem;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  if(sem->given) {
+    return pdFALSE;
+  }
+
+  sem->given = true;
+  return pdTRUE;
+}
+
+static void (*idle)(uint32_t) = NULL;
+static bool idling = false;
+
+void hostSetIdle(void (*callback)(uint32_t))
+{
+  idle = callback;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  uint64_t until = clockMicros + (uint64_t)ticks * 1000;
+
+  if(sem->given) {
+    sem->given = false;
+    return pdTRUE;
+  }
+
+  if((ticks == 0) || (ticks == portMAX_DELAY)) {
+    return pdFALSE;
+  }
+
+  // Not from inside the callback, whatever it delivers can take semaphores too
+  if(idle && !idling) {
+    idling = true;
+    idle(ticks);
+    idling = false;
+
+    if(sem->given) {
+      sem->given = false;
+      return pdTRUE;
+    }
+  }
+
+  if(clockMicros < until) {
+    clockMicros = until;
+  }
+
+  return pdFALSE;
+}
+
+static size_t minimumFreeHeap = HOST_HEAP_SIZE;
+
+size_t hostHeapUsed()
+{
+  return mallinfo2().uordblks;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+  size_t used = hostHeapUsed();
+  size_t available = (used >= HOST_HEAP_SIZE) ? 0 : HOST_HEAP_SIZE - used;
+
+  if(available < minimumFreeHeap) {
+    minimumFreeHeap = available;
+  }
+
+  return available;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+  return heap_caps_get_free_size(caps);
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+  heap_caps_get_free_size(caps);
+  return minimumFreeHeap;
+}
+
+/**
+ * FS
+ */
+namespace fs {
+
+size_t File::write(uint8_t c) { return (fp && (fputc(c, fp) != EOF)) ? 1 : 0; }
+size_t File::write(const uint8_t *buf, size_t len) { return fp ? fwrite(buf, 1, len, fp) : 0; }
+size_t File::read(uint8_t *buf, size_t len) { return fp ? fread(buf, 1, len, fp) : 0; }
+int File::read() { return fp ? fgetc(fp) : -1; }
+bool File::seek(uint32_t pos) { return fp && (fseek(fp, pos, SEEK_SET) == 0); }
+void File::flush() { if(fp) fflush(fp); }
+
+int File::available()
+{
+  long pos;
+  long end;
+
+  if(!fp) {
+    return 0;
+  }
+
+  pos = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  end = ftell(fp);
+  fseek(fp, pos, SEEK_SET);
+
+  return (int)(end - pos);
+}
+
+size_t File::size()
+{
+  long pos;
+  long end;
+
+  if(!fp) {
+    return 0;
+  }
+
+  pos = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  end = ftell(fp);
+  fseek(fp, pos, SEEK_SET);
+
+  return end;
+}
+
+void File::close()
+{
+  if(fp) {
+    fclose(fp);
+    fp = NULL;
+  }
+}
+
+std::string FS::path(const char *p)
+{
+  return root + p;
+}
+
+File FS::open(const char *p, const char *mode)
+{
+  std::string m(mode);
+
+  // Always binary, and "r" on the ESP32 lets you write too
+  if(m == "r") {
+    m = "rb";
+  } else {
+    m += "b";
+  }
+
+  return File(fopen(path(p).c_str(), m.c_str()));
+}
+
+bool FS::exists(const char *p)
+{
+  FILE *fp = fopen(path(p).c_str(), "rb");
+
+  if(fp) {
+    fclose(fp);
+  }
+
+  return fp != NULL;
+}
+
+bool FS::remove(const char *p)
+{
+  return ::remove(path(p).c_str()) == 0;
+}
+
+bool FS::rename(const char *from, const char *to)
+{
+  return ::rename(path(from).c_str(), path(to).c_str()) == 0;
+}
+
+}
+
+/**
+ * BLE
+ */
+std::string BLEUUID::toString() const
+{
+  char buf[8];
+
+  snprintf(buf, sizeof(buf), "%04x", uuid);
+  return std::string(buf);
+}
+
+BLEAddress::BLEAddress(esp_bd_addr_t native)
+{
+  memcpy(address, native, sizeof(address));
+}
+
+BLEAddress::BLEAddress(std::string str)
+{
+  unsigned int parts[6] = {0};
+
+  sscanf(str.c_str(), "%x:%x:%x:%x:%x:%x", &parts[0], &parts[1], &parts[2], &parts[3], &parts[4], &parts[5]);
+
+  for(int i = 0; i < 6; i++) {
+    address[i] = parts[i];
+  }
+}
+
+bool BLEAddress::equals(const BLEAddress &other) const
+{
+  return memcmp(address, other.address, sizeof(address)) == 0;
+}
+
+bool BLEAddress::operator<(const BLEAddress &other) const
+{
+  return memcmp(address, other.address, sizeof(address)) < 0;
+}
+
+esp_bd_addr_t *BLEAddress::getNative()
+{
+  return &address;
+}
+
+std::string BLEAddress::toString() const
+{
+  char buf[18];
+
+  snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+           address[0], address[1], address[2], address[3], address[4], address[5]);
+
+  return std::string(buf);
+}
+
+void BLERemoteCharacteristic::registerForNotify(notify_callback cb, bool notifications)
+{
+  callback = cb;
+  blePeer->subscribed(client, this);
+}
+
+void BLERemoteCharacteristic::hostNotify(uint8_t *data, size_t length)
+{
+  if(callback && client->isConnected()) {
+    callback(this, data, length, true);
+  }
+}
+
+BLERemoteService::~BLERemoteService()
+{
+  delete characteristic;
+}
+
+BLERemoteCharacteristic *BLERemoteService::getCharacteristic(BLEUUID uuid)
+{
+  if(!uuid.equals(BLEUUID((uint16_t)0xffe4))) {
+    return nullptr;
+  }
+
+  if(!characteristic) {
+    characteristic = new BLERemoteCharacteristic(client, uuid, 0x0011);
+  }
+
+  return characteristic;
+}
+
+BLEClient::BLEClient() : peerAddress(std::string("00:00:00:00:00:00"))
+{
+  liveBLEClients++;
+}
+
+BLEClient::~BLEClient()
+{
+  delete service;
+  liveBLEClients--;
+}
+
+bool BLEClient::connect(BLEAdvertisedDevice *device)
+{
+  return connect(device->getAddress());
+}
+
+bool BLEClient::connect(BLEAddress address, esp_ble_addr_type_t type)
+{
+  peerAddress = address;
+  mtu = 23; // every link starts out at the default
+  connected = blePeer->connect(this, address);
+
+  return connected;
+}
+
+void BLEClient::disconnect()
+{
+  if(!connected) {
+    return;
+  }
+
+  connected = false;
+  blePeer->disconnected(this);
+}
+
+bool BLEClient::isConnected()
+{
+  return connected;
+}
+
+BLERemoteService *BLEClient::getService(BLEUUID uuid)
+{
+  if(!connected || !blePeer->hasService(this, uuid)) {
+    return nullptr;
+  }
+
+  if(!service) {
+    service = new BLERemoteService(this, uuid);
+  }
+
+  return service;
+}
+
+BLEAddress BLEClient::getPeerAddress()
+{
+  return peerAddress;
+}
+
+int BLEClient::getRssi()
+{
+  return 0;
+}
+
+/**
+ * The real one sends the request and the MTU changes when the answer comes back,
+ * here the peer answers straight away
+ */
+bool BLEClient::setMTU(uint16_t requested)
+{
+  if(!connected) {
+    return false;
+  }
+
+  mtu = blePeer->mtu(this, requested);
+
+  return true;
+}
+
+uint16_t BLEClient::getMTU()
+{
+  return mtu;
+}
+
+void BLEDevice::setCustomGapHandler(gap_event_handler handler)
+{
+  gapHandler = handler;
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params)
+{
+  esp_ble_gap_cb_param_t event = {};
+
+  memcpy(event.update_conn_params.bda, params->bda, sizeof(esp_bd_addr_t));
+  event.update_conn_params.status = blePeer->connParams(params) ? ESP_BT_STATUS_SUCCESS : ESP_BT_STATUS_FAIL;
+  event.update_conn_params.min_int = params->min_int;
+  event.update_conn_params.max_int = params->max_int;
+  event.update_conn_params.latency = params->latency;
+  event.update_conn_params.conn_int = params->max_int;
+  event.update_conn_params.timeout = params->timeout;
+
+  if(gapHandler) {
+    gapHandler(ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, &event);
+  }
+
+  return ESP_OK;
+}
+
+void BLEDevice::init(std::string name)
+{
+}
+
+BLEClient *BLEDevice::createClient()
+{
+  return new BLEClient();
+}
+
+void hostSetBLEPeer(BLEHostPeer *peer)
+{
+  blePeer = peer ? peer : &defaultPeer;
+}
+
+uint32_t hostLiveBLEClients()
+{
+  return liveBLEClients;
+}
+
+/**
+ * WiFi
+ */
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+  struct sockaddr_in addr = {};
+
+  stop();
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  if(inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    return 0;
+  }
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if((fd < 0) || (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+    stop();
+    return 0;
+  }
+
+  return 1;
+}
+
+uint8_t WiFiClient::connected()
+{
+  char c;
+  ssize_t result;
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  result = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  // Still connected if there's data waiting or just nothing yet, 0 means the other end closed
+  return (result > 0) || ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)));
+}
+
+int WiFiClient::available()
+{
+  int waiting = 0;
+
+  if((fd < 0) || (ioctl(fd, FIONREAD, &waiting) != 0)) {
+    return 0;
+  }
+
+  return waiting;
+}
+
+int WiFiClient::read()
+{
+  uint8_t c;
+
+  return (read(&c, 1) == 1) ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t len)
+{
+  ssize_t result;
+
+  if(fd < 0) {
+    return -1;
+  }
+
+  result = recv(fd, buf, len, MSG_DONTWAIT);
+
+  return (result < 0) ? -1 : (int)result;
+}
+
+size_t WiFiClient::write(uint8_t c)
+{
+  return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t len)
+{
+  size_t written = 0;
+  ssize_t result;
+
+  while((fd >= 0) && (written < len)) {
+    result = send(fd, buf + written, len - written, MSG_NOSIGNAL);
+
+    if(result <= 0) {
+      break;
+    }
+
+    written += result;
+  }
+
+  return written;
+}
+
+void WiFiClient::stop()
+{
+  if(fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+void WiFiServer::begin()
+{
+  struct sockaddr_in addr = {};
+  int yes = 1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  if((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 8) != 0)) {
+    perror("WiFiServer::begin");
+    end();
+    return;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+WiFiClient WiFiServer::available()
+{
+  int client;
+
+  if(fd < 0) {
+    return WiFiClient();
+  }
+
+  client = accept(fd, NULL, NULL);
+
+  return WiFiClient(client);
+}
+
+void WiFiServer::end()
+{
+  if(fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+uint16_t WiFiServer::hostPort()
+{
+  struct sockaddr_in addr = {};
+  socklen_t length = sizeof(addr);
+
+  if((fd < 0) || (getsockname(fd, (struct sockaddr *)&addr, &length) != 0)) {
+    return 0;
+  }
+
+  return ntohs(addr.sin_port);
+}
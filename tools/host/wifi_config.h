@@ -0,0 +1,16 @@
+#ifndef __LIFEBLUE_WIFI_CFG
+#define __LIFEBLUE_WIFI_CFG
+
+/**
+ * Host tools configuration, only used when there's no wifi_config.h next to the sketch
+ */
+
+static const char *SSID = "host";
+static const char *wifiPassword = "";
+static const char *mqttClientId = "lifeblue-host";
+static const char *mqttServer = "localhost";
+static const char *mqttTopic = "/rv/sensors/batteries/%s";
+static const char *mqttUser = "";
+static const char *mqttPassword = "";
+
+#endif
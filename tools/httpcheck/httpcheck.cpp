@@ -0,0 +1,329 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * lifeblue-httpcheck: runs the MetricsServer on the loopback interface with a
+ * couple of simulated batteries behind the real BatteryManager, then fetches
+ * from it with a loopback client and checks what comes back, including that
+ * responses are served from the cache until the next frame is decoded.
+ *
+ * Usage: lifeblue-httpcheck [-n requests] [-s port] [-v]
+ *
+ *   -n  how many cached requests to time (default 1000)
+ *   -s  don't check anything, just serve on port until killed (try it with curl)
+ *   -v  show the firmware's own serial output
+ *
+ * Exits non-zero if any check fails.
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "WiFi.h"
+#include "BatteryManager.h"
+#include "MetricsServer.h"
+#include "TelemetryPipeline.h"
+#include "ScanManager.h"
+#include "../sim/SimFrame.h"
+#include "../sim/SimPeer.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <unistd.h>
+
+/**
+ * A sink that never gets anything written, like MQTT with the broker down
+ */
+class StuckSink : public TelemetrySink
+{
+
+public:
+  StuckSink() : TelemetrySink("stuck", SINK_LATEST) {};
+
+protected:
+  bool write(const telemetrySnapshot_t *) { return false; };
+};
+
+static SimPeer peer;
+static std::map<std::string, simFrame_t> &frames = peer.frames;
+static int failures = 0;
+
+/**
+ * Runs the scheduler until it has polled a battery and that battery's frame has
+ * been delivered and through the pipeline
+ */
+static void pollOnce()
+{
+  for(int attempts = 0; (attempts < 10) && !peer.characteristic; attempts++) {
+    BatteryManager::instance()->loop();
+  }
+
+  peer.deliver();
+  TelemetryPipeline::instance()->loop();
+}
+
+/**
+ * One request over the loopback interface. The server is single threaded like
+ * everything else here, so the request is written first, then the server gets a
+ * turn, then the whole response is sitting there waiting to be read.
+ */
+static std::string fetch(uint16_t port, const char *path)
+{
+  WiFiClient client;
+  std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: lifeblue-httpcheck\r\n\r\n";
+  std::string response;
+  uint8_t buffer[4096];
+  int length;
+
+  if(!client.connect("127.0.0.1", port)) {
+    return "";
+  }
+
+  client.write((const uint8_t *)request.data(), request.length());
+
+  MetricsServer::instance()->loop();
+
+  while((length = client.read(buffer, sizeof(buffer))) > 0) {
+    response.append((char *)buffer, length);
+  }
+
+  client.stop();
+
+  return response;
+}
+
+static void check(bool condition, const char *what)
+{
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if(!condition) {
+    failures++;
+  }
+}
+
+static bool contains(const std::string &haystack, const std::string &needle)
+{
+  return haystack.find(needle) != std::string::npos;
+}
+
+int main(int argc, char **argv)
+{
+  BatteryManager *batteryManager;
+  MetricsServer *metricsServer;
+  std::string response;
+  uint32_t renders;
+  uint32_t notifications;
+  uint16_t port;
+  int requests = 1000;
+  int servePort = -1;
+  bool verbose = false;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:s:v")) != -1) {
+    switch(opt) {
+      case 'n':
+        requests = atoi(optarg);
+        break;
+      case 's':
+        servePort = atoi(optarg);
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n requests] [-s port] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(!verbose) {
+    Serial.setOutput(NULL);
+  }
+
+  hostSetBLEPeer(&peer);
+
+  frames["c8:fd:19:00:00:01"] = simFrame_t();
+  frames["c8:fd:19:00:00:02"] = simFrame_t();
+  frames["c8:fd:19:00:00:02"].current = -2500;
+  frames["c8:fd:19:00:00:02"].cells[1] = 3390;
+  frames["c8:fd:19:00:00:02"].totalCells = 8; // a 24V pack, with a frame that only has room for its own cells
+  frames["c8:fd:19:00:00:03"] = simFrame_t(); // added part way through
+  frames["c8:fd:19:00:00:02"].frameCells = 8;
+
+  batteryManager = BatteryManager::instance(frames.size());
+  TelemetryPipeline::instance()->addSink(new StuckSink());
+  TelemetryPipeline::instance()->addSink(new MetricsSink());
+  batteryManager->addBattery(BLEAddress(std::string("c8:fd:19:00:00:01")), BLE_ADDR_TYPE_PUBLIC, "LB \"one\"\n", -60);
+  batteryManager->addBattery(BLEAddress(std::string("c8:fd:19:00:00:02")), BLE_ADDR_TYPE_PUBLIC, "LB two\n", -70);
+
+  // Two frames each, a battery's cell count is only settled once a second frame agrees
+  pollOnce();
+  pollOnce();
+  pollOnce();
+  pollOnce();
+
+  metricsServer = MetricsServer::instance();
+  metricsServer->begin(servePort >= 0 ? servePort : 0);
+  port = metricsServer->getServer()->hostPort();
+
+  if(!port) {
+    fprintf(stderr, "Could not start the server\n");
+    return 1;
+  }
+
+  if(servePort >= 0) {
+    fprintf(stderr, "Serving on http://127.0.0.1:%u/metrics and /json\n", port);
+
+    for(;;) {
+      metricsServer->loop();
+      usleep(10000);
+    }
+  }
+
+  response = fetch(port, "/metrics");
+  check(contains(response, "HTTP/1.1 200 OK\r\n"), "/metrics returns 200");
+  check(contains(response, "Content-Type: text/plain; version=0.0.4\r\n"), "/metrics is Prometheus text");
+  check(contains(response, "lifeblue_battery_info{battery=\"c8:fd:19:00:00:01\",name=\"LB \\\"one\\\"\"} 1\n"), "battery info with escaped name");
+  check(contains(response, "lifeblue_battery_voltage_millivolts{battery=\"c8:fd:19:00:00:01\"} 13300\n"), "battery gauge");
+  check(contains(response, "lifeblue_battery_current_milliamps{battery=\"c8:fd:19:00:00:02\"} -2500\n"), "signed current");
+  check(contains(response, "lifeblue_battery_cell_millivolts{battery=\"c8:fd:19:00:00:02\",cell=\"2\"} 3390\n"), "cell voltage");
+  check(contains(response, "lifeblue_battery_cell_millivolts{battery=\"c8:fd:19:00:00:02\",cell=\"8\"} 3325\n"), "cells of a 24V pack");
+  check(!contains(response, "lifeblue_battery_cell_millivolts{battery=\"c8:fd:19:00:00:01\",cell=\"5\"}"), "no padding cells for a 12V pack");
+  check(contains(response, "lifeblue_bank_batteries 2\n"), "bank aggregates");
+  check(contains(response, "lifeblue_bank_current_milliamps -4000\n"), "bank current");
+  check(contains(response, "stage=\"total\",le=\"+Inf\"} 4\n"), "poll stage histograms");
+  check(contains(response, "lifeblue_battery_link_mtu_bytes{battery=\"c8:fd:19:00:00:01\"} 23\n") &&
+        contains(response, "lifeblue_battery_link_interval_microseconds{battery=\"c8:fd:19:00:00:01\"} 15000\n"), "link parameters recorded");
+
+  renders = metricsServer->getTotalRenders();
+
+  response = fetch(port, "/json");
+  check(contains(response, "Content-Type: application/json\r\n"), "/json is JSON");
+  check(contains(response, "\"battery_id\":\"c8:fd:19:00:00:02\""), "/json has the batteries");
+  check(contains(response, "\"cells\":[3325,3326,3324,3325],") && contains(response, "\"cells\":[3325,3390,3324,3325,3325,3326,3324,3325],"),
+        "/json has each battery's own cells");
+  check(contains(response, "\"bank\":{\"batteries\":2,\"current\":-4000"), "/json has the bank");
+  check(metricsServer->getTotalRenders() == renders, "second request served from the cache");
+
+  response = fetch(port, "/nope");
+  check(contains(response, "HTTP/1.1 404 Not Found\r\n"), "unknown path returns 404");
+
+  frames["c8:fd:19:00:00:01"].voltage = 13250;
+  frames["c8:fd:19:00:00:02"].voltage = 13250;
+  pollOnce();
+
+  response = fetch(port, "/metrics");
+  check(contains(response, "lifeblue_bank_voltage_min_millivolts 13250\n"), "new frame shows up");
+  check(metricsServer->getTotalRenders() == renders + 1, "new frame re-renders once");
+  check(contains(response, "lifeblue_sink_written_total{sink=\"metrics\"} 5\n") &&
+        contains(response, "lifeblue_sink_queued{sink=\"stuck\"} 2\n") &&
+        contains(response, "lifeblue_sink_dropped_total{sink=\"stuck\"} 3\n"), "a stuck sink only holds up itself");
+
+  // Lost fragments and bad checksums ahead of the good frame, all on the one connection
+  frames["c8:fd:19:00:00:02"].voltage = 13240;
+  peer.truncate = true;
+  peer.badFrames = 1;
+  pollOnce();
+
+  response = fetch(port, "/metrics");
+  check(contains(response, "lifeblue_battery_voltage_millivolts{battery=\"c8:fd:19:00:00:02\"} 13240\n"), "good frame after bad ones");
+  check(contains(response, "lifeblue_battery_resyncs_total{battery=\"c8:fd:19:00:00:02\"} 1\n"), "truncated frame resyncs");
+  check(contains(response, "lifeblue_battery_checksum_rejects_total{battery=\"c8:fd:19:00:00:02\"} 1\n"), "bad checksum doesn't end the poll");
+
+  frames["c8:fd:19:00:00:01"].voltage = 13230;
+  peer.truncate = false;
+  peer.badFrames = FRAME_MAX_REJECTS;
+  pollOnce();
+
+  peer.badFrames = 0;
+  pollOnce(); // the other battery, nothing's rendered again until a frame is decoded
+
+  response = fetch(port, "/metrics");
+  check(contains(response, "lifeblue_battery_voltage_millivolts{battery=\"c8:fd:19:00:00:01\"} 13250\n") &&
+        contains(response, "lifeblue_battery_timeouts_total{battery=\"c8:fd:19:00:00:01\"} 1\n"), "too many bad frames ends the poll");
+
+  // A battery that takes a bigger MTU gets its frame in one notification, the
+  // ones that turned it down aren't asked again
+  peer.maxMtu = LINK_MTU;
+  batteryManager->addBattery(BLEAddress(std::string("c8:fd:19:00:00:03")), BLE_ADDR_TYPE_PUBLIC, "LB three\n", -65);
+  batteryManager->pollNow(batteryManager->findBattery(BLEAddress(std::string("c8:fd:19:00:00:03"))));
+  notifications = peer.notifications;
+  pollOnce();
+
+  response = fetch(port, "/metrics");
+  check(contains(response, "lifeblue_battery_link_mtu_bytes{battery=\"c8:fd:19:00:00:03\"} 247\n") &&
+        (peer.notifications - notifications == 1), "bigger MTU, one notification a frame");
+
+  pollOnce();
+
+  response = fetch(port, "/metrics");
+  check(contains(response, "lifeblue_battery_link_mtu_bytes{battery=\"c8:fd:19:00:00:01\"} 23\n"), "turned down MTU isn't asked for again");
+
+  // A refresh can stop as soon as every battery it knows about has been heard,
+  // hearing one twice or hearing something else doesn't count
+  ScanManager *scanManager = ScanManager::instance();
+  BLEAdvertisedDevice one(BLEAddress(std::string("c8:fd:19:00:00:01")), "LB one", -50);
+  BLEAdvertisedDevice two(BLEAddress(std::string("c8:fd:19:00:00:02")), "LB two", -55);
+  BLEAdvertisedDevice three(BLEAddress(std::string("c8:fd:19:00:00:03")), "LB three", -58);
+  BLEAdvertisedDevice other(BLEAddress(std::string("11:22:33:44:55:66")), "Speaker", -40, false);
+
+  scanManager->begin(SCAN_REFRESH);
+  scanManager->advertised(&one);
+  scanManager->advertised(&one);
+  scanManager->advertised(&other);
+  scanManager->advertised(&two);
+  check(!scanManager->isComplete() && (batteryManager->getTotalBatteries() == 3), "refresh keeps going until every battery is heard");
+
+  scanManager->advertised(&three);
+  scanManager->finished();
+  check(scanManager->isComplete() && (batteryManager->findBattery(one.getAddress())->rssi == -50), "refresh stops once every battery is heard");
+
+  // So can a rescan someone asked for, once it's heard at least the batteries we already had
+  scanManager->begin(SCAN_DISCOVERY);
+  scanManager->advertised(&three);
+  scanManager->advertised(&two);
+  check(!scanManager->isComplete(), "rescan keeps going until every known battery is heard");
+
+  scanManager->advertised(&one);
+  scanManager->finished();
+  check(scanManager->isComplete(), "rescan stops once every known battery is heard");
+
+  renders = metricsServer->getTotalRenders();
+
+  auto started = std::chrono::steady_clock::now();
+
+  for(int i = 0; i < requests; i++) {
+    if(fetch(port, "/metrics").empty()) {
+      check(false, "cached request");
+      break;
+    }
+  }
+
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  check(metricsServer->getTotalRenders() == renders, "cached requests don't re-render");
+
+  fprintf(stderr, "%d cached /metrics requests in %.3fs (%.0f requests/s), %zu bytes each\n", requests, elapsed,
+          elapsed > 0 ? requests / elapsed : 0, fetch(port, "/metrics").length());
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,492 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * lifeblue-leasecheck: runs three gateways sharing one simulated bank, each in
+ * its own process with the real BatteryManager and LeaseManager, while this
+ * process stands in for the MQTT broker. Everything runs in lock step on the
+ * virtual clock: every tick each gateway gets the announcements the broker
+ * passed on since the last one (its own included, in the same order for
+ * everyone), runs its main loop once and hands back what it announced and
+ * which batteries it polled.
+ *
+ * The scenario: A and B start together, C joins at 120 s, A dies at 300 s and
+ * B loses the broker at 420 s (but keeps running). Each battery is heard best
+ * by one gateway. Checks that no battery is ever polled by two gateways at
+ * once, that in between events each battery is polled by the best gateway still
+ * around and nobody else, and that B stops polling on its own once cut off.
+ *
+ * Usage: lifeblue-leasecheck [-v]
+ *
+ *   -v  show the firmware's own serial output
+ *
+ * Exits non-zero if any check fails.
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "BatteryManager.h"
+#include "LeaseManager.h"
+#include "../sim/SimPeer.h"
+
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TICK 2500 // ms, longer than a poll takes so every gateway keeps to the same clock
+#define RUN_TIME 600000
+#define JOIN_TIME 120000 // C
+#define KILL_TIME 300000 // A
+#define PARTITION_TIME 420000 // B
+#define SETTLE_TIME 60000 // allowed after each event for leases to change hands
+
+#define TOTAL_GATEWAYS 3
+#define TOTAL_BATTERIES 6
+
+static const char *gatewayNames[TOTAL_GATEWAYS] = { "gw-a", "gw-b", "gw-c" };
+
+// How well each gateway (A, B, C) hears each battery
+static const int rssi[TOTAL_BATTERIES][TOTAL_GATEWAYS] = {
+  { -60, -75, -80 },
+  { -62, -70, -85 },
+  { -80, -58, -70 },
+  { -78, -65, -72 },
+  { -70, -72, -55 },
+  { -75, -68, -60 }
+};
+
+/**
+ * An announcement on its way through the broker
+ */
+struct wireMessage_t {
+  uint8_t gateway;
+  uint8_t battery;
+  int8_t rssi;
+  bool hold;
+  uint32_t sent;
+};
+
+struct tick_t {
+  uint32_t now; // ms
+  uint32_t delivered; // wireMessage_t's that follow
+};
+
+struct report_t {
+  uint32_t sent; // wireMessage_t's that follow
+  int8_t pollStarted; // battery, or -1
+  int8_t pollEnded; // battery, or -1
+};
+
+/**
+ * A poll as seen from outside, end is 0 while it's still going
+ */
+struct poll_t {
+  int gateway;
+  int battery;
+  uint32_t start;
+  uint32_t end;
+};
+
+struct gateway_t {
+  pid_t pid = 0;
+  int toGateway = -1;
+  int fromGateway = -1;
+  bool running = false;
+  bool partitioned = false;
+};
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if(!condition) {
+    failures++;
+  }
+}
+
+static std::string batteryAddress(int i)
+{
+  char address[18];
+
+  snprintf(address, sizeof(address), "c8:fd:19:00:00:%02x", i);
+
+  return address;
+}
+
+static bool readAll(int fd, void *buffer, size_t length)
+{
+  ssize_t got;
+
+  while(length) {
+    if((got = read(fd, buffer, length)) <= 0) {
+      return false;
+    }
+
+    buffer = (char *)buffer + got;
+    length -= got;
+  }
+
+  return true;
+}
+
+static int batteryIndex(batteryInfo_t *battery)
+{
+  std::string address = battery->address;
+
+  for(int i = 0; i < TOTAL_BATTERIES; i++) {
+    if(batteryAddress(i) == address) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * One gateway, this is what runs in each child process
+ */
+static void runGateway(int gateway, int in, int out)
+{
+  BatteryManager *batteryManager = BatteryManager::instance(TOTAL_BATTERIES);
+  LeaseManager *leaseManager = LeaseManager::instance();
+  std::vector<wireMessage_t> messages;
+  leaseMessage_t announcement;
+  wireMessage_t message;
+  report_t report;
+  SimPeer peer;
+  tick_t tick;
+
+  hostSetBLEPeer(&peer);
+  leaseManager->begin(gatewayNames[gateway]);
+
+  for(int i = 0; i < TOTAL_BATTERIES; i++) {
+    BLEAdvertisedDevice device(BLEAddress(batteryAddress(i)), "LB\n", rssi[i][gateway]);
+    batteryManager->addBattery(&device);
+  }
+
+  while(readAll(in, &tick, sizeof(tick))) {
+    if(tick.now > millis()) {
+      hostClockSet((uint64_t)tick.now * 1000);
+    }
+
+    for(uint32_t i = 0; i < tick.delivered; i++) {
+      if(!readAll(in, &message, sizeof(message))) {
+        _exit(1);
+      }
+
+      leaseManager->received(batteryManager->getBattery(message.battery), gatewayNames[message.gateway],
+                             message.rssi, message.hold, message.sent);
+    }
+
+    // Same order as the sketch's loop(), the poll started last tick finishes in between
+    report.pollStarted = report.pollEnded = -1;
+    messages.clear();
+
+    leaseManager->loop();
+
+    while(leaseManager->peek(&announcement)) {
+      message.gateway = gateway;
+      message.battery = batteryIndex(announcement.battery);
+      message.rssi = announcement.rssi;
+      message.hold = announcement.hold;
+      message.sent = announcement.sent;
+
+      messages.push_back(message);
+      leaseManager->shift();
+    }
+
+    if(peer.client) {
+      report.pollEnded = batteryIndex(batteryManager->getCurrentBattery());
+      peer.deliver();
+    }
+
+    batteryManager->loop();
+
+    if(peer.client) {
+      report.pollStarted = batteryIndex(batteryManager->getCurrentBattery());
+    }
+
+    report.sent = messages.size();
+
+    if((write(out, &report, sizeof(report)) != sizeof(report)) ||
+       (messages.size() && (write(out, messages.data(), messages.size() * sizeof(wireMessage_t)) !=
+                            (ssize_t)(messages.size() * sizeof(wireMessage_t))))) {
+      _exit(1);
+    }
+  }
+
+  _exit(0);
+}
+
+static bool startGateway(gateway_t *gateways, int gateway, bool verbose)
+{
+  int toGateway[2];
+  int fromGateway[2];
+  pid_t pid;
+
+  if((pipe(toGateway) != 0) || (pipe(fromGateway) != 0)) {
+    return false;
+  }
+
+  fflush(stdout);
+
+  if((pid = fork()) == 0) {
+    for(int i = 0; i < TOTAL_GATEWAYS; i++) {
+      if(gateways[i].running) {
+        close(gateways[i].toGateway);
+        close(gateways[i].fromGateway);
+      }
+    }
+
+    close(toGateway[1]);
+    close(fromGateway[0]);
+
+    if(!verbose) {
+      Serial.setOutput(NULL);
+    }
+
+    runGateway(gateway, toGateway[0], fromGateway[1]);
+  }
+
+  close(toGateway[0]);
+  close(fromGateway[1]);
+
+  if(pid < 0) {
+    return false;
+  }
+
+  gateways[gateway].pid = pid;
+  gateways[gateway].toGateway = toGateway[1];
+  gateways[gateway].fromGateway = fromGateway[0];
+  gateways[gateway].running = true;
+
+  return true;
+}
+
+static void stopGateway(gateway_t *gateway)
+{
+  kill(gateway->pid, SIGKILL);
+  waitpid(gateway->pid, NULL, 0);
+  close(gateway->toGateway);
+  close(gateway->fromGateway);
+  gateway->running = false;
+}
+
+/**
+ * Which gateway should be polling the battery, out of those still around
+ */
+static int bestGateway(int battery, const bool *around)
+{
+  int best = -1;
+
+  for(int i = 0; i < TOTAL_GATEWAYS; i++) {
+    if(around[i] && ((best < 0) || (rssi[battery][i] > rssi[battery][best]))) {
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Checks every battery was polled in [from, to) only by the gateway that
+ * should have it
+ */
+static void checkOwners(std::vector<poll_t> &polls, uint32_t from, uint32_t to, const bool *around, const char *when)
+{
+  char what[128];
+  int polled[TOTAL_BATTERIES][TOTAL_GATEWAYS] = {};
+  int best;
+  bool only;
+
+  for(auto &poll : polls) {
+    if((poll.start >= from) && (poll.start < to)) {
+      polled[poll.battery][poll.gateway]++;
+    }
+  }
+
+  for(int battery = 0; battery < TOTAL_BATTERIES; battery++) {
+    best = bestGateway(battery, around);
+    only = true;
+
+    for(int i = 0; i < TOTAL_GATEWAYS; i++) {
+      if((i != best) && polled[battery][i]) {
+        only = false;
+      }
+    }
+
+    snprintf(what, sizeof(what), "%s, battery %d polled only by %s (%d polls)", when, battery, gatewayNames[best],
+             polled[battery][best]);
+    check(only && polled[battery][best], what);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  gateway_t gateways[TOTAL_GATEWAYS];
+  std::vector<wireMessage_t> inFlight;
+  std::vector<wireMessage_t> arrived;
+  std::vector<poll_t> polls;
+  poll_t *open[TOTAL_GATEWAYS] = {};
+  bool verbose = false;
+  bool overlapping = false;
+  bool around[TOTAL_GATEWAYS];
+  uint32_t lastPartitionedPoll = 0;
+  report_t report;
+  tick_t tick;
+  char what[128];
+  int opt;
+
+  while((opt = getopt(argc, argv, "v")) != -1) {
+    switch(opt) {
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if(!startGateway(gateways, 0, verbose) || !startGateway(gateways, 1, verbose)) {
+    fprintf(stderr, "Could not start the gateways\n");
+    return 1;
+  }
+
+  polls.reserve(RUN_TIME / TICK * TOTAL_GATEWAYS);
+
+  for(uint32_t now = TICK; now <= RUN_TIME; now += TICK) {
+    if((now == JOIN_TIME) && !startGateway(gateways, 2, verbose)) {
+      fprintf(stderr, "Could not start gateway C\n");
+      return 1;
+    }
+
+    if(now == KILL_TIME) {
+      stopGateway(&gateways[0]);
+      open[0] = NULL; // it never finishes
+    }
+
+    if(now == PARTITION_TIME) {
+      gateways[1].partitioned = true;
+    }
+
+    // What the broker got last tick goes out to everyone it can reach now
+    arrived.swap(inFlight);
+    inFlight.clear();
+
+    for(int i = 0; i < TOTAL_GATEWAYS; i++) {
+      if(!gateways[i].running) {
+        continue;
+      }
+
+      tick.now = now;
+      tick.delivered = gateways[i].partitioned ? 0 : arrived.size();
+
+      if((write(gateways[i].toGateway, &tick, sizeof(tick)) != sizeof(tick)) ||
+         (tick.delivered && (write(gateways[i].toGateway, arrived.data(), arrived.size() * sizeof(wireMessage_t)) !=
+                             (ssize_t)(arrived.size() * sizeof(wireMessage_t))))) {
+        fprintf(stderr, "Gateway %s went away\n", gatewayNames[i]);
+        return 1;
+      }
+    }
+
+    for(int i = 0; i < TOTAL_GATEWAYS; i++) {
+      if(!gateways[i].running) {
+        continue;
+      }
+
+      if(!readAll(gateways[i].fromGateway, &report, sizeof(report))) {
+        fprintf(stderr, "Gateway %s went away\n", gatewayNames[i]);
+        return 1;
+      }
+
+      for(uint32_t j = 0; j < report.sent; j++) {
+        wireMessage_t message;
+
+        if(!readAll(gateways[i].fromGateway, &message, sizeof(message))) {
+          fprintf(stderr, "Gateway %s went away\n", gatewayNames[i]);
+          return 1;
+        }
+
+        if(!gateways[i].partitioned) {
+          inFlight.push_back(message);
+        }
+      }
+
+      if((report.pollEnded >= 0) && open[i]) {
+        open[i]->end = now;
+        open[i] = NULL;
+      }
+
+      if(report.pollStarted >= 0) {
+        for(int j = 0; j < TOTAL_GATEWAYS; j++) {
+          if((j != i) && open[j] && (open[j]->battery == report.pollStarted)) {
+            printf("- %s started polling battery %d at %u ms while %s was still polling it\n", gatewayNames[i],
+                   report.pollStarted, now, gatewayNames[j]);
+            overlapping = true;
+          }
+        }
+
+        polls.push_back({ i, report.pollStarted, now, 0 });
+        open[i] = &polls.back();
+
+        if(gateways[i].partitioned) {
+          lastPartitionedPoll = now;
+        }
+      }
+    }
+  }
+
+  for(int i = 0; i < TOTAL_GATEWAYS; i++) {
+    if(gateways[i].running) {
+      stopGateway(&gateways[i]);
+    }
+  }
+
+  check(!overlapping, "no battery was ever polled by two gateways at once");
+
+  around[0] = true; around[1] = true; around[2] = false;
+  checkOwners(polls, JOIN_TIME - SETTLE_TIME, JOIN_TIME, around, "A and B");
+
+  around[2] = true;
+  checkOwners(polls, JOIN_TIME + SETTLE_TIME, KILL_TIME, around, "C joined");
+
+  around[0] = false;
+  checkOwners(polls, KILL_TIME + SETTLE_TIME, PARTITION_TIME, around, "A died");
+
+  around[1] = false;
+  checkOwners(polls, PARTITION_TIME + SETTLE_TIME, RUN_TIME, around, "B cut off");
+
+  snprintf(what, sizeof(what), "B stopped polling within %u ms of being cut off (last poll at %u ms)",
+           LEASE_DURATION, lastPartitionedPoll);
+  check(lastPartitionedPoll < PARTITION_TIME + LEASE_DURATION, what);
+
+  printf("\n%zu polls, %d failures\n", polls.size(), failures);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,440 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * lifeblue-replay: feeds a capture made with CAPTURE_BLE_FRAGMENTS back through
+ * the real BatteryManager (scheduler, notification callback and decoder) on the
+ * host, as fast as it will go.
+ *
+ * Every battery address in the capture is added to the BatteryManager. Whenever
+ * the scheduler connects to a battery and subscribes, that battery's captured
+ * fragments are delivered in their original order until the callback decides it
+ * has a complete frame (and disconnects) or we run out of fragments for it.
+ *
+ * The fragments go in while the scheduler waits for them, with the virtual clock
+ * moved to the micros() each was captured at, so the estimator, the alarm holds
+ * and the printed times follow the capture rather than how fast we replay it.
+ * The clock never goes backwards, a wait the firmware takes on its own can have
+ * carried it past the capture.
+ *
+ * Usage: lifeblue-replay [-n repeat] [-p] [-s stream.bin] [-v] capture.txt
+ *
+ *   -n  replay the capture this many times (for benchmarking)
+ *   -p  print one line per decoded frame and alarm transition, diff this between parser changes
+ *   -s  write what a SERIAL_STREAM gateway would have sent to a file, for lifeblue-streamdump
+ *   -v  show the firmware's own serial output
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "BatteryManager.h"
+#include "AlarmManager.h"
+#include "SerialStream.h"
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+struct fragment_t {
+  uint64_t timestamp; // micros() when captured, unwrapped
+  std::string address;
+  std::vector<uint8_t> data;
+};
+
+struct replayBattery_t {
+  batteryInfo_t *battery;
+  std::deque<size_t> pending;
+};
+
+static std::vector<fragment_t> fragments;
+static std::vector<replayBattery_t> batteries;
+
+class ReplayPeer : public BLEHostPeer
+{
+public:
+  void subscribed(BLEClient *c, BLERemoteCharacteristic *ch) { client = c; characteristic = ch; }
+  void disconnected(BLEClient *c) { client = NULL; characteristic = NULL; }
+
+  BLEClient *client = NULL;
+  BLERemoteCharacteristic *characteristic = NULL;
+};
+
+static ReplayPeer peer;
+static replayBattery_t *polled = NULL; // delivered to by deliverFrame(), not yet counted
+static uint64_t delivered = 0, bytes = 0;
+
+static bool parseCapture(const char *path)
+{
+  FILE *fp;
+  char line[2048];
+  char address[32];
+  char hex[1600];
+  unsigned int timestamp;
+  unsigned int byte;
+  uint32_t last = 0;
+  uint64_t wraps = 0;
+  fragment_t fragment;
+
+  fp = fopen(path, "r");
+
+  if(!fp) {
+    perror(path);
+    return false;
+  }
+
+  while(fgets(line, sizeof(line), fp)) {
+    if(strncmp(line, "F ", 2) != 0) {
+      continue;
+    }
+
+    hex[0] = '\0';
+
+    if(sscanf(line, "F %u %31s %1599s", &timestamp, address, hex) < 2) {
+      continue;
+    }
+
+    // micros() wraps every 71 minutes on the ESP32
+    if(!fragments.empty() && (timestamp < last)) {
+      wraps += 0x100000000ULL;
+    }
+
+    last = timestamp;
+    fragment.timestamp = wraps + timestamp;
+    fragment.address = address;
+    fragment.data.clear();
+
+    for(size_t i = 0; (i + 1) < strlen(hex); i += 2) {
+      sscanf(&hex[i], "%2x", &byte);
+      fragment.data.push_back(byte);
+    }
+
+    fragments.push_back(fragment);
+  }
+
+  fclose(fp);
+  return true;
+}
+
+static replayBattery_t *findBattery(BLEAddress address)
+{
+  for(size_t i = 0; i < batteries.size(); i++) {
+    if(BLEAddress(batteries[i].battery->bdAddress).equals(address)) {
+      return &batteries[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void enqueueFragments()
+{
+  for(size_t i = 0; i < fragments.size(); i++) {
+    findBattery(BLEAddress(fragments[i].address))->pending.push_back(i);
+  }
+}
+
+static bool havePending()
+{
+  for(size_t i = 0; i < batteries.size(); i++) {
+    if(!batteries[i].pending.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Delivers the subscribed battery's captured fragments until it has a frame or
+ * runs out, at the time each one was captured
+ */
+static void deliverFrame()
+{
+  replayBattery_t *current = findBattery(peer.client->getPeerAddress());
+  fragment_t *fragment;
+
+  if(current->pending.empty()) {
+    peer.client->disconnect();
+    return;
+  }
+
+  current->battery->is_valid = false;
+
+  while(!current->pending.empty() && peer.characteristic) {
+    fragment = &fragments[current->pending.front()];
+    current->pending.pop_front();
+
+    if(fragment->timestamp > hostClockMicros()) {
+      hostClockSet(fragment->timestamp);
+    }
+
+    peer.characteristic->hostNotify(fragment->data.data(), fragment->data.size());
+
+    delivered++;
+    bytes += fragment->data.size();
+  }
+
+  polled = current;
+}
+
+static void deliverWhileWaiting(uint32_t)
+{
+  if(peer.characteristic) {
+    deliverFrame();
+  }
+}
+
+static void printFrame(batteryInfo_t *battery)
+{
+  printf("%lu %s V=%u I=%d Ah=%u cy=%u soc=%u t=%u st=%04x afe=%04x cells=",
+         millis(), battery->id, battery->voltage, battery->current, battery->ampHrs,
+         battery->cycleCount, battery->soc, battery->temp, battery->status, battery->afeStatus);
+
+  for(int i = 0; i < battery->totalCells; i++) {
+    printf("%s%u", i ? "," : "", battery->cells[i]);
+  }
+
+  printf("\n");
+}
+
+/**
+ * Which battery holds an extreme, "-" if it hasn't been set
+ */
+static const char *extremeId(const bankExtreme_t *extreme)
+{
+  return extreme->battery ? extreme->battery->id : "-";
+}
+
+static void printBank(BatteryManager *batteryManager)
+{
+  bankAggregates_t bank = batteryManager->getBankAggregates();
+
+  if(!bank.batteries) {
+    return;
+  }
+
+  printf("bank n=%u I=%d soc=%u V=%d..%d I=%d..%d cells=",
+         bank.batteries, bank.totalCurrent, BatteryManager::getBankSoc(&bank),
+         bank.minVoltage.value, bank.maxVoltage.value,
+         bank.minCurrent.value, bank.maxCurrent.value);
+
+  if(!bank.cellBatteries) {
+    printf("none\n");
+    return;
+  }
+
+  printf("%d(%s#%u)..%d(%s#%u)\n",
+         bank.minCell.value, extremeId(&bank.minCell), bank.minCell.cell + 1,
+         bank.maxCell.value, extremeId(&bank.maxCell), bank.maxCell.cell + 1);
+}
+
+/**
+ * Takes every queued alarm transition off the AlarmManager like the sketch does
+ * when it publishes them, returns how many there were
+ */
+static uint64_t drainAlarms(bool print)
+{
+  AlarmManager *alarmManager = AlarmManager::instance();
+  alarmEvent_t event;
+  uint64_t total = 0;
+
+  while(alarmManager->peek(&event)) {
+    if(print) {
+      printf("%lu %s alarm %s %s value=%d\n", (unsigned long)event.timestamp, event.battery->id,
+             alarmManager->getRule(event.rule)->name, event.active ? "raised" : "cleared", event.value);
+    }
+
+    alarmManager->shift();
+    total++;
+  }
+
+  return total;
+}
+
+int main(int argc, char **argv)
+{
+  BatteryManager *batteryManager;
+  replayBattery_t *current;
+  int opt;
+  int repeat = 1;
+  bool printFrames = false;
+  bool verbose = false;
+  const char *streamPath = NULL;
+  HardwareSerial streamPort;
+  FILE *stream = NULL;
+  uint64_t polls = 0, decoded = 0, rejected = 0, incomplete = 0, alarms = 0;
+  uint64_t checksumRejects = 0, resyncs = 0;
+
+  while((opt = getopt(argc, argv, "n:ps:v")) != -1) {
+    switch(opt) {
+      case 'n':
+        repeat = atoi(optarg);
+        break;
+      case 'p':
+        printFrames = true;
+        break;
+      case 's':
+        streamPath = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n repeat] [-p] [-s stream.bin] [-v] capture.txt\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if((optind >= argc) || !parseCapture(argv[optind])) {
+    fprintf(stderr, "Usage: %s [-n repeat] [-p] [-s stream.bin] [-v] capture.txt\n", argv[0]);
+    return 1;
+  }
+
+  if(streamPath) {
+    if(!(stream = fopen(streamPath, "wb"))) {
+      perror(streamPath);
+      return 1;
+    }
+
+    streamPort.setOutput(stream);
+    TelemetryPipeline::instance()->addSink(new SerialSink(streamPort));
+  }
+
+  if(!verbose) {
+    Serial.setOutput(NULL);
+  }
+
+  hostSetBLEPeer(&peer);
+  hostSetIdle(deliverWhileWaiting);
+
+  // One battery per distinct address, in order of first appearance
+  std::vector<std::string> addresses;
+
+  for(size_t i = 0; i < fragments.size(); i++) {
+    bool seen = false;
+
+    for(size_t j = 0; j < addresses.size(); j++) {
+      seen = seen || (addresses[j] == fragments[i].address);
+    }
+
+    if(!seen) {
+      addresses.push_back(fragments[i].address);
+    }
+  }
+
+  if(addresses.empty() || (addresses.size() > MAX_BATTERIES)) {
+    fprintf(stderr, "Capture has %zu batteries, need between 1 and %u\n", addresses.size(), MAX_BATTERIES);
+    return 1;
+  }
+
+  batteryManager = BatteryManager::instance(addresses.size());
+
+  for(size_t i = 0; i < addresses.size(); i++) {
+    BLEAdvertisedDevice device(BLEAddress(addresses[i]), "replay\n", 0);
+    batteryManager->addBattery(&device);
+  }
+
+  for(uint16_t i = 0; i < batteryManager->getTotalBatteries(); i++) {
+    replayBattery_t rb;
+
+    rb.battery = batteryManager->getBattery(i);
+    batteries.push_back(rb);
+  }
+
+  auto started = std::chrono::steady_clock::now();
+
+  for(int pass = 0; pass < repeat; pass++) {
+
+    enqueueFragments();
+
+    while(havePending()) {
+
+      batteryManager->loop();
+
+      // Normally delivered while the scheduler waited, unless it didn't have to
+      if(peer.characteristic) {
+        deliverFrame();
+      }
+
+      if(!polled) {
+        continue;
+      }
+
+      current = polled;
+      polled = NULL;
+      polls++;
+
+      if(peer.client) {
+        // Ran out of captured fragments before the frame was complete
+        incomplete++;
+        peer.client->disconnect();
+        continue;
+      }
+
+      if(current->battery->is_valid) {
+        decoded++;
+
+        if(printFrames) {
+          printFrame(current->battery);
+        }
+
+        alarms += drainAlarms(printFrames);
+
+        while(TelemetryPipeline::instance()->hasPending()) {
+          TelemetryPipeline::instance()->loop();
+        }
+      } else {
+        rejected++;
+      }
+    }
+  }
+
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  for(size_t i = 0; i < batteries.size(); i++) {
+    checksumRejects += batteries[i].battery->metrics.checksumRejects;
+    resyncs += batteries[i].battery->metrics.resyncs;
+  }
+
+  if(printFrames) {
+    printBank(batteryManager);
+  }
+
+  if(stream) {
+    fclose(stream);
+  }
+
+  fprintf(stderr, "batteries:  %zu\n", batteries.size());
+  fprintf(stderr, "fragments:  %llu (%llu bytes)\n", (unsigned long long)delivered, (unsigned long long)bytes);
+  fprintf(stderr, "polls:      %llu\n", (unsigned long long)polls);
+  fprintf(stderr, "decoded:    %llu\n", (unsigned long long)decoded);
+  fprintf(stderr, "rejected:   %llu\n", (unsigned long long)rejected);
+  fprintf(stderr, "incomplete: %llu\n", (unsigned long long)incomplete);
+  fprintf(stderr, "bad frames: %llu checksum, %llu resynced\n", (unsigned long long)checksumRejects, (unsigned long long)resyncs);
+  fprintf(stderr, "alarms:     %llu\n", (unsigned long long)alarms);
+  fprintf(stderr, "elapsed:    %.3fs (%.0f fragments/s, %.0f frames/s)\n", elapsed,
+          elapsed > 0 ? delivered / elapsed : 0, elapsed > 0 ? (decoded + rejected) / elapsed : 0);
+
+  return 0;
+}
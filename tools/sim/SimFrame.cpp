@@ -0,0 +1,86 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "SimFrame.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+/**
+ * Values go out as hex text, least significant byte first
+ */
+static void putHex(std::string &out, uint32_t value, int bytes)
+{
+  char hex[3];
+
+  for(int i = 0; i < bytes; i++) {
+    snprintf(hex, sizeof(hex), "%02X", (value >> (8 * i)) & 0xff);
+    out += hex;
+  }
+}
+
+std::vector<uint8_t> simBuildFrame(const simFrame_t &frame, bool corrupt)
+{
+  std::vector<uint8_t> out;
+  std::string body;
+  uint32_t sum = 0;
+  char checksum[5];
+
+  putHex(body, frame.voltage, 4);
+  putHex(body, (uint32_t)frame.current, 4);
+  putHex(body, frame.ampHrs, 4);
+  putHex(body, frame.cycles, 2);
+  putHex(body, frame.soc, 2);
+  putHex(body, (uint16_t)(frame.temp + 2731), 2);
+  putHex(body, frame.status, 2);
+  putHex(body, frame.afeStatus, 2);
+
+  for(int i = 0; (i < frame.frameCells) && (i < SIM_FRAME_CELLS); i++) {
+    putHex(body, (i < frame.totalCells) ? frame.cells[i] : 0, 2);
+  }
+
+  for(size_t i = 0; i < body.length(); i += 2) {
+    sum += strtoul(body.substr(i, 2).c_str(), NULL, 16);
+  }
+
+  snprintf(checksum, sizeof(checksum), "%04X", (sum + (corrupt ? 1 : 0)) & 0xffff);
+  body += checksum;
+
+  out.push_back(0x87);
+  out.insert(out.end(), body.begin(), body.end());
+  out.push_back(0x29);
+
+  return out;
+}
+
+std::vector<std::vector<uint8_t> > simFragment(const std::vector<uint8_t> &stream, size_t size)
+{
+  std::vector<std::vector<uint8_t> > fragments;
+
+  for(size_t i = 0; i < stream.size(); i += size) {
+    fragments.push_back(std::vector<uint8_t>(stream.begin() + i, stream.begin() + std::min(stream.size(), i + size)));
+  }
+
+  return fragments;
+}
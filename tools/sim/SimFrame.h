@@ -0,0 +1,58 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * Builds battery frames for the host tools, in the same format the batteries
+ * send them (see BatteryManager::processBuffer()), so the tools can drive the
+ * real decoder without needing a capture.
+ */
+
+#ifndef SIM_FRAME_H_
+#define SIM_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define SIM_FRAME_CELLS 16
+
+struct simFrame_t {
+  uint32_t voltage = 13300; // mV
+  int32_t current = -1500; // mA
+  uint32_t ampHrs = 80000; // mAh
+  uint16_t cycles = 12;
+  uint16_t soc = 87; // %
+  int16_t temp = 200; // tenths of a degree C
+  uint16_t status = 0;
+  uint16_t afeStatus = 0;
+  uint8_t totalCells = 4;
+  uint8_t frameCells = SIM_FRAME_CELLS; // cell slots in the frame, the ones past totalCells are sent as 0
+  uint16_t cells[SIM_FRAME_CELLS] = { 3325, 3326, 3324, 3325, 3325, 3326, 3324, 3325 };
+};
+
+// 0x87, the hex payload and checksum, then 0x29
+std::vector<uint8_t> simBuildFrame(const simFrame_t &, bool corrupt = false);
+
+// Splits a byte stream into notification sized fragments
+std::vector<std::vector<uint8_t> > simFragment(const std::vector<uint8_t> &, size_t);
+
+#endif
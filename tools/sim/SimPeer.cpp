@@ -0,0 +1,88 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+#include "SimPeer.h"
+
+/**
+ * Sends the subscribed battery its frame, then disconnects it like a poll that
+ * timed out would if the frame wasn't taken. Like a real battery we join the
+ * stream part way through a frame, and badFrames / truncate put bad frames
+ * ahead of the good one, and dropFragment loses one notification on the way.
+ * Fragments are as big as the MTU the battery agreed to. Returns false if nothing
+ * is subscribed.
+ */
+bool SimPeer::connect(BLEClient *, BLEAddress)
+{
+  hostClockAdvance(connectTime);
+
+  return !refuseConnect;
+}
+
+bool SimPeer::deliver()
+{
+  const simFrame_t &battery = frames[client ? client->getPeerAddress().toString() : ""];
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> frame;
+  std::vector<uint8_t> bad;
+  int16_t fragments = 0;
+
+  if(!characteristic) {
+    return false;
+  }
+
+  frame = simBuildFrame(battery);
+
+  stream.insert(stream.end(), frame.begin() + 7, frame.end());
+
+  if(truncate) {
+    stream.insert(stream.end(), frame.begin(), frame.begin() + (frame.size() / 2));
+  }
+
+  for(int i = 0; i < badFrames; i++) {
+    bad = simBuildFrame(battery, true);
+    stream.insert(stream.end(), bad.begin(), bad.end());
+  }
+
+  stream.insert(stream.end(), frame.begin(), frame.end());
+
+  // A notification carries the MTU less the 3 byte ATT header
+  for(auto &fragment : simFragment(stream, client->getMTU() - 3)) {
+    if(!characteristic) {
+      break;
+    }
+
+    hostClockAdvance(notifyInterval);
+
+    if(fragments++ == dropFragment) {
+      continue;
+    }
+
+    characteristic->hostNotify(fragment.data(), fragment.size());
+    notifications++;
+  }
+
+  if(client) {
+    client->disconnect();
+  }
+
+  return true;
+}
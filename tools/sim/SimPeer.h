@@ -0,0 +1,63 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+/**
+ * A BLE peer for the host tools that answers every poll with a simulated frame
+ * for whichever battery the scheduler connected to.
+ */
+
+#ifndef SIM_PEER_H_
+#define SIM_PEER_H_
+
+#include "BLEDevice.h"
+#include "SimFrame.h"
+
+#include <map>
+#include <string>
+
+class SimPeer : public BLEHostPeer
+{
+public:
+  bool connect(BLEClient *, BLEAddress);
+  void subscribed(BLEClient *c, BLERemoteCharacteristic *ch) { client = c; characteristic = ch; }
+  void disconnected(BLEClient *c) { client = NULL; characteristic = NULL; }
+  uint16_t mtu(BLEClient *, uint16_t requested) { return (requested < maxMtu) ? requested : maxMtu; }
+  bool connParams(esp_ble_conn_update_params_t *) { return !refuseParams; }
+
+  bool deliver();
+
+  std::map<std::string, simFrame_t> frames; // by address, batteries without one get the defaults
+  uint8_t badFrames = 0; // frames with a bad checksum sent ahead of the good one
+  bool truncate = false; // send the first half of a frame ahead of the rest, like fragments were lost
+  int16_t dropFragment = -1; // lose this notification (by number, from 0) of the next delivery
+  bool refuseConnect = false; // fail connects, like a battery out of range
+  uint16_t maxMtu = 23; // largest ATT MTU the batteries agree to
+  bool refuseParams = false; // turn down connection parameter updates
+  uint32_t notifications = 0; // sent since this was created
+  uint32_t connectTime = 0; // us a connect takes on the virtual clock
+  uint32_t notifyInterval = 0; // us on the virtual clock before each notification
+
+  BLEClient *client = NULL;
+  BLERemoteCharacteristic *characteristic = NULL;
+};
+
+#endif
@@ -0,0 +1,47 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifndef SKETCH_ADAFRUIT_GFX_H_
+#define SKETCH_ADAFRUIT_GFX_H_
+
+#include <Arduino.h>
+
+#define WHITE 1
+#define BLACK 0
+
+class Adafruit_GFX : public Print
+{
+public:
+  size_t write(uint8_t);
+
+  void setTextSize(uint8_t);
+  void setTextColor(uint16_t);
+  void setCursor(int16_t, int16_t);
+  void cp437(bool);
+  void drawBitmap(int16_t, int16_t, const uint8_t *, int16_t, int16_t, uint16_t);
+  void fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t);
+  void drawRect(int16_t, int16_t, int16_t, int16_t, uint16_t);
+  void drawLine(int16_t, int16_t, int16_t, int16_t, uint16_t);
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * The host stand-in plus the parts of the ESP32 core only the sketch uses.
+ * Declarations only, for make sketchcheck.
+ */
+
+#ifndef SKETCH_ARDUINO_H_
+#define SKETCH_ARDUINO_H_
+
+#include_next <Arduino.h>
+
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define RTC_DATA_ATTR
+
+class String : public std::string
+{
+public:
+  String();
+  String(const char *);
+  String(int, unsigned char = 10);
+  String(unsigned int, unsigned char = 10);
+  String(long, unsigned char = 10);
+  String(unsigned long, unsigned char = 10);
+
+  String &operator+=(const String &);
+  String &operator+=(const char *);
+};
+
+String operator+(const String &, const String &);
+String operator+(const String &, const char *);
+String operator+(const char *, const String &);
+
+typedef struct hw_timer_s hw_timer_t;
+
+hw_timer_t *timerBegin(uint8_t, uint16_t, bool);
+void timerAttachInterrupt(hw_timer_t *, void (*)(), bool);
+void timerAlarmWrite(hw_timer_t *, uint64_t, bool);
+void timerAlarmEnable(hw_timer_t *);
+void timerAlarmDisable(hw_timer_t *);
+
+typedef void (*TaskFunction_t)(void *);
+typedef void *TaskHandle_t;
+
+BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * Declarations only, enough of ArduinoJson for the sketch to get through
+ * make sketchcheck. Nothing here is ever linked or run.
+ */
+
+#ifndef SKETCH_ARDUINOJSON_H_
+#define SKETCH_ARDUINOJSON_H_
+
+#include <stddef.h>
+#include <Arduino.h>
+
+#define JSON_OBJECT_SIZE(n) ((n) * 16)
+#define JSON_ARRAY_SIZE(n) ((n) * 16)
+
+class JsonVariant
+{
+public:
+  template<typename T> JsonVariant &operator=(const T &);
+  template<typename T> operator T() const;
+  template<typename T> T operator|(const T &) const;
+  const char *operator|(const char *) const;
+  template<typename T> bool is() const;
+  template<typename T> bool add(const T &);
+
+  JsonVariant operator[](const char *) const;
+  JsonVariant operator[](int) const;
+
+  JsonVariant createNestedObject(const char *);
+  JsonVariant createNestedArray(const char *);
+  JsonVariant createNestedObject();
+  JsonVariant createNestedArray();
+
+  bool isNull() const;
+};
+
+typedef JsonVariant JsonObject;
+typedef JsonVariant JsonArray;
+
+class JsonDocument : public JsonVariant
+{
+public:
+  void clear();
+};
+
+class DynamicJsonDocument : public JsonDocument
+{
+public:
+  DynamicJsonDocument(size_t);
+};
+
+class DeserializationError
+{
+public:
+  operator bool() const;
+  const char *c_str() const;
+};
+
+DeserializationError deserializeJson(JsonDocument &, const byte *, size_t);
+DeserializationError deserializeJson(JsonDocument &, const char *);
+size_t serializeJson(const JsonVariant &, char *, size_t);
+template<size_t N> size_t serializeJson(const JsonVariant &, char (&)[N]);
+size_t measureJson(const JsonVariant &);
+
+#endif
@@ -0,0 +1,54 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * The host stand-in plus scanning, which only the sketch does. Declarations
+ * only, for make sketchcheck.
+ */
+
+#ifndef SKETCH_BLEDEVICE_H_
+#define SKETCH_BLEDEVICE_H_
+
+#include_next <BLEDevice.h>
+
+class BLEAdvertisedDeviceCallbacks
+{
+public:
+  virtual ~BLEAdvertisedDeviceCallbacks() {}
+  virtual void onResult(BLEAdvertisedDevice) = 0;
+};
+
+class BLEScan
+{
+public:
+  void setAdvertisedDeviceCallbacks(BLEAdvertisedDeviceCallbacks *, bool = false, bool = true);
+  void setInterval(uint16_t);
+  void setWindow(uint16_t);
+  void setActiveScan(bool);
+  bool start(uint32_t, void (*)(BLEScanResults), bool = false);
+  BLEScanResults start(uint32_t, bool = false);
+  void stop();
+  void clearResults();
+};
+
+#endif
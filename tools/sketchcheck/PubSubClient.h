@@ -0,0 +1,59 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * Declarations only, see ArduinoJson.h
+ */
+
+#ifndef SKETCH_PUBSUBCLIENT_H_
+#define SKETCH_PUBSUBCLIENT_H_
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+class PubSubClient
+{
+public:
+  PubSubClient(Client &);
+
+  PubSubClient &setServer(const char *, uint16_t);
+  PubSubClient &setCallback(void (*)(char *, byte *, unsigned int));
+  bool setBufferSize(uint16_t);
+
+  bool connect(const char *);
+  bool connect(const char *, const char *, const char *);
+  bool connect(const char *, const char *, uint8_t, bool, const char *);
+  bool connect(const char *, const char *, const char *, const char *, uint8_t, bool, const char *);
+  void disconnect();
+  bool connected();
+  bool loop();
+  int state();
+
+  bool publish(const char *, const char *);
+  bool publish(const char *, const char *, bool);
+  bool publish(const char *, const uint8_t *, unsigned int, bool);
+  bool subscribe(const char *);
+  bool subscribe(const char *, uint8_t);
+};
+
+#endif
@@ -0,0 +1,66 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * The host stand-in plus the WiFi object, declarations only for make sketchcheck
+ */
+
+#ifndef SKETCH_WIFI_H_
+#define SKETCH_WIFI_H_
+
+#include <Arduino.h>
+#include_next <WiFi.h>
+
+typedef WiFiClient Client;
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_CONNECTED = 3,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum {
+  WIFI_OFF = 0,
+  WIFI_STA = 1
+} wifi_mode_t;
+
+class IPAddress
+{
+public:
+  String toString() const;
+};
+
+class WiFiClass
+{
+public:
+  wl_status_t begin(const char *, const char *);
+  wl_status_t status();
+  bool mode(wifi_mode_t);
+  bool disconnect(bool = false, bool = false);
+  IPAddress localIP();
+  int8_t RSSI();
+};
+
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+#
+# Does what the Arduino builder does to a sketch before it's compiled: a
+# prototype for every function is put ahead of the first one, so they can be
+# called before they're defined. Writes the result to stdout with #line
+# markers, so errors point back at the .ino.
+#
+# Usage: prototypes.py sketch.ino > sketch.cpp
+#
+# Only handles what the sketch uses, one line signatures at the start of a
+# line with the { on the same line or the next.
+#
+
+import re
+import sys
+
+KEYWORDS = ('if', 'for', 'while', 'switch', 'return', 'else', 'class', 'struct', 'enum', 'typedef', 'do')
+SIGNATURE = re.compile(r'^([A-Za-z_][\w\s\*&:<>,]*?[\s\*&])(\w+)\s*\(([^;{}]*)\)\s*(\{\s*)?$')
+
+path = sys.argv[1]
+lines = open(path).read().split('\n')
+
+prototypes = []
+first = None
+depth = 0
+
+for i, line in enumerate(lines):
+    if depth == 0:
+        match = SIGNATURE.match(line)
+
+        if match and match.group(1).split()[0] not in KEYWORDS:
+            following = match.group(4) or (i + 1 < len(lines) and lines[i + 1].strip() == '{')
+
+            if following:
+                prototypes.append('%s%s(%s);' % (match.group(1), match.group(2), match.group(3)))
+
+                if first is None:
+                    first = i
+
+    code = re.sub(r'"(\\.|[^"\\])*"|\'(\\.|[^\'\\])*\'|//.*$', '', line)
+    depth += code.count('{') - code.count('}')
+
+if first is None:
+    first = len(lines)
+
+out = sys.stdout
+out.write('#line 1 "%s"\n' % path)
+out.write('\n'.join(lines[:first]) + '\n')
+out.write('\n'.join(prototypes) + '\n')
+out.write('#line %d "%s"\n' % (first + 1, path))
+out.write('\n'.join(lines[first:]))
@@ -0,0 +1,549 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * lifeblue-soak: runs the real BatteryManager, alarms and telemetry pipeline
+ * through a long stretch of simulated polls with faults thrown in, to turn up
+ * the slow problems (the heap creeping up, polls getting slower, the scheduler
+ * wedging) before a gateway in the field does. Run it before every release.
+ *
+ * The bank is a SimPeer, connects take SOAK_CONNECT_TIME and the frame arrives a
+ * notification every SOAK_NOTIFY_INTERVAL while the scheduler waits for it, so the
+ * firmware's own poll stage histograms mean something. MQTT is a sink that formats and "publishes" each frame
+ * like the sketch's MqttSink, to a broker that drops off now and then and takes
+ * the alarms with it. /metrics is scraped through the real MetricsServer. It all
+ * runs on the virtual clock, a million polls is weeks of gateway time.
+ *
+ * Each poll can have any of these injected: the connect failing, a notification
+ * going missing, a bad checksum frame ahead of the good one, and the broker
+ * going away for a while.
+ *
+ * Every interval a line is printed with the polls so far, the virtual time,
+ * polls a second (real time), the p50 / p99 of a whole poll over the interval
+ * from the firmware's own POLL_STAGE_TOTAL histograms (virtual time, so bucket
+ * bounds), the heap in use and how much it has grown since the end of the first
+ * interval, which is the warm up (history and render buffers fill up, the
+ * batteries' state is allocated). At the end each poll stage's histogram is
+ * summed over the bank and printed.
+ *
+ * Usage: lifeblue-soak [-n polls] [-i interval] [-b batteries] [-f percent] [-g bytes] [-r seed] [-v]
+ *
+ *   -n  polls to run (default 1000000)
+ *   -i  polls between reports (default 100000)
+ *   -b  batteries in the bank (default 8)
+ *   -f  chance of each BLE fault on a poll in percent (default 2), the broker drops off at a tenth of that
+ *       and is away SOAK_BROKER_DOWN percent of the time
+ *   -g  heap growth allowed after the warm up, in bytes (default 4096)
+ *   -r  seed for the faults (default 1), the same seed gives the same run
+ *   -v  show the firmware's own serial output
+ *
+ * Exits non-zero if the heap grows by more than -g after the warm up, a BLE
+ * client is leaked, a battery goes a whole interval without a good frame, the
+ * median poll ends up more than SOAK_SLOWDOWN times slower than in the warm up,
+ * or the MQTT sink drops a bigger share of frames than the broker was away for
+ * (plus SOAK_MQTT_DROP_MARGIN).
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "WiFi.h"
+#include "esp_heap_caps.h"
+#include "BatteryManager.h"
+#include "AlarmManager.h"
+#include "HistoryStore.h"
+#include "MetricsServer.h"
+#include "TelemetryPipeline.h"
+#include "../sim/SimPeer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#define SOAK_SCRAPE_EVERY 1000 // polls between /metrics scrapes
+#define SOAK_ALARM_PERIOD 5000 // polls a battery's high cell alarm stays raised, then cleared
+#define SOAK_BROKER_DOWN 15 // percent of the time the broker is away, outages last as long as it takes
+#define SOAK_MQTT_DROP_MARGIN 2 // percent of frames MQTT can drop over and above the broker's time away
+#define SOAK_CONNECT_TIME 150000 // us a connect takes on the virtual clock
+#define SOAK_NOTIFY_INTERVAL 15000 // us between notifications, one connection interval
+#define SOAK_SLOWDOWN 3 // the median poll can get this many times slower than the warm up before it fails
+
+static SimPeer peer;
+static uint32_t seed = 1;
+static bool brokerUp = true;
+static int failures = 0;
+
+struct soakCounts_t {
+  uint64_t connectFaults;
+  uint64_t dropFaults;
+  uint64_t checksumFaults;
+  uint64_t brokerOutages;
+  uint64_t brokerDownPolls;
+  uint64_t published;
+  uint64_t publishedBytes;
+  uint64_t alarms;
+  uint64_t alarmResyncs;
+  uint64_t scrapes;
+};
+
+static soakCounts_t counts = {};
+
+/**
+ * xorshift32, so a seed always gives the same run whatever the C library
+ */
+static uint32_t nextRandom()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static bool chance(double percent)
+{
+  return (nextRandom() % 1000000) < (uint32_t)(percent * 10000);
+}
+
+static std::string batteryAddress(int i)
+{
+  char address[18];
+
+  snprintf(address, sizeof(address), "c8:fd:19:00:%02x:%02x", (i >> 8) & 0xff, i & 0xff);
+
+  return address;
+}
+
+/**
+ * Stands in for the sketch's MqttSink: held back while the broker is away,
+ * deadbands checked, the payload built in a buffer of its own for every publish
+ */
+class SoakMqttSink : public TelemetrySink
+{
+
+public:
+  SoakMqttSink() : TelemetrySink("mqtt", SINK_LATEST, MQTT_SINK_QUEUE_SIZE) {};
+
+protected:
+  bool write(const telemetrySnapshot_t *snapshot)
+  {
+    BatteryManager *batteryManager = BatteryManager::instance();
+    char *payload;
+    int length;
+
+    if(!brokerUp) {
+      return false;
+    }
+
+    if(!batteryManager->needsPublish(snapshot)) {
+      return true;
+    }
+
+    payload = (char *)malloc(512);
+
+    length = snprintf(payload, 512, "{\"battery_id\":\"%s\",\"voltage\":%u,\"current\":%d,\"soc\":%u,\"temp\":%d,"
+                                    "\"alarms\":%u,\"time_to_empty\":%u,\"cells\":[%u,%u,%u,%u]}",
+                      snapshot->battery->address, snapshot->voltage, snapshot->current, snapshot->soc,
+                      (int16_t)snapshot->temp, snapshot->alarms, snapshot->timeToEmpty,
+                      snapshot->cells[0], snapshot->cells[1], snapshot->cells[2], snapshot->cells[3]);
+
+    counts.published++;
+    counts.publishedBytes += length;
+
+    free(payload);
+
+    batteryManager->markPublished(snapshot);
+
+    return true;
+  }
+};
+
+/**
+ * What the sketch's publishAlarms() does with the alarm queue, when the broker
+ * is there to take them
+ */
+static void drainAlarms()
+{
+  AlarmManager *alarmManager = AlarmManager::instance();
+  alarmEvent_t event;
+
+  if(!brokerUp) {
+    return;
+  }
+
+  if(alarmManager->needsResync()) {
+    alarmManager->clearResync();
+    counts.alarmResyncs++;
+  }
+
+  while(alarmManager->peek(&event)) {
+    alarmManager->shift();
+    counts.alarms++;
+  }
+}
+
+/**
+ * One scrape over the loopback interface, see httpcheck
+ */
+static void scrape(uint16_t port)
+{
+  WiFiClient client;
+  std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\nUser-Agent: lifeblue-soak\r\n\r\n";
+  uint8_t buffer[4096];
+
+  if(!client.connect("127.0.0.1", port)) {
+    return;
+  }
+
+  client.write((const uint8_t *)request.data(), request.length());
+
+  MetricsServer::instance()->loop();
+
+  while(client.read(buffer, sizeof(buffer)) > 0);
+
+  client.stop();
+
+  counts.scrapes++;
+}
+
+/**
+ * Decides what goes wrong with this poll and sets the bank up for it
+ */
+static void injectFaults(double percent, int batteries, uint64_t poll)
+{
+  peer.refuseConnect = chance(percent);
+  peer.badFrames = chance(percent) ? 1 : 0;
+  peer.dropFragment = chance(percent) ? (nextRandom() % 8) : -1;
+
+  counts.connectFaults += peer.refuseConnect;
+  counts.checksumFaults += peer.badFrames;
+  counts.dropFaults += (peer.dropFragment >= 0);
+
+  // Outages start at a tenth of the BLE fault rate and come back at whatever rate
+  // leaves the broker away SOAK_BROKER_DOWN percent of the time
+  if(!brokerUp) {
+    brokerUp = chance(std::min(100.0, (percent / 10) * (100 - SOAK_BROKER_DOWN) / SOAK_BROKER_DOWN));
+  } else if(chance(percent / 10)) {
+    brokerUp = false;
+    counts.brokerOutages++;
+  }
+
+  counts.brokerDownPolls += !brokerUp;
+
+  // Each battery's high cell alarm is raised and cleared in turn
+  for(int i = 0; i < batteries; i++) {
+    peer.frames[batteryAddress(i)].cells[1] = (((poll / SOAK_ALARM_PERIOD) + i) % batteries == 0) ? 3700 : 3326;
+  }
+}
+
+/**
+ * The firmware is waiting for the frame, it turns up while it waits
+ */
+static void deliverWhileWaiting(uint32_t)
+{
+  if(peer.characteristic) {
+    peer.deliver();
+  }
+}
+
+/**
+ * Runs the scheduler until it has polled a battery (a refused connect costs it a
+ * go). The frame is normally delivered while the scheduler waits for it, if it
+ * didn't wait (an alarm was already queued) it's delivered now. Then the
+ * pipeline and alarms catch up.
+ */
+static void pollOnce()
+{
+  BatteryManager *batteryManager = BatteryManager::instance();
+  uint32_t notifications = peer.notifications;
+
+  for(int attempts = 0; (attempts < 10) && !peer.characteristic && (peer.notifications == notifications); attempts++) {
+    batteryManager->loop();
+    peer.refuseConnect = false; // it's back in range for the retry
+  }
+
+  if(peer.characteristic) {
+    peer.deliver();
+  }
+
+  TelemetryPipeline::instance()->loop();
+  drainAlarms();
+}
+
+/**
+ * One poll stage's histogram summed over the whole bank, like /metrics does it
+ */
+static void combineStage(pollStage_t stage, int batteries, histogram_t *combined)
+{
+  histogram_t *histogram;
+
+  memset(combined, 0, sizeof(histogram_t));
+
+  for(int i = 0; i < batteries; i++) {
+    histogram = &BatteryManager::instance()->getBattery(i)->metrics.stages[stage];
+
+    for(int b = 0; b <= METRICS_HISTOGRAM_BOUNDS; b++) {
+      combined->buckets[b] += histogram->buckets[b];
+    }
+
+    combined->count += histogram->count;
+    combined->sum += histogram->sum;
+    combined->max = std::max(combined->max, histogram->max);
+  }
+}
+
+/**
+ * The bound of the bucket the percentile lands in, in us. Anything past the last
+ * bound (or a bound past the biggest value seen) is reported as the max.
+ */
+static uint32_t histogramPercentile(const histogram_t *histogram, double percent)
+{
+  uint64_t target = (uint64_t)(histogram->count * percent / 100 + 0.5);
+  uint64_t cumulative = 0;
+
+  for(int b = 0; b < METRICS_HISTOGRAM_BOUNDS; b++) {
+    cumulative += histogram->buckets[b];
+
+    if(target && (cumulative >= target)) {
+      return std::min(metricsHistogramBounds[b], histogram->max);
+    }
+  }
+
+  return histogram->max;
+}
+
+static void check(bool condition, const char *what)
+{
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if(!condition) {
+    failures++;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  BatteryManager *batteryManager;
+  std::chrono::steady_clock::time_point started;
+  std::chrono::steady_clock::time_point windowStarted;
+  std::vector<uint32_t> decodes;
+  histogram_t total, window, previous = {};
+  uint64_t polls = 1000000;
+  uint64_t interval = 100000;
+  int batteries = 8;
+  double faults = 2;
+  size_t allowedGrowth = 4096;
+  bool verbose = false;
+  size_t baseline = 0;
+  size_t heap;
+  size_t worstGrowth = 0;
+  uint32_t p50, p99;
+  double seconds;
+  double dropRatio, downRatio;
+  uint32_t warmP50 = 0;
+  double worstSlowdown = 0;
+  bool starved = false;
+  uint16_t port;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:i:b:f:g:r:v")) != -1) {
+    switch(opt) {
+      case 'n':
+        polls = strtoull(optarg, NULL, 10);
+        break;
+      case 'i':
+        interval = strtoull(optarg, NULL, 10);
+        break;
+      case 'b':
+        batteries = atoi(optarg);
+        break;
+      case 'f':
+        faults = atof(optarg);
+        break;
+      case 'g':
+        allowedGrowth = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        seed = strtoul(optarg, NULL, 10) ? strtoul(optarg, NULL, 10) : 1;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n polls] [-i interval] [-b batteries] [-f percent] [-g bytes] [-r seed] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if((batteries < 1) || (batteries > MAX_BATTERIES) || !interval || (polls < interval * 2)) {
+    fprintf(stderr, "Need 1 to %d batteries and at least two intervals of polls\n", MAX_BATTERIES);
+    return 1;
+  }
+
+  if(!verbose) {
+    Serial.setOutput(NULL);
+  }
+
+  hostSetBLEPeer(&peer);
+  hostSetIdle(deliverWhileWaiting);
+
+  peer.connectTime = SOAK_CONNECT_TIME;
+  peer.notifyInterval = SOAK_NOTIFY_INTERVAL;
+
+  batteryManager = BatteryManager::instance(batteries);
+  TelemetryPipeline::instance()->addSink(new SoakMqttSink());
+  TelemetryPipeline::instance()->addSink(new HistorySink());
+  TelemetryPipeline::instance()->addSink(new MetricsSink());
+
+  MetricsServer::instance()->begin(0);
+  port = MetricsServer::instance()->getServer()->hostPort();
+
+  for(int i = 0; i < batteries; i++) {
+    BLEAdvertisedDevice device(BLEAddress(batteryAddress(i)), "LB soak\n", -60 - i);
+
+    peer.frames[batteryAddress(i)].current = -1000 - (i * 100);
+    batteryManager->addBattery(&device);
+  }
+
+  // Everything the harness needs is allocated up front, so it doesn't show up as growth
+  decodes.resize(batteries);
+
+  printf("%10s %8s %10s %10s %10s %10s %8s\n", "polls", "days", "polls/s", "p50 us", "p99 us", "heap", "growth");
+
+  started = windowStarted = std::chrono::steady_clock::now();
+
+  for(uint64_t poll = 1; poll <= polls; poll++) {
+    injectFaults(faults, batteries, poll);
+
+    pollOnce();
+
+    if(!(poll % SOAK_SCRAPE_EVERY)) {
+      scrape(port);
+    }
+
+    if(poll % interval) {
+      continue;
+    }
+
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - windowStarted).count();
+
+    // Just this interval's polls, the firmware's histograms are since boot
+    combineStage(POLL_STAGE_TOTAL, batteries, &total);
+    window = total;
+
+    for(int b = 0; b <= METRICS_HISTOGRAM_BOUNDS; b++) {
+      window.buckets[b] -= previous.buckets[b];
+    }
+
+    window.count -= previous.count;
+    previous = total;
+
+    p50 = histogramPercentile(&window, 50);
+    p99 = histogramPercentile(&window, 99);
+
+    heap = hostHeapUsed();
+
+    if(poll == interval) {
+      baseline = heap;
+      warmP50 = p50;
+    } else {
+      worstGrowth = std::max(worstGrowth, (heap > baseline) ? heap - baseline : 0);
+      worstSlowdown = std::max(worstSlowdown, warmP50 > 0 ? (double)p50 / warmP50 : 0);
+    }
+
+    for(int i = 0; i < batteries; i++) {
+      if(batteryManager->getBattery(i)->metrics.decodes == decodes[i]) {
+        starved = true;
+      }
+
+      decodes[i] = batteryManager->getBattery(i)->metrics.decodes;
+    }
+
+    printf("%10llu %8.1f %10.0f %10u %10u %10zu %8ld\n", (unsigned long long)poll, hostClockMicros() / 86400000000.0,
+           seconds > 0 ? interval / seconds : 0, p50, p99, heap, (long)heap - (long)baseline);
+    fflush(stdout);
+
+    windowStarted = std::chrono::steady_clock::now();
+  }
+
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  pollMetrics_t totals = {};
+
+  for(int i = 0; i < batteries; i++) {
+    pollMetrics_t *metrics = &batteryManager->getBattery(i)->metrics;
+
+    totals.polls += metrics->polls;
+    totals.decodes += metrics->decodes;
+    totals.connectFailures += metrics->connectFailures;
+    totals.checksumRejects += metrics->checksumRejects;
+    totals.resyncs += metrics->resyncs;
+    totals.timeouts += metrics->timeouts;
+  }
+
+  printf("\n");
+  printf("injected:   %llu connect failures, %llu lost notifications, %llu bad checksums, %llu broker outages\n",
+         (unsigned long long)counts.connectFaults, (unsigned long long)counts.dropFaults,
+         (unsigned long long)counts.checksumFaults, (unsigned long long)counts.brokerOutages);
+  printf("firmware:   %u polls, %u decoded, %u connect failures, %u checksum rejects, %u resyncs, %u timeouts\n",
+         totals.polls, totals.decodes, totals.connectFailures, totals.checksumRejects, totals.resyncs, totals.timeouts);
+  printf("published:  %llu (%llu bytes), %llu alarms, %llu alarm resyncs, %llu scrapes\n",
+         (unsigned long long)counts.published, (unsigned long long)counts.publishedBytes, (unsigned long long)counts.alarms,
+         (unsigned long long)counts.alarmResyncs, (unsigned long long)counts.scrapes);
+
+  for(uint8_t i = 0; i < TelemetryPipeline::instance()->getTotalSinks(); i++) {
+    TelemetrySink *sink = TelemetryPipeline::instance()->getSink(i);
+
+    printf("sink %-8s %u written, %u dropped\n", sink->getName(), sink->getWritten(), sink->getDropped());
+  }
+
+  printf("elapsed:    %.1fs (%.0f polls/s), %.1f days on the virtual clock\n", seconds,
+         seconds > 0 ? polls / seconds : 0, hostClockMicros() / 86400000000.0);
+
+  TelemetrySink *mqtt = TelemetryPipeline::instance()->getSink(0);
+
+  downRatio = (double)counts.brokerDownPolls / polls;
+  dropRatio = (mqtt->getWritten() + mqtt->getDropped()) ? (double)mqtt->getDropped() / (mqtt->getWritten() + mqtt->getDropped()) : 0;
+
+  printf("broker:     away for %.1f%% of polls, MQTT dropped %.1f%% of frames\n\n", downRatio * 100, dropRatio * 100);
+
+  printf("%-16s %10s %10s %10s %10s %10s\n", "stage (virtual)", "count", "mean us", "p50 us", "p99 us", "max us");
+
+  for(int s = 0; s < POLL_STAGE_COUNT; s++) {
+    combineStage((pollStage_t)s, batteries, &total);
+
+    printf("%-16s %10u %10llu %10u %10u %10u\n", pollStageName((pollStage_t)s), total.count,
+           (unsigned long long)(total.count ? total.sum / total.count : 0), histogramPercentile(&total, 50),
+           histogramPercentile(&total, 99), total.max);
+  }
+
+  printf("\n");
+
+  check(worstGrowth <= allowedGrowth, "heap doesn't grow after the warm up");
+  check(hostLiveBLEClients() <= 1, "no BLE clients leaked");
+  check(!starved, "every battery decoded in every interval");
+  check(worstSlowdown <= SOAK_SLOWDOWN, "polls don't get slower");
+  check(dropRatio * 100 <= (downRatio * 100) + SOAK_MQTT_DROP_MARGIN, "MQTT only drops frames while the broker is away");
+
+  return failures ? 1 : 0;
+}
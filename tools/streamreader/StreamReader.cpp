@@ -0,0 +1,248 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#include "StreamReader.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static uint16_t get16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void StreamReader::feed(const uint8_t *data, size_t length)
+{
+  size_t consumed;
+
+  pending.insert(pending.end(), data, data + length);
+
+  consumed = parse(pending.data(), pending.size());
+  pending.erase(pending.begin(), pending.begin() + consumed);
+}
+
+/**
+ * Hands out every record and run of text in data, returns how much of it was
+ * used. Whatever's left is the start of a record we don't have all of yet.
+ */
+size_t StreamReader::parse(const uint8_t *data, size_t length)
+{
+  size_t i = 0;
+  size_t text = 0; // where the text we haven't handed out yet starts
+  size_t total;
+  uint16_t payload;
+
+  while(i < length) {
+    if(data[i] != STREAM_SYNC_0) {
+      i++;
+      continue;
+    }
+
+    if(i > text) {
+      onText(&data[text], i - text);
+    }
+
+    text = i;
+
+    if((length - i) < STREAM_HEADER_LENGTH) {
+      return i;
+    }
+
+    if(data[i + 1] != STREAM_SYNC_1) {
+      skippedBytes++;
+      text = ++i;
+      continue;
+    }
+
+    payload = get16(&data[i + 3]);
+
+    if(payload > STREAM_MAX_PAYLOAD) {
+      skippedBytes += 2;
+      text = (i += 2);
+      continue;
+    }
+
+    total = STREAM_HEADER_LENGTH + payload + STREAM_CRC_LENGTH;
+
+    if((length - i) < total) {
+      return i;
+    }
+
+    if(streamCrc(0xffff, &data[i + 2], STREAM_HEADER_LENGTH - 2 + payload) != get16(&data[i + STREAM_HEADER_LENGTH + payload])) {
+      crcErrors++;
+      skippedBytes += 2;
+      text = (i += 2);
+      continue;
+    }
+
+    totalRecords++;
+
+    if(!decode(data[i + 2], &data[i + STREAM_HEADER_LENGTH], payload)) {
+      malformed++;
+    }
+
+    text = (i += total);
+  }
+
+  if(i > text) {
+    onText(&data[text], i - text);
+  }
+
+  return length;
+}
+
+bool StreamReader::decode(uint8_t type, const uint8_t *payload, uint16_t length)
+{
+  switch(type) {
+    case STREAM_RECORD_SNAPSHOT:
+      return decodeSnapshot(payload, length);
+    case STREAM_RECORD_ALARM:
+      return decodeAlarm(payload, length);
+    case STREAM_RECORD_ALARM_STATE:
+      return decodeAlarmState(payload, length);
+  }
+
+  return true; // newer firmware than us, skip it
+}
+
+bool StreamReader::decodeSnapshot(const uint8_t *p, uint16_t length)
+{
+  streamSnapshot_t snapshot;
+  uint8_t cells;
+
+  if(length < STREAM_SNAPSHOT_LENGTH(0)) {
+    return false;
+  }
+
+  cells = p[66];
+
+  if(length < STREAM_SNAPSHOT_LENGTH(cells)) {
+    return false;
+  }
+
+  memcpy(snapshot.address, p, 6);
+  snapshot.timestamp = get32(&p[6]);
+  snapshot.decodes = get32(&p[10]);
+  snapshot.flags = p[14];
+  snapshot.rssi = (int8_t)p[15];
+  snapshot.voltage = get32(&p[16]);
+  snapshot.current = (int32_t)get32(&p[20]);
+  snapshot.ampHrs = get32(&p[24]);
+  snapshot.cycleCount = get16(&p[28]);
+  snapshot.soc = get16(&p[30]);
+  snapshot.temp = (int16_t)get16(&p[32]);
+  snapshot.status = get16(&p[34]);
+  snapshot.afeStatus = get16(&p[36]);
+  snapshot.minCell = get16(&p[38]);
+  snapshot.maxCell = get16(&p[40]);
+  snapshot.alarms = get32(&p[42]);
+  snapshot.chargeSinceFull = (int32_t)get32(&p[46]);
+  snapshot.currentAvg = (int32_t)get32(&p[50]);
+  snapshot.powerAvg = (int32_t)get32(&p[54]);
+  snapshot.timeToEmpty = get32(&p[58]);
+  snapshot.timeToFull = get32(&p[62]);
+
+  for(uint8_t i = 0; i < cells; i++) {
+    snapshot.cells.push_back(get16(&p[67 + i * 2]));
+  }
+
+  onSnapshot(snapshot);
+  return true;
+}
+
+bool StreamReader::decodeAlarm(const uint8_t *p, uint16_t length)
+{
+  streamAlarm_t alarm;
+  uint8_t name;
+
+  if(length < STREAM_ALARM_LENGTH(0)) {
+    return false;
+  }
+
+  name = p[16];
+
+  if(length < STREAM_ALARM_LENGTH(name)) {
+    return false;
+  }
+
+  memcpy(alarm.address, p, 6);
+  alarm.timestamp = get32(&p[6]);
+  alarm.rule = p[10];
+  alarm.active = p[11];
+  alarm.value = (int32_t)get32(&p[12]);
+  alarm.name.assign((const char *)&p[17], name);
+
+  onAlarm(alarm);
+  return true;
+}
+
+bool StreamReader::decodeAlarmState(const uint8_t *p, uint16_t length)
+{
+  streamAlarmState_t state;
+
+  if(length < STREAM_ALARM_STATE_LENGTH) {
+    return false;
+  }
+
+  memcpy(state.address, p, 6);
+  state.timestamp = get32(&p[6]);
+  state.alarms = get32(&p[10]);
+
+  onAlarmState(state);
+  return true;
+}
+
+uint64_t StreamReader::getTotalRecords()
+{
+  return totalRecords;
+}
+
+uint64_t StreamReader::getCrcErrors()
+{
+  return crcErrors;
+}
+
+uint64_t StreamReader::getMalformed()
+{
+  return malformed;
+}
+
+uint64_t StreamReader::getSkippedBytes()
+{
+  return skippedBytes;
+}
+
+std::string StreamReader::formatAddress(const uint8_t *address)
+{
+  char text[18];
+
+  snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x",
+           address[0], address[1], address[2], address[3], address[4], address[5]);
+
+  return text;
+}
@@ -0,0 +1,131 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+#ifndef LIFESTREAMREADER_H_
+#define LIFESTREAMREADER_H_
+
+#include "SerialStreamFormat.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * A decoded STREAM_RECORD_SNAPSHOT, units as in SerialStreamFormat.h
+ */
+struct streamSnapshot_t {
+  uint8_t address[6];
+  uint32_t timestamp;
+  uint32_t decodes;
+  uint8_t flags;
+  int8_t rssi;
+  uint32_t voltage;
+  int32_t current;
+  uint32_t ampHrs;
+  uint16_t cycleCount;
+  uint16_t soc;
+  int16_t temp;
+  uint16_t status;
+  uint16_t afeStatus;
+  uint16_t minCell;
+  uint16_t maxCell;
+  uint32_t alarms;
+  int32_t chargeSinceFull;
+  int32_t currentAvg;
+  int32_t powerAvg;
+  uint32_t timeToEmpty;
+  uint32_t timeToFull;
+  std::vector<uint16_t> cells;
+};
+
+/**
+ * A decoded STREAM_RECORD_ALARM
+ */
+struct streamAlarm_t {
+  uint8_t address[6];
+  uint32_t timestamp;
+  uint8_t rule;
+  bool active;
+  int32_t value;
+  std::string name;
+};
+
+/**
+ * A decoded STREAM_RECORD_ALARM_STATE
+ */
+struct streamAlarmState_t {
+  uint8_t address[6];
+  uint32_t timestamp;
+  uint32_t alarms;
+};
+
+/**
+ * Picks the binary records written by SerialSink out of whatever comes off the
+ * gateway's serial port. Bytes can be fed in as they arrive, in any size pieces;
+ * a record split across two reads is held on to until the rest turns up.
+ *
+ * Anything that isn't a good record (the text log, a record with a bad CRC, a
+ * partial one from before we started listening) is skipped over a byte at a time
+ * until the next sync, so one bad byte only ever costs the record it landed in.
+ *
+ * Subclass it and override the on*() calls for the records you want. It's plain
+ * C++11 with no dependencies beyond SerialStreamFormat.h, copy both onto the host.
+ */
+class StreamReader
+{
+
+public:
+  virtual ~StreamReader() {}
+
+  void feed(const uint8_t *, size_t);
+
+  uint64_t getTotalRecords();
+  uint64_t getCrcErrors();
+  uint64_t getMalformed();
+  uint64_t getSkippedBytes();
+
+  static std::string formatAddress(const uint8_t *);
+
+protected:
+  virtual void onSnapshot(const streamSnapshot_t &) {}
+  virtual void onAlarm(const streamAlarm_t &) {}
+  virtual void onAlarmState(const streamAlarmState_t &) {}
+
+  // Bytes that weren't part of a record, normally the firmware's text log
+  virtual void onText(const uint8_t *, size_t) {}
+
+private:
+  size_t parse(const uint8_t *, size_t);
+  bool decode(uint8_t, const uint8_t *, uint16_t);
+  bool decodeSnapshot(const uint8_t *, uint16_t);
+  bool decodeAlarm(const uint8_t *, uint16_t);
+  bool decodeAlarmState(const uint8_t *, uint16_t);
+
+  std::vector<uint8_t> pending;
+
+  uint64_t totalRecords = 0;
+  uint64_t crcErrors = 0;
+  uint64_t malformed = 0; // good CRC but too short for its type
+  uint64_t skippedBytes = 0; // not text and not a good record
+};
+
+#endif
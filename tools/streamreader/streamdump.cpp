@@ -0,0 +1,131 @@
+/*
+  +----------------------------------------------------------------------+
+  | LiFeBlue Bluetooth Interface                                         |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2017-2020 Internet Technology Solutions, LLC,          |
+  +----------------------------------------------------------------------+
+  | Licensed under the Apache License, Version 2.0 (the "License");      |
+  | you may not use this file except in compliance with the License. You |
+  | may obtain a copy of the License at:                                 |
+  |                                                                      |
+  | http://www.apache.org/licenses/LICENSE-2.0                           |
+  |                                                                      |
+  | Unless required by applicable law or agreed to in writing, software  |
+  | distributed under the License is distributed on an "AS IS" BASIS,    |
+  | WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or      |
+  | implied. See the License for the specific language governing         |
+  | permissions and limitations under the License.                       |
+  +----------------------------------------------------------------------+
+  | Authors: John Coggeshall <john@thissmarthouse.com>                   |
+  +----------------------------------------------------------------------+
+*/
+
+
+/**
+ * lifeblue-streamdump: prints the records from a gateway built with SERIAL_STREAM,
+ * one line each, in the same format as lifeblue-replay -p. Reads the serial port
+ * itself or anything saved from it.
+ *
+ * Usage: lifeblue-streamdump [-t] [file]
+ *
+ *   -t  pass the firmware's text log through to stderr
+ *
+ * With no file it reads stdin. For a port, set it up first, i.e.
+ *
+ *   stty -F /dev/ttyUSB0 921600 raw && lifeblue-streamdump /dev/ttyUSB0
+ */
+
+#include "StreamReader.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+class DumpReader : public StreamReader
+{
+public:
+  bool showText = false;
+  uint64_t snapshots = 0;
+  uint64_t alarms = 0;
+  uint64_t alarmStates = 0;
+
+protected:
+  void onSnapshot(const streamSnapshot_t &snapshot)
+  {
+    printf("%u %s V=%u I=%d Ah=%u cy=%u soc=%u t=%d st=%04x afe=%04x cells=",
+           snapshot.timestamp, formatAddress(snapshot.address).c_str(), snapshot.voltage, snapshot.current,
+           snapshot.ampHrs, snapshot.cycleCount, snapshot.soc, snapshot.temp, snapshot.status, snapshot.afeStatus);
+
+    for(size_t i = 0; i < snapshot.cells.size(); i++) {
+      printf("%s%u", i ? "," : "", snapshot.cells[i]);
+    }
+
+    printf("%s\n", (snapshot.flags & STREAM_FLAG_RESTORED) ? " restored" : "");
+    snapshots++;
+  }
+
+  void onAlarm(const streamAlarm_t &alarm)
+  {
+    printf("%u %s alarm %s %s value=%d\n", alarm.timestamp, formatAddress(alarm.address).c_str(),
+           alarm.name.c_str(), alarm.active ? "raised" : "cleared", alarm.value);
+    alarms++;
+  }
+
+  void onAlarmState(const streamAlarmState_t &state)
+  {
+    printf("%u %s alarms %08x (after dropped snapshots)\n", state.timestamp, formatAddress(state.address).c_str(),
+           state.alarms);
+    alarmStates++;
+  }
+
+  void onText(const uint8_t *text, size_t length)
+  {
+    if(showText) {
+      fwrite(text, 1, length, stderr);
+    }
+  }
+};
+
+int main(int argc, char **argv)
+{
+  DumpReader reader;
+  uint8_t buffer[4096];
+  ssize_t length;
+  int fd = STDIN_FILENO;
+  int opt;
+
+  while((opt = getopt(argc, argv, "t")) != -1) {
+    switch(opt) {
+      case 't':
+        reader.showText = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t] [file]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(optind < argc) {
+    fd = open(argv[optind], O_RDONLY);
+
+    if(fd < 0) {
+      perror(argv[optind]);
+      return 1;
+    }
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0); // a line as soon as each record comes off the port
+
+  while((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    reader.feed(buffer, length);
+  }
+
+  fprintf(stderr, "records:    %llu (%llu snapshots, %llu alarms, %llu alarm states)\n",
+          (unsigned long long)reader.getTotalRecords(), (unsigned long long)reader.snapshots,
+          (unsigned long long)reader.alarms, (unsigned long long)reader.alarmStates);
+  fprintf(stderr, "bad:        %llu crc, %llu malformed, %llu bytes skipped\n", (unsigned long long)reader.getCrcErrors(),
+          (unsigned long long)reader.getMalformed(), (unsigned long long)reader.getSkippedBytes());
+
+  return 0;
+}